@@ -0,0 +1,124 @@
+#pragma once
+#include<atomic>
+#include<cstdint>
+#include<mutex>
+#include<vector>
+
+//Process-wide pool of equally sized byte buffers for file chunks.
+//Sending or receiving a chunk borrows a buffer whose pages are already mapped,
+//instead of allocating (and page faulting) a fresh block of a megabyte per chunk.
+//Buffers are returned when the request, or the last frame sharing its payload, is destroyed.
+//Any buffer of exactly BUFFER_CAPACITY is taken back, lent or not, so the pool keeps no record of single buffers
+//and a holder may drop a buffer, or grow it past its capacity, without leaving anything behind in the pool.
+class ftp_buffer_pool
+{
+public:
+	//room for a 1MB chunk and the fields packed in front of it
+	static constexpr std::size_t BUFFER_CAPACITY = 1024 * 1024 + 4096;
+	static constexpr std::size_t MIN_POOLED_SIZE = 64 * 1024;
+	static constexpr std::size_t MAX_POOLED_BUFFERS = 64;
+
+	using buffer = std::vector<unsigned char>;
+
+	struct pool_stats
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		//lent and not returned yet; buffers that were dropped or grown instead stay counted
+		int64_t outstanding = 0;
+		std::size_t pooled = 0;
+	};
+
+	static ftp_buffer_pool& Shared()
+	{
+		static ftp_buffer_pool pool;
+		return pool;
+	}
+
+	//smaller payloads are cheap to allocate and would waste a whole buffer
+	static bool IsChunkSized(std::size_t size)
+	{
+		return size >= MIN_POOLED_SIZE && size <= BUFFER_CAPACITY;
+	}
+
+	//Returns an empty buffer with BUFFER_CAPACITY bytes reserved.
+	buffer Acquire()
+	{
+		buffer borrowed;
+
+		{
+			std::lock_guard<std::mutex> pool_lock(m_pool_mutex);
+
+			if (!m_free_buffers.empty())
+			{
+				borrowed = std::move(m_free_buffers.back());
+				m_free_buffers.pop_back();
+			}
+		}
+
+		if (borrowed.capacity() > 0)
+			m_hits.fetch_add(1, std::memory_order_relaxed);
+
+		else
+		{
+			m_misses.fetch_add(1, std::memory_order_relaxed);
+			borrowed.reserve(BUFFER_CAPACITY);
+		}
+
+		m_lent.fetch_add(1, std::memory_order_relaxed);
+
+		return borrowed;
+	}
+
+	//Takes back buffers of exactly BUFFER_CAPACITY, anything else (ex. a buffer that was grown past its capacity)
+	//is left to be freed by the caller.
+	void Release(buffer&& returned)
+	{
+		if (!Owns(returned))
+			return;
+
+		//buffers that were never lent don't take the count below zero
+		auto lent = m_lent.load(std::memory_order_relaxed);
+		while (lent > 0 && !m_lent.compare_exchange_weak(lent, lent - 1, std::memory_order_relaxed));
+
+		returned.clear();
+
+		std::lock_guard<std::mutex> pool_lock(m_pool_mutex);
+
+		if (m_free_buffers.size() < MAX_POOLED_BUFFERS)
+			m_free_buffers.push_back(std::move(returned));
+	}
+
+	//Whether Release would take the buffer back.
+	static bool Owns(const buffer& candidate)
+	{
+		return candidate.capacity() == BUFFER_CAPACITY;
+	}
+
+	pool_stats GetStats()
+	{
+		pool_stats stats;
+		stats.hits = m_hits.load(std::memory_order_relaxed);
+		stats.misses = m_misses.load(std::memory_order_relaxed);
+
+		stats.outstanding = static_cast<int64_t>(m_lent.load(std::memory_order_relaxed));
+
+		std::lock_guard<std::mutex> pool_lock(m_pool_mutex);
+		stats.pooled = m_free_buffers.size();
+		return stats;
+	}
+
+private:
+	ftp_buffer_pool()
+	{
+		m_free_buffers.reserve(MAX_POOLED_BUFFERS);
+	}
+
+	std::mutex m_pool_mutex;
+	std::vector<buffer> m_free_buffers;
+	//lent and not returned yet
+	std::atomic<uint64_t> m_lent = 0;
+
+	std::atomic<uint64_t> m_hits = 0;
+	std::atomic<uint64_t> m_misses = 0;
+};
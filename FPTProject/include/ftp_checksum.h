@@ -0,0 +1,447 @@
+#pragma once
+#include<algorithm>
+#include<array>
+#include<cstdint>
+#include<cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include<nmmintrin.h>
+#if defined(_MSC_VER)
+#include<intrin.h>
+#define FTP_TARGET_SSE42
+#else
+#define FTP_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#define FTP_HAS_CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include<arm_acle.h>
+#define FTP_HAS_CRC32C_ARM 1
+#endif
+
+//CRC32C (Castagnoli) of a file chunk, carried in front of the chunk bytes so every chunk is checked on its own.
+//Uses the crc32 instructions of SSE4.2 or ARMv8 when the CPU has them, and slicing-by-8 tables otherwise.
+class ftp_crc32c
+{
+public:
+	//crc is the value returned for the previous bytes, so a chunk can be checksummed slice by slice.
+	static uint32_t Update(uint32_t crc, const unsigned char* data, std::size_t size)
+	{
+#if defined(FTP_HAS_CRC32C_X86)
+		if (HasHardwareSupport())
+			return UpdateHardware(crc, data, size);
+#elif defined(FTP_HAS_CRC32C_ARM)
+		return UpdateHardware(crc, data, size);
+#endif
+		return UpdateTables(crc, data, size);
+	}
+
+	static uint32_t Compute(const unsigned char* data, std::size_t size)
+	{
+		return Update(0, data, size);
+	}
+
+	static bool HasHardwareSupport()
+	{
+#if defined(FTP_HAS_CRC32C_X86)
+		static const bool has_sse42 = []() -> bool
+		{
+#if defined(_MSC_VER)
+			int cpu_info[4];
+			__cpuid(cpu_info, 1);
+			return (cpu_info[2] & (1 << 20)) != 0;
+#else
+			return __builtin_cpu_supports("sse4.2");
+#endif
+		}();
+
+		return has_sse42;
+#elif defined(FTP_HAS_CRC32C_ARM)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+private:
+	static constexpr uint32_t POLYNOMIAL = 0x82F63B78;
+
+	using crc_tables = std::array<std::array<uint32_t, 256>, 8>;
+
+	static const crc_tables& Tables()
+	{
+		static const crc_tables tables = []() -> crc_tables
+		{
+			crc_tables built{};
+
+			for (uint32_t byte = 0; byte < 256; ++byte)
+			{
+				uint32_t crc = byte;
+
+				for (int bit = 0; bit < 8; ++bit)
+					crc = (crc >> 1) ^ (POLYNOMIAL & (0u - (crc & 1)));
+
+				built[0][byte] = crc;
+			}
+
+			for (std::size_t table = 1; table < built.size(); ++table)
+			{
+				for (uint32_t byte = 0; byte < 256; ++byte)
+					built[table][byte] = (built[table - 1][byte] >> 8) ^ built[0][built[table - 1][byte] & 0xFF];
+			}
+
+			return built;
+		}();
+
+		return tables;
+	}
+
+	static uint32_t UpdateTables(uint32_t crc, const unsigned char* data, std::size_t size)
+	{
+		const auto& tables = Tables();
+		crc = ~crc;
+
+		while (size >= 8)
+		{
+			uint32_t low, high;
+			std::memcpy(&low, data, sizeof(low));
+			std::memcpy(&high, data + 4, sizeof(high));
+			low ^= crc;
+
+			crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24]
+				^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+
+			data += 8;
+			size -= 8;
+		}
+
+		while (size-- > 0)
+			crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+
+		return ~crc;
+	}
+
+#if defined(FTP_HAS_CRC32C_X86)
+	FTP_TARGET_SSE42 static uint32_t UpdateHardware(uint32_t crc, const unsigned char* data, std::size_t size)
+	{
+		uint64_t crc64 = ~crc;
+
+		while (size >= 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, data, sizeof(word));
+			crc64 = _mm_crc32_u64(crc64, word);
+
+			data += 8;
+			size -= 8;
+		}
+
+		auto crc32 = static_cast<uint32_t>(crc64);
+
+		while (size-- > 0)
+			crc32 = _mm_crc32_u8(crc32, *data++);
+
+		return ~crc32;
+	}
+#elif defined(FTP_HAS_CRC32C_ARM)
+	static uint32_t UpdateHardware(uint32_t crc, const unsigned char* data, std::size_t size)
+	{
+		crc = ~crc;
+
+		while (size >= 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, data, sizeof(word));
+			crc = __crc32cd(crc, word);
+
+			data += 8;
+			size -= 8;
+		}
+
+		while (size-- > 0)
+			crc = __crc32cb(crc, *data++);
+
+		return ~crc;
+	}
+#endif
+};
+
+
+//Streaming XXH64 of the bytes of a transfer, fed chunk by chunk in file order.
+//Sender and receiver compare their digests once the last chunk is through,
+//which also catches chunks that were lost, repeated or reordered on the way.
+class ftp_file_digest
+{
+public:
+	explicit ftp_file_digest(uint64_t seed = 0)
+		: m_lanes{ seed + PRIME_1 + PRIME_2, seed + PRIME_2, seed, seed - PRIME_1 }, m_seed(seed)
+	{}
+
+	void Update(const unsigned char* data, std::size_t size)
+	{
+		m_total_size += size;
+
+		//topping up the stripe left over from the previous update
+		if (m_buffered > 0)
+		{
+			const auto taken = std::min(size, STRIPE_SIZE - m_buffered);
+			std::memcpy(m_stripe + m_buffered, data, taken);
+			m_buffered += taken;
+			data += taken;
+			size -= taken;
+
+			if (m_buffered < STRIPE_SIZE)
+				return;
+
+			ConsumeStripe(m_stripe);
+			m_buffered = 0;
+		}
+
+		while (size >= STRIPE_SIZE)
+		{
+			ConsumeStripe(data);
+			data += STRIPE_SIZE;
+			size -= STRIPE_SIZE;
+		}
+
+		std::memcpy(m_stripe, data, size);
+		m_buffered = size;
+	}
+
+	//Digest of everything fed so far, more bytes can still be added afterwards.
+	uint64_t Value() const
+	{
+		uint64_t hash;
+
+		if (m_total_size >= STRIPE_SIZE)
+		{
+			hash = RotateLeft(m_lanes[0], 1) + RotateLeft(m_lanes[1], 7) + RotateLeft(m_lanes[2], 12) + RotateLeft(m_lanes[3], 18);
+
+			for (const auto lane : m_lanes)
+				hash = (hash ^ Round(0, lane)) * PRIME_1 + PRIME_4;
+		}
+		else
+			hash = m_seed + PRIME_5;
+
+		hash += m_total_size;
+
+		const unsigned char* tail = m_stripe;
+		std::size_t tail_size = m_buffered;
+
+		while (tail_size >= 8)
+		{
+			hash ^= Round(0, Read64(tail));
+			hash = RotateLeft(hash, 27) * PRIME_1 + PRIME_4;
+			tail += 8;
+			tail_size -= 8;
+		}
+
+		if (tail_size >= 4)
+		{
+			uint32_t word;
+			std::memcpy(&word, tail, sizeof(word));
+			hash ^= word * PRIME_1;
+			hash = RotateLeft(hash, 23) * PRIME_2 + PRIME_3;
+			tail += 4;
+			tail_size -= 4;
+		}
+
+		while (tail_size-- > 0)
+		{
+			hash ^= *tail++ * PRIME_5;
+			hash = RotateLeft(hash, 11) * PRIME_1;
+		}
+
+		hash ^= hash >> 33;
+		hash *= PRIME_2;
+		hash ^= hash >> 29;
+		hash *= PRIME_3;
+		hash ^= hash >> 32;
+		return hash;
+	}
+
+	uint64_t Size() const
+	{
+		return m_total_size;
+	}
+
+private:
+	static constexpr uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL;
+	static constexpr uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+	static constexpr uint64_t PRIME_3 = 0x165667B19E3779F9ULL;
+	static constexpr uint64_t PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+	static constexpr uint64_t PRIME_5 = 0x27D4EB2F165667C5ULL;
+	static constexpr std::size_t STRIPE_SIZE = 32;
+
+	uint64_t m_lanes[4];
+	uint64_t m_seed;
+	uint64_t m_total_size = 0;
+	unsigned char m_stripe[STRIPE_SIZE];
+	std::size_t m_buffered = 0;
+
+	static uint64_t RotateLeft(uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	static uint64_t Read64(const unsigned char* data)
+	{
+		uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		return word;
+	}
+
+	static uint64_t Round(uint64_t lane, uint64_t input)
+	{
+		lane += input * PRIME_2;
+		return RotateLeft(lane, 31) * PRIME_1;
+	}
+
+	void ConsumeStripe(const unsigned char* stripe)
+	{
+		for (std::size_t lane = 0; lane < 4; ++lane)
+			m_lanes[lane] = Round(m_lanes[lane], Read64(stripe + lane * 8));
+	}
+};
+
+
+//SHA-256, names chunks in the server's content-addressed chunk store, see ftp_chunk_store.
+//Unlike the digests above it has to hold up against chunks crafted to collide.
+class ftp_sha256
+{
+public:
+	using hash = std::array<unsigned char, 32>;
+
+	static hash Compute(const unsigned char* data, std::size_t size)
+	{
+		ftp_sha256 hasher;
+		hasher.Update(data, size);
+		return hasher.Value();
+	}
+
+	void Update(const unsigned char* data, std::size_t size)
+	{
+		m_total_size += size;
+
+		if (m_buffered > 0)
+		{
+			const auto taken = std::min(size, BLOCK_SIZE - m_buffered);
+			std::memcpy(m_block + m_buffered, data, taken);
+			m_buffered += taken;
+			data += taken;
+			size -= taken;
+
+			if (m_buffered < BLOCK_SIZE)
+				return;
+
+			ConsumeBlock(m_block);
+			m_buffered = 0;
+		}
+
+		while (size >= BLOCK_SIZE)
+		{
+			ConsumeBlock(data);
+			data += BLOCK_SIZE;
+			size -= BLOCK_SIZE;
+		}
+
+		std::memcpy(m_block, data, size);
+		m_buffered = size;
+	}
+
+	hash Value() const
+	{
+		auto finished = *this;
+		const uint64_t bit_size = m_total_size * 8;
+
+		const unsigned char padding_start = 0x80;
+		finished.Update(&padding_start, 1);
+
+		const unsigned char zero = 0;
+		while (finished.m_buffered != BLOCK_SIZE - sizeof(bit_size))
+			finished.Update(&zero, 1);
+
+		unsigned char size_bytes[sizeof(bit_size)];
+		for (std::size_t i = 0; i < sizeof(bit_size); ++i)
+			size_bytes[i] = static_cast<unsigned char>(bit_size >> (56 - 8 * i));
+
+		finished.Update(size_bytes, sizeof(size_bytes));
+
+		hash value;
+		for (std::size_t i = 0; i < 8; ++i)
+		{
+			for (std::size_t byte = 0; byte < 4; ++byte)
+				value[i * 4 + byte] = static_cast<unsigned char>(finished.m_state[i] >> (24 - 8 * byte));
+		}
+
+		return value;
+	}
+
+private:
+	static constexpr std::size_t BLOCK_SIZE = 64;
+
+	uint32_t m_state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	uint64_t m_total_size = 0;
+	unsigned char m_block[BLOCK_SIZE];
+	std::size_t m_buffered = 0;
+
+	static uint32_t RotateRight(uint32_t value, int bits)
+	{
+		return (value >> bits) | (value << (32 - bits));
+	}
+
+	void ConsumeBlock(const unsigned char* block)
+	{
+		static constexpr uint32_t ROUND_CONSTANTS[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+		uint32_t schedule[64];
+
+		for (std::size_t i = 0; i < 16; ++i)
+		{
+			schedule[i] = static_cast<uint32_t>(block[i * 4]) << 24 | static_cast<uint32_t>(block[i * 4 + 1]) << 16
+				| static_cast<uint32_t>(block[i * 4 + 2]) << 8 | static_cast<uint32_t>(block[i * 4 + 3]);
+		}
+
+		for (std::size_t i = 16; i < 64; ++i)
+		{
+			const auto s0 = RotateRight(schedule[i - 15], 7) ^ RotateRight(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+			const auto s1 = RotateRight(schedule[i - 2], 17) ^ RotateRight(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+			schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+		}
+
+		uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+		uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+		for (std::size_t i = 0; i < 64; ++i)
+		{
+			const auto t1 = h + (RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25)) + ((e & f) ^ (~e & g)) + ROUND_CONSTANTS[i] + schedule[i];
+			const auto t2 = (RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		m_state[0] += a;
+		m_state[1] += b;
+		m_state[2] += c;
+		m_state[3] += d;
+		m_state[4] += e;
+		m_state[5] += f;
+		m_state[6] += g;
+		m_state[7] += h;
+	}
+};
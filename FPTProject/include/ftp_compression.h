@@ -0,0 +1,198 @@
+#pragma once
+#include<algorithm>
+#include<cstdint>
+#include<cstring>
+#include<memory>
+
+//Codecs are opt-in, define FTP_WITH_ZSTD and/or FTP_WITH_LZ4 and link libzstd/liblz4
+//(-lzstd -llz4, or the FtpWithZstd/FtpWithLz4 properties of the Visual Studio projects).
+#if defined(FTP_WITH_ZSTD)
+#include<zstd.h>
+#define FTP_HAS_ZSTD 1
+#endif
+
+#if defined(FTP_WITH_LZ4)
+#include<lz4.h>
+#define FTP_HAS_LZ4 1
+#endif
+
+//Codec a frame's payload is compressed with, NONE for raw frames, see ftp_request_header.
+enum class ftp_compression : uint32_t
+{
+	NONE,
+	LZ4,
+	ZSTD
+};
+
+//Compression of file chunks. Both ends offer the codecs they were built with when a data connection is opened
+//and the best common one is used for every chunk sent on it, see ftp_connection::OfferCompression.
+//A chunk is only compressed when a few samples spread over it compress well,
+//so already compressed files (media, archives) are sent raw and cost no more than a few small sample reads.
+class ftp_chunk_codec
+{
+public:
+	static constexpr std::size_t SAMPLE_COUNT = 4;
+	static constexpr std::size_t SAMPLE_SIZE = 4 * 1024;
+
+	//payloads that do not shrink at least by 1/8 are not worth decompressing on the other side
+	static constexpr std::size_t MIN_SAVING_DIVISOR = 8;
+
+	//larger chunks are never sent, a bigger announced size means a corrupt or hostile frame
+	static constexpr uint64_t MAX_DECOMPRESSED_SIZE = 16 * 1024 * 1024;
+
+	//raw size prefix and a payload that is never larger than the raw bytes, see ftp_request::Compress
+	static constexpr uint64_t MAX_COMPRESSED_FRAME_SIZE = sizeof(uint64_t) + MAX_DECOMPRESSED_SIZE;
+
+	static constexpr int ZSTD_LEVEL = 1;
+
+	//Bit (1 << codec) is set for every codec this build can compress and decompress.
+	static uint32_t SupportedCodecs()
+	{
+		uint32_t codecs = 0;
+
+#if defined(FTP_HAS_LZ4)
+		codecs |= CodecBit(ftp_compression::LZ4);
+#endif
+#if defined(FTP_HAS_ZSTD)
+		codecs |= CodecBit(ftp_compression::ZSTD);
+#endif
+
+		return codecs;
+	}
+
+	static uint32_t CodecBit(ftp_compression codec)
+	{
+		return 1u << static_cast<uint32_t>(codec);
+	}
+
+	//zstd compresses better at a similar speed, links are the bottleneck rather than the CPU
+	static ftp_compression Negotiate(uint32_t offered_codecs)
+	{
+		const auto common_codecs = offered_codecs & SupportedCodecs();
+
+		if (common_codecs & CodecBit(ftp_compression::ZSTD))
+			return ftp_compression::ZSTD;
+
+		if (common_codecs & CodecBit(ftp_compression::LZ4))
+			return ftp_compression::LZ4;
+
+		return ftp_compression::NONE;
+	}
+
+	static const char* Name(ftp_compression codec)
+	{
+		switch (codec)
+		{
+		case ftp_compression::LZ4:
+			return "lz4";
+
+		case ftp_compression::ZSTD:
+			return "zstd";
+
+		default:
+			return "none";
+		}
+	}
+
+	//Payload bytes that have to be saved for a compressed payload of size bytes to be sent.
+	static std::size_t CompressedLimit(std::size_t size)
+	{
+		return size - size / MIN_SAVING_DIVISOR;
+	}
+
+	//Compresses SAMPLE_COUNT samples spread over a chunk of chunk_size bytes.
+	//read_sample(dest, offset, length) copies the given bytes of the chunk to dest and returns how many were copied.
+	template<class ReadSample>
+	static bool LooksCompressible(ftp_compression codec, std::size_t chunk_size, ReadSample read_sample)
+	{
+		if (codec == ftp_compression::NONE)
+			return false;
+
+		//small chunks are simply compressed whole
+		if (chunk_size <= 2 * SAMPLE_COUNT * SAMPLE_SIZE)
+			return true;
+
+		unsigned char samples[SAMPLE_COUNT * SAMPLE_SIZE];
+		std::size_t sampled = 0;
+
+		for (std::size_t i = 0; i < SAMPLE_COUNT; ++i)
+		{
+			const auto sample_offset = (chunk_size - SAMPLE_SIZE) / (SAMPLE_COUNT - 1) * i;
+			sampled += read_sample(samples + sampled, sample_offset, SAMPLE_SIZE);
+		}
+
+		unsigned char compressed[SAMPLE_COUNT * SAMPLE_SIZE];
+		return CompressBytes(codec, samples, sampled, compressed, CompressedLimit(sampled)) > 0;
+	}
+
+	static bool LooksCompressible(ftp_compression codec, const unsigned char* chunk, std::size_t chunk_size)
+	{
+		return LooksCompressible(codec, chunk_size,
+			[chunk](unsigned char* dest, std::size_t offset, std::size_t length) -> std::size_t
+			{
+				std::memcpy(dest, chunk + offset, length);
+				return length;
+			});
+	}
+
+	//Returns the compressed size, or 0 when the codec failed or the output did not fit in dest_capacity.
+	static std::size_t CompressBytes(ftp_compression codec, [[maybe_unused]] const unsigned char* src, [[maybe_unused]] std::size_t size,
+		[[maybe_unused]] unsigned char* dest, [[maybe_unused]] std::size_t dest_capacity)
+	{
+		switch (codec)
+		{
+#if defined(FTP_HAS_LZ4)
+		case ftp_compression::LZ4:
+			{
+			const auto compressed = LZ4_compress_default(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dest),
+				static_cast<int>(size), static_cast<int>(dest_capacity));
+
+			return compressed > 0 ? static_cast<std::size_t>(compressed) : 0;
+			}
+#endif
+#if defined(FTP_HAS_ZSTD)
+		case ftp_compression::ZSTD:
+			{
+			//contexts are reused, creating one per chunk costs more than compressing it
+			thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> compress_context(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+
+			const auto compressed = ZSTD_compressCCtx(compress_context.get(), dest, dest_capacity, src, size, ZSTD_LEVEL);
+
+			return ZSTD_isError(compressed) ? 0 : compressed;
+			}
+#endif
+		default:
+			return 0;
+		}
+	}
+
+	//Returns false unless exactly dest_size bytes were decompressed.
+	static bool DecompressBytes(ftp_compression codec, [[maybe_unused]] const unsigned char* src, [[maybe_unused]] std::size_t size,
+		[[maybe_unused]] unsigned char* dest, [[maybe_unused]] std::size_t dest_size)
+	{
+		switch (codec)
+		{
+#if defined(FTP_HAS_LZ4)
+		case ftp_compression::LZ4:
+			{
+			const auto decompressed = LZ4_decompress_safe(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dest),
+				static_cast<int>(size), static_cast<int>(dest_size));
+
+			return decompressed >= 0 && static_cast<std::size_t>(decompressed) == dest_size;
+			}
+#endif
+#if defined(FTP_HAS_ZSTD)
+		case ftp_compression::ZSTD:
+			{
+			thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> decompress_context(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+
+			const auto decompressed = ZSTD_decompressDCtx(decompress_context.get(), dest, dest_size, src, size);
+
+			return !ZSTD_isError(decompressed) && decompressed == dest_size;
+			}
+#endif
+		default:
+			return false;
+		}
+	}
+};
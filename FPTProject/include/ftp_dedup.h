@@ -0,0 +1,233 @@
+#pragma once
+#include<algorithm>
+#include<array>
+#include<atomic>
+#include<cstdint>
+#include<filesystem>
+#include<fstream>
+#include<string>
+#include<vector>
+#include"ftp_checksum.h"
+
+//Content-defined chunking (FastCDC with normalized chunking).
+//Cut points depend only on the bytes around them, so inserting or removing bytes in a file
+//changes the chunks around the edit and leaves every other chunk, and its hash, as it was.
+//Uploads send the hashes first and then only the chunks the server's ftp_chunk_store is missing.
+class ftp_cdc
+{
+public:
+	static constexpr std::size_t MIN_CHUNK_SIZE = 16 * 1024;
+	static constexpr std::size_t AVG_CHUNK_SIZE = 64 * 1024;
+	static constexpr std::size_t MAX_CHUNK_SIZE = 256 * 1024;
+
+	struct chunk
+	{
+		ftp_sha256::hash hash;
+		uint64_t offset = 0;
+		uint32_t length = 0;
+	};
+
+	//Length of the chunk at the start of data, size is the number of bytes available.
+	//Fewer than MAX_CHUNK_SIZE bytes are only ever passed for the end of the file.
+	static std::size_t NextChunkLength(const unsigned char* data, std::size_t size)
+	{
+		if (size <= MIN_CHUNK_SIZE)
+			return size;
+
+		const auto max_length = std::min(size, MAX_CHUNK_SIZE);
+		const auto normal_length = std::min(max_length, AVG_CHUNK_SIZE);
+		const auto& gear = GearTable();
+
+		uint64_t fingerprint = 0;
+		std::size_t i = MIN_CHUNK_SIZE;
+
+		//below the average size cuts are harder to hit and above it easier, so chunk sizes gather around the average
+		for (; i < normal_length; ++i)
+		{
+			fingerprint = (fingerprint << 1) + gear[data[i]];
+
+			if ((fingerprint & MASK_SMALL) == 0)
+				return i + 1;
+		}
+
+		for (; i < max_length; ++i)
+		{
+			fingerprint = (fingerprint << 1) + gear[data[i]];
+
+			if ((fingerprint & MASK_LARGE) == 0)
+				return i + 1;
+		}
+
+		return max_length;
+	}
+
+	//Splits the whole stream into chunks and hashes every one of them.
+	static std::vector<chunk> Split(std::istream& src)
+	{
+		std::vector<chunk> chunks;
+		std::vector<unsigned char> window(READ_SIZE + MAX_CHUNK_SIZE);
+		std::size_t window_start = 0;
+		std::size_t window_end = 0;
+		uint64_t offset = 0;
+		bool end_of_file = false;
+
+		while (true)
+		{
+			//keeps at least MAX_CHUNK_SIZE bytes ahead, a shorter tail means the end of the file
+			if (!end_of_file && window_end - window_start < MAX_CHUNK_SIZE)
+			{
+				std::copy(window.begin() + window_start, window.begin() + window_end, window.begin());
+				window_end -= window_start;
+				window_start = 0;
+
+				src.read(reinterpret_cast<char*>(window.data() + window_end), window.size() - window_end);
+				window_end += static_cast<std::size_t>(src.gcount());
+				end_of_file = !src;
+			}
+
+			if (window_start == window_end)
+				break;
+
+			const auto chunk_length = NextChunkLength(window.data() + window_start, window_end - window_start);
+
+			chunk next_chunk;
+			next_chunk.hash = ftp_sha256::Compute(window.data() + window_start, chunk_length);
+			next_chunk.offset = offset;
+			next_chunk.length = static_cast<uint32_t>(chunk_length);
+			chunks.push_back(next_chunk);
+
+			window_start += chunk_length;
+			offset += chunk_length;
+		}
+
+		return chunks;
+	}
+
+private:
+	static constexpr std::size_t READ_SIZE = 4 * 1024 * 1024;
+
+	//the fingerprint's top bits depend on its last 64 bytes, 2 bits more (less) than the average needs
+	static constexpr uint64_t MASK_SMALL = ~0ull << (64 - 18);
+	static constexpr uint64_t MASK_LARGE = ~0ull << (64 - 14);
+
+	//Random value per byte value. It has to be the same in every build, or the same file would be split differently.
+	static const std::array<uint64_t, 256>& GearTable()
+	{
+		static const std::array<uint64_t, 256> gear = []() -> std::array<uint64_t, 256>
+		{
+			std::array<uint64_t, 256> table;
+			uint64_t state = 0x46545043444331ull;
+
+			//splitmix64
+			for (auto& entry : table)
+			{
+				state += 0x9E3779B97F4A7C15ull;
+				uint64_t value = state;
+				value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+				value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+				entry = value ^ (value >> 31);
+			}
+
+			return table;
+		}();
+
+		return gear;
+	}
+};
+
+
+//Chunks of uploaded files, stored once under their SHA-256 in root/ab/abcdef...
+//Chunks are only ever added. Each is written to a temporary file and renamed into place,
+//so concurrent writers of the same chunk and readers never see a partial chunk.
+class ftp_chunk_store
+{
+public:
+	static constexpr const char* DIRECTORY_NAME = ".chunks";
+
+	explicit ftp_chunk_store(const std::string& parent_path)
+		: m_root((std::filesystem::path(parent_path) / DIRECTORY_NAME).lexically_normal())
+	{}
+
+	const std::filesystem::path& Root() const
+	{
+		return m_root;
+	}
+
+	bool Contains(const ftp_sha256::hash& chunk_hash) const
+	{
+		std::error_code ec;
+		return std::filesystem::exists(ChunkPath(chunk_hash), ec);
+	}
+
+	//Returns false when the bytes don't hash to chunk_hash or could not be stored.
+	bool Put(const ftp_sha256::hash& chunk_hash, const unsigned char* data, std::size_t size)
+	{
+		if (ftp_sha256::Compute(data, size) != chunk_hash)
+			return false;
+
+		if (Contains(chunk_hash))
+			return true;
+
+		const auto chunk_path = ChunkPath(chunk_hash);
+
+		std::error_code ec;
+		std::filesystem::create_directories(chunk_path.parent_path(), ec);
+
+		auto temporary_path = chunk_path;
+		temporary_path += "." + std::to_string(m_temporary_counter++) + ".tmp";
+
+		{
+			std::ofstream chunk_file(temporary_path, std::ios::binary | std::ios::trunc);
+			chunk_file.write(reinterpret_cast<const char*>(data), size);
+
+			if (!chunk_file)
+			{
+				chunk_file.close();
+				std::filesystem::remove(temporary_path, ec);
+				return false;
+			}
+		}
+
+		std::filesystem::rename(temporary_path, chunk_path, ec);
+
+		if (ec)
+			std::filesystem::remove(temporary_path, ec);
+
+		return Contains(chunk_hash);
+	}
+
+	//Appends the chunk to dest. Returns false unless exactly length bytes were copied.
+	bool CopyTo(const ftp_sha256::hash& chunk_hash, uint32_t length, std::ostream& dest, std::vector<unsigned char>& buffer) const
+	{
+		std::ifstream chunk_file(ChunkPath(chunk_hash), std::ios::binary);
+
+		buffer.resize(length);
+		chunk_file.read(reinterpret_cast<char*>(buffer.data()), length);
+
+		if (static_cast<std::size_t>(chunk_file.gcount()) != length || chunk_file.peek() != std::ifstream::traits_type::eof())
+			return false;
+
+		dest.write(reinterpret_cast<const char*>(buffer.data()), length);
+		return static_cast<bool>(dest);
+	}
+
+private:
+	std::filesystem::path m_root;
+	std::atomic<uint64_t> m_temporary_counter = 0;
+
+	std::filesystem::path ChunkPath(const ftp_sha256::hash& chunk_hash) const
+	{
+		static constexpr char HEX_DIGITS[] = "0123456789abcdef";
+
+		std::string hex_name;
+		hex_name.reserve(chunk_hash.size() * 2);
+
+		for (const auto byte : chunk_hash)
+		{
+			hex_name += HEX_DIGITS[byte >> 4];
+			hex_name += HEX_DIGITS[byte & 0x0F];
+		}
+
+		return m_root / hex_name.substr(0, 2) / hex_name;
+	}
+};
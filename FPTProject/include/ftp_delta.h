@@ -0,0 +1,272 @@
+#pragma once
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<istream>
+#include<unordered_map>
+#include<vector>
+#include"ftp_checksum.h"
+
+//rsync style delta of a local file against a remote copy of an older version of it.
+//The side that has the old copy sends a signature per block of it: a weak checksum that can be rolled
+//one byte at a time and a strong hash to confirm matches. The other side looks for those blocks at every
+//offset of the new file and describes it as copies of old blocks and literal ranges of the new file,
+//so only the literal bytes have to be sent, see UPLOAD_DELTA.
+class ftp_delta
+{
+public:
+	static constexpr std::size_t MIN_BLOCK_SIZE = 2 * 1024;
+	static constexpr std::size_t MAX_BLOCK_SIZE = 256 * 1024;
+
+	//source_block of instructions whose bytes are sent rather than copied
+	static constexpr uint32_t LITERAL = 0xFFFFFFFF;
+
+	struct block_signature
+	{
+		uint32_t weak = 0;
+		uint64_t strong = 0;
+	};
+
+	//length bytes copied from the old file starting at block source_block, or length literal bytes
+	struct instruction
+	{
+		uint32_t source_block = LITERAL;
+		uint64_t length = 0;
+	};
+
+	struct delta
+	{
+		std::vector<instruction> instructions;
+		uint64_t literal_size = 0;
+		//of the whole new file, checked after the delta was applied
+		uint64_t file_digest = 0;
+	};
+
+	//Rolling checksum of a block, as in rsync: a is the sum of the bytes, b the sum of the running sums.
+	class rolling_checksum
+	{
+	public:
+		void Reset(const unsigned char* block, std::size_t length)
+		{
+			m_a = 0;
+			m_b = 0;
+			m_length = static_cast<uint32_t>(length);
+
+			for (std::size_t i = 0; i < length; ++i)
+			{
+				m_a += block[i];
+				m_b += m_a;
+			}
+		}
+
+		//Moves the block one byte forward, dropping out_byte and taking in_byte.
+		void Roll(unsigned char out_byte, unsigned char in_byte)
+		{
+			m_a += in_byte - out_byte;
+			m_b += m_a - m_length * out_byte;
+		}
+
+		uint32_t Value() const
+		{
+			return (m_a & 0xFFFF) | (m_b << 16);
+		}
+
+	private:
+		uint32_t m_a = 0;
+		uint32_t m_b = 0;
+		uint32_t m_length = 0;
+	};
+
+	//About the square root of the file size, so the signatures and the bytes a changed block costs grow alike.
+	static uint32_t BlockSize(uint64_t file_size)
+	{
+		const auto block_size = static_cast<std::size_t>(std::sqrt(static_cast<double>(file_size)));
+
+		//multiple of 1KB
+		return static_cast<uint32_t>(std::clamp<std::size_t>((block_size + 1023) & ~std::size_t(1023), MIN_BLOCK_SIZE, MAX_BLOCK_SIZE));
+	}
+
+	static uint64_t StrongHash(const unsigned char* block, std::size_t length)
+	{
+		ftp_file_digest block_digest;
+		block_digest.Update(block, length);
+		return block_digest.Value();
+	}
+
+	static std::vector<block_signature> Signatures(std::istream& src, uint32_t block_size)
+	{
+		std::vector<block_signature> signatures;
+		std::vector<unsigned char> block(block_size);
+		rolling_checksum weak_checksum;
+
+		while (src.read(reinterpret_cast<char*>(block.data()), block_size) || src.gcount() > 0)
+		{
+			const auto length = static_cast<std::size_t>(src.gcount());
+
+			weak_checksum.Reset(block.data(), length);
+			signatures.push_back({ weak_checksum.Value(), StrongHash(block.data(), length) });
+		}
+
+		return signatures;
+	}
+
+	//Describes the file read from src with the blocks of the old copy whose signatures are given.
+	static delta Compute(std::istream& src, uint32_t block_size, const std::vector<block_signature>& signatures)
+	{
+		//most offsets match no block, the filter rules them out before the map is searched
+		std::vector<bool> weak_filter(FILTER_SIZE);
+		std::unordered_multimap<uint32_t, uint32_t> blocks_by_weak;
+		blocks_by_weak.reserve(signatures.size());
+
+		for (uint32_t block_index = 0; block_index < signatures.size(); ++block_index)
+		{
+			weak_filter[FilterSlot(signatures[block_index].weak)] = true;
+			blocks_by_weak.insert({ signatures[block_index].weak, block_index });
+		}
+
+		delta file_delta;
+		ftp_file_digest file_digest;
+
+		std::vector<unsigned char> window(READ_SIZE + block_size);
+		std::size_t window_start = 0;
+		std::size_t window_end = 0;
+		//file offset of window[0]
+		uint64_t window_offset = 0;
+		uint64_t literal_start = 0;
+		bool end_of_file = false;
+
+		rolling_checksum weak_checksum;
+		bool checksum_valid = false;
+
+		while (true)
+		{
+			//keeps a block and the byte after it ahead, unless the file ends sooner
+			if (!end_of_file && window_end - window_start <= block_size)
+			{
+				std::copy(window.begin() + window_start, window.begin() + window_end, window.begin());
+				window_offset += window_start;
+				window_end -= window_start;
+				window_start = 0;
+
+				src.read(reinterpret_cast<char*>(window.data() + window_end), window.size() - window_end);
+				const auto read_size = static_cast<std::size_t>(src.gcount());
+
+				file_digest.Update(window.data() + window_end, read_size);
+				window_end += read_size;
+				end_of_file = !src;
+			}
+
+			//without an old copy every byte is a literal, the file is only read for its digest
+			if (signatures.empty())
+			{
+				window_start = window_end;
+
+				if (end_of_file)
+					break;
+
+				continue;
+			}
+
+			//a tail shorter than a block is sent as it is
+			if (window_end - window_start < block_size)
+				break;
+
+			const auto* block = window.data() + window_start;
+
+			if (!checksum_valid)
+			{
+				weak_checksum.Reset(block, block_size);
+				checksum_valid = true;
+			}
+
+			const auto block_offset = window_offset + window_start;
+			const auto weak = weak_checksum.Value();
+
+			if (weak_filter[FilterSlot(weak)])
+			{
+				const auto matched_block = FindBlock(blocks_by_weak, signatures, weak, block, block_size);
+
+				if (matched_block != LITERAL)
+				{
+					AddLiteral(file_delta, block_offset - literal_start);
+					AddCopy(file_delta, matched_block, block_size);
+
+					window_start += block_size;
+					literal_start = block_offset + block_size;
+					checksum_valid = false;
+					continue;
+				}
+			}
+
+			if (window_end - window_start == block_size)
+				break;
+
+			weak_checksum.Roll(block[0], block[block_size]);
+			window_start++;
+		}
+
+		AddLiteral(file_delta, window_offset + window_end - literal_start);
+
+		file_delta.file_digest = file_digest.Value();
+		return file_delta;
+	}
+
+private:
+	static constexpr std::size_t READ_SIZE = 4 * 1024 * 1024;
+	static constexpr std::size_t FILTER_SIZE = 1 << 20;
+
+	static std::size_t FilterSlot(uint32_t weak)
+	{
+		return (weak * 0x9E3779B1u) >> 12;
+	}
+
+	static uint32_t FindBlock(const std::unordered_multimap<uint32_t, uint32_t>& blocks_by_weak, const std::vector<block_signature>& signatures,
+		uint32_t weak, const unsigned char* block, uint32_t block_size)
+	{
+		const auto [candidates_begin, candidates_end] = blocks_by_weak.equal_range(weak);
+
+		if (candidates_begin == candidates_end)
+			return LITERAL;
+
+		const auto strong = StrongHash(block, block_size);
+
+		for (auto candidate = candidates_begin; candidate != candidates_end; ++candidate)
+		{
+			if (signatures[candidate->second].strong == strong)
+				return candidate->second;
+		}
+
+		return LITERAL;
+	}
+
+	static void AddLiteral(delta& file_delta, uint64_t length)
+	{
+		if (length == 0)
+			return;
+
+		file_delta.literal_size += length;
+
+		if (!file_delta.instructions.empty() && file_delta.instructions.back().source_block == LITERAL)
+			file_delta.instructions.back().length += length;
+		else
+			file_delta.instructions.push_back({ LITERAL, length });
+	}
+
+	//blocks that follow each other in the old file are copied with one instruction
+	static void AddCopy(delta& file_delta, uint32_t block_index, uint32_t block_size)
+	{
+		if (!file_delta.instructions.empty())
+		{
+			auto& previous = file_delta.instructions.back();
+
+			if (previous.source_block != LITERAL && previous.length % block_size == 0
+				&& previous.source_block + previous.length / block_size == block_index)
+			{
+				previous.length += block_size;
+				return;
+			}
+		}
+
+		file_delta.instructions.push_back({ block_index, block_size });
+	}
+};
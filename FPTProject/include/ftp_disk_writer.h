@@ -0,0 +1,370 @@
+#pragma once
+#include<algorithm>
+#include<atomic>
+#include<chrono>
+#include<fstream>
+#include<functional>
+#include<iostream>
+#include<limits>
+#include<memory>
+#include<string>
+#include<thread>
+#include<vector>
+#include"ftp_buffer_pool.h"
+#include"ftp_file_handle.h"
+#include"ftp_io_uring.h"
+#include"ftp_mpsc_queue.h"
+
+//Disk stage of uploads. Writes, truncations and renames of received files run on a few writer threads,
+//so neither the io threads nor the request dispatcher wait for the disk while the writers keep up.
+//Operations are keyed by the path of the file they touch (see Key), so every operation on a file, whichever
+//upload it belongs to, goes to the same writer and happens in the order it was submitted.
+//Every writer has a bounded queue. A producer facing a full one is blocked like on the request queue:
+//an io thread then stops serving every connection it runs, not only the one sending to the slow disk.
+//Where io_uring is available, every writer has its own ring: the positional writes a writer drains together
+//are submitted with one system call and run in parallel in the kernel, the writer waits for all of them
+//before it runs anything else, so ordering within a file is kept. A writer whose ring fails to submit
+//gives it up for good and writes with pwrite from then on.
+class ftp_disk_writer
+{
+public:
+	static constexpr std::size_t QUEUE_CAPACITY = 64;
+	static constexpr std::size_t MAX_DRAIN_BATCH = 16;
+
+	struct writer_stats
+	{
+		//submitted and not done yet, over all writers
+		std::size_t queue_depth = 0;
+		uint64_t writes = 0;
+		uint64_t bytes_written = 0;
+		std::chrono::microseconds average_write_latency{ 0 };
+		std::chrono::microseconds max_write_latency{ 0 };
+		//time tasks waited in the queue before a writer got to them
+		std::chrono::microseconds average_queue_delay{ 0 };
+	};
+
+	explicit ftp_disk_writer(std::size_t writer_count = 2)
+	{
+		for (std::size_t i = 0; i < std::max<std::size_t>(writer_count, 1); ++i)
+		{
+			m_writers.push_back(std::make_unique<writer>());
+			m_writers.back()->ring = ftp_io_uring::Create(MAX_DRAIN_BATCH);
+		}
+
+		m_uses_io_uring = m_writers.front()->ring != nullptr;
+
+		for (auto& curr_writer : m_writers)
+		{
+			curr_writer->thread = std::thread(
+				[this, target = curr_writer.get()]() -> void
+				{
+					RunWriter(*target);
+				});
+		}
+	}
+
+	~ftp_disk_writer()
+	{
+		Stop();
+	}
+
+	ftp_disk_writer(const ftp_disk_writer&) = delete;
+	ftp_disk_writer& operator=(const ftp_disk_writer&) = delete;
+
+	static unsigned int Key(const std::string& file_path)
+	{
+		return static_cast<unsigned int>(std::hash<std::string>{}(file_path));
+	}
+
+	//Appends bytes, a buffer borrowed from ftp_buffer_pool, to the file. The buffer goes back to the pool once written.
+	void Write(unsigned int writer_key, std::shared_ptr<std::ofstream> file_dest, ftp_buffer_pool::buffer&& bytes)
+	{
+		const auto length = bytes.size();
+
+		task write_task;
+		write_task.bytes = length;
+		write_task.run = [file_dest = std::move(file_dest), bytes = std::move(bytes)]() mutable -> void
+		{
+			file_dest->write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+			ftp_buffer_pool::Shared().Release(std::move(bytes));
+		};
+
+		Enqueue(writer_key, std::move(write_task));
+	}
+
+	//Writes bytes at offset through a handle from ftp_file_handle::OpenForWrite, with io_uring where the writer has it.
+	//The buffer goes back to the pool once written.
+	void Write(unsigned int writer_key, std::shared_ptr<ftp_file_handle> file_handle, uint64_t offset, ftp_buffer_pool::buffer&& bytes)
+	{
+		task write_task;
+		write_task.bytes = bytes.size();
+		write_task.file_handle = std::move(file_handle);
+		write_task.offset = offset;
+		write_task.write_bytes = std::move(bytes);
+
+		Enqueue(writer_key, std::move(write_task));
+	}
+
+	//Positional writes are worth opening handles for only when they go through io_uring.
+	bool UsesIoUring() const
+	{
+		return m_uses_io_uring;
+	}
+
+	//Runs operation behind the ones already submitted for the file, ex. closing and renaming it once it is complete.
+	void Submit(unsigned int writer_key, std::function<void()> operation)
+	{
+		task submitted_task;
+		submitted_task.run = std::move(operation);
+
+		Enqueue(writer_key, std::move(submitted_task));
+	}
+
+	writer_stats GetStats() const
+	{
+		writer_stats stats;
+		stats.queue_depth = m_queue_depth.load(std::memory_order_relaxed);
+		stats.writes = m_writes.load(std::memory_order_relaxed);
+		stats.bytes_written = m_bytes_written.load(std::memory_order_relaxed);
+		stats.max_write_latency = std::chrono::microseconds(m_max_write_time.load(std::memory_order_relaxed));
+
+		if (stats.writes > 0)
+			stats.average_write_latency = std::chrono::microseconds(m_write_time.load(std::memory_order_relaxed) / stats.writes);
+
+		if (const auto tasks_done = m_tasks_done.load(std::memory_order_relaxed); tasks_done > 0)
+			stats.average_queue_delay = std::chrono::microseconds(m_queue_delay.load(std::memory_order_relaxed) / tasks_done);
+
+		return stats;
+	}
+
+	//Finishes every submitted task, then stops the writers.
+	void Stop()
+	{
+		for (auto& curr_writer : m_writers)
+			curr_writer->tasks.Close();
+
+		for (auto& curr_writer : m_writers)
+		{
+			if (curr_writer->thread.joinable())
+				curr_writer->thread.join();
+		}
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	//result of a ring write whose completion never came
+	static constexpr int NOT_COMPLETED = std::numeric_limits<int>::min();
+
+	struct task
+	{
+		std::function<void()> run;
+		clock::time_point queued_at;
+		//of writes, 0 for other operations
+		std::size_t bytes = 0;
+
+		//positional writes have no run
+		std::shared_ptr<ftp_file_handle> file_handle;
+		uint64_t offset = 0;
+		ftp_buffer_pool::buffer write_bytes;
+	};
+
+	struct writer
+	{
+		ftp_mpsc_queue<task> tasks{ QUEUE_CAPACITY };
+		std::thread thread;
+		//reset when a submit fails, positional writes use pwrite then
+		std::unique_ptr<ftp_io_uring> ring;
+
+		//prepared in the ring and not completed yet, with the time they were prepared
+		std::vector<std::pair<task*, clock::time_point>> ring_writes;
+
+		//buffers of writes the kernel may still read, kept with the ring that failed until the writer is destroyed
+		std::vector<ftp_buffer_pool::buffer> abandoned_buffers;
+		std::unique_ptr<ftp_io_uring> abandoned_ring;
+	};
+
+	std::vector<std::unique_ptr<writer>> m_writers;
+	bool m_uses_io_uring = false;
+
+	std::atomic<std::size_t> m_queue_depth = 0;
+	std::atomic<uint64_t> m_tasks_done = 0;
+	std::atomic<uint64_t> m_writes = 0;
+	std::atomic<uint64_t> m_bytes_written = 0;
+	//in microseconds
+	std::atomic<uint64_t> m_write_time = 0;
+	std::atomic<uint64_t> m_max_write_time = 0;
+	std::atomic<uint64_t> m_queue_delay = 0;
+
+	writer& WriterOf(unsigned int writer_key)
+	{
+		return *m_writers[writer_key % m_writers.size()];
+	}
+
+	void Enqueue(unsigned int writer_key, task&& new_task)
+	{
+		m_queue_depth.fetch_add(1, std::memory_order_relaxed);
+		new_task.queued_at = clock::now();
+
+		//blocks while the writer is QUEUE_CAPACITY tasks behind
+		if (!WriterOf(writer_key).tasks.Push(std::move(new_task)))
+			m_queue_depth.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void RunWriter(writer& curr_writer)
+	{
+		std::vector<task> task_batch;
+		task_batch.reserve(MAX_DRAIN_BATCH);
+
+		while (curr_writer.tasks.WaitAndDrainInto(task_batch, MAX_DRAIN_BATCH) > 0)
+		{
+			for (auto& curr_task : task_batch)
+			{
+				if (!curr_task.run)
+				{
+					StartWrite(curr_writer, curr_task);
+					continue;
+				}
+
+				//everything submitted before the task is on disk before it runs
+				CompleteRingWrites(curr_writer);
+
+				const auto started_at = clock::now();
+				curr_task.run();
+				TaskDone(curr_task, started_at, clock::now());
+			}
+
+			CompleteRingWrites(curr_writer);
+			task_batch.clear();
+		}
+	}
+
+	void StartWrite(writer& curr_writer, task& curr_task)
+	{
+		if (!curr_writer.ring)
+		{
+			const auto started_at = clock::now();
+			curr_task.file_handle->WriteAt(curr_task.write_bytes.data(), curr_task.offset, curr_task.write_bytes.size());
+			FinishWrite(curr_task, started_at, clock::now());
+			return;
+		}
+
+		const auto write_index = curr_writer.ring_writes.size();
+
+		if (!curr_writer.ring->PrepareWrite(curr_task.file_handle->NativeHandle(), curr_task.write_bytes.data(), curr_task.write_bytes.size(),
+			curr_task.offset, write_index))
+		{
+			//the ring is full, or was given up by the writes completed here
+			CompleteRingWrites(curr_writer);
+			StartWrite(curr_writer, curr_task);
+			return;
+		}
+
+		curr_writer.ring_writes.push_back({ &curr_task, clock::now() });
+	}
+
+	void CompleteRingWrites(writer& curr_writer)
+	{
+		auto& ring_writes = curr_writer.ring_writes;
+
+		if (ring_writes.empty())
+			return;
+
+		std::vector<int> results(ring_writes.size(), NOT_COMPLETED);
+		std::size_t completed = 0;
+		bool keep_buffers = false;
+
+		const auto on_completion = [&results](uint64_t write_index, int result) -> void
+		{
+			if (write_index < results.size())
+				results[write_index] = result;
+		};
+
+		while (completed < ring_writes.size())
+		{
+			if (!curr_writer.ring->Submit(static_cast<unsigned>(ring_writes.size() - completed)))
+			{
+				keep_buffers = !AbandonRing(curr_writer, on_completion);
+				break;
+			}
+
+			completed += curr_writer.ring->ReapCompletions(on_completion);
+		}
+
+		const auto finished_at = clock::now();
+
+		for (std::size_t i = 0; i < ring_writes.size(); ++i)
+		{
+			auto& curr_task = *ring_writes[i].first;
+			const auto written = static_cast<std::size_t>(std::max(results[i], 0));
+
+			//short, failed and abandoned writes are finished, or retried, without the ring
+			if (written < curr_task.write_bytes.size())
+				curr_task.file_handle->WriteAt(curr_task.write_bytes.data() + written, curr_task.offset + written, curr_task.write_bytes.size() - written);
+
+			if (keep_buffers && results[i] == NOT_COMPLETED)
+			{
+				curr_writer.abandoned_buffers.push_back(std::move(curr_task.write_bytes));
+				curr_task.write_bytes = ftp_buffer_pool::buffer();
+			}
+
+			FinishWrite(curr_task, ring_writes[i].second, finished_at);
+		}
+
+		ring_writes.clear();
+	}
+
+	//The writes left prepared in the ring would reach the kernel with the next submit, after their buffers
+	//went back to the pool, so the ring is not used again. Returns false when the writes the kernel already took
+	//could not be waited for, their buffers have to outlive the ring then.
+	template<typename completion_handler>
+	bool AbandonRing(writer& curr_writer, completion_handler&& on_completion)
+	{
+		std::cout << "Disk writer: io_uring submit failed, writing with pwrite from now on\n";
+
+		const bool waited = curr_writer.ring->WaitForInFlight();
+
+		if (waited)
+		{
+			curr_writer.ring->ReapCompletions(on_completion);
+			curr_writer.ring.reset();
+		}
+		else
+			curr_writer.abandoned_ring = std::move(curr_writer.ring);
+
+		return waited;
+	}
+
+	void FinishWrite(task& curr_task, clock::time_point started_at, clock::time_point finished_at)
+	{
+		ftp_buffer_pool::Shared().Release(std::move(curr_task.write_bytes));
+		curr_task.file_handle.reset();
+
+		TaskDone(curr_task, started_at, finished_at);
+	}
+
+	void TaskDone(const task& curr_task, clock::time_point started_at, clock::time_point finished_at)
+	{
+		m_queue_delay.fetch_add(Microseconds(started_at - curr_task.queued_at), std::memory_order_relaxed);
+		m_tasks_done.fetch_add(1, std::memory_order_relaxed);
+
+		if (curr_task.bytes > 0)
+		{
+			const auto write_time = Microseconds(finished_at - started_at);
+
+			m_writes.fetch_add(1, std::memory_order_relaxed);
+			m_bytes_written.fetch_add(curr_task.bytes, std::memory_order_relaxed);
+			m_write_time.fetch_add(write_time, std::memory_order_relaxed);
+
+			auto max_write_time = m_max_write_time.load(std::memory_order_relaxed);
+			while (write_time > max_write_time && !m_max_write_time.compare_exchange_weak(max_write_time, write_time, std::memory_order_relaxed));
+		}
+
+		m_queue_depth.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	static uint64_t Microseconds(clock::duration duration)
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+	}
+};
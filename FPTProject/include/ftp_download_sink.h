@@ -0,0 +1,363 @@
+#pragma once
+#include<algorithm>
+#include<cstdint>
+#include<filesystem>
+#include<fstream>
+#include<functional>
+#include<map>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<vector>
+#include"ftp_buffer_pool.h"
+#include"ftp_checksum.h"
+#include"ftp_disk_writer.h"
+#include"ftpconnection.h"
+
+//Disk stage of downloads on the client. DOWNLOAD_START, DOWNLOAD_FILE and DOWNLOAD_FINISHED frames are not queued
+//as responses: the data connections stream them into the sink on their io thread, see ftp_connection::body_stream_handler,
+//and the chunk bytes are written by an ftp_disk_writer, so whoever consumes the responses never waits for the disk.
+//All downloads of the same partial copy go to the same writer, so opening, writing, closing and removing it stay in order.
+//In place of the frames, the consumer receives small reports through report_handler:
+//	DOWNLOAD_START    the frame as it was sent, once opening the partial copy was submitted
+//	DOWNLOAD_FILE     [file id][uint64 chunk size][uint8 intact] once the chunk is written, or dropped for not matching its CRC32C
+//	DOWNLOAD_FINISHED [file id][uint64 server digest][uint64 digest of the bytes received] once the partial copy is closed
+//Frames of file ids that are not expected are dropped. So are the chunks after one that failed its CRC32C: the id is
+//forgotten on the io thread as soon as that chunk ends, and the partial copy ends where the corrupt chunk starts.
+class ftp_download_sink
+{
+public:
+	static constexpr std::size_t DISK_WRITER_COUNT = 2;
+
+	//Called from the io thread and the writer threads.
+	using report_handler = std::function<void(ftp_request&&)>;
+
+	explicit ftp_download_sink(report_handler t_report) : m_report(std::move(t_report))
+	{}
+
+	~ftp_download_sink()
+	{
+		Stop();
+	}
+
+	ftp_download_sink(const ftp_download_sink&) = delete;
+	ftp_download_sink& operator=(const ftp_download_sink&) = delete;
+
+	//Bytes sent under file_id go to partial_path. Preallocated copies, ex. of segmented downloads, are written from the offset
+	//the server starts at; other copies are appended to when the server resumes them and replaced otherwise.
+	void Expect(unsigned int file_id, const std::string& partial_path, bool preallocated)
+	{
+		auto new_download = std::make_shared<download>();
+		new_download->partial_path = partial_path;
+		new_download->preallocated = preallocated;
+		new_download->writer_key = ftp_disk_writer::Key(partial_path);
+
+		std::lock_guard<std::mutex> downloads_lock(m_downloads_mutex);
+		m_downloads[file_id] = std::move(new_download);
+	}
+
+	//Bytes arriving under file_id from now on are dropped, the partial copy is closed after the ones already received.
+	void Forget(unsigned int file_id)
+	{
+		std::shared_ptr<download> forgotten;
+
+		{
+			std::lock_guard<std::mutex> downloads_lock(m_downloads_mutex);
+
+			const auto download_it = m_downloads.find(file_id);
+			if (download_it == m_downloads.end())
+				return;
+
+			forgotten = std::move(download_it->second);
+			m_downloads.erase(download_it);
+		}
+
+		m_disk_writer.Submit(forgotten->writer_key,
+			[file_dest = forgotten->file_dest]() -> void
+			{
+				file_dest->close();
+			});
+	}
+
+	//Removes the partial copy once every download of it that was forgotten has been closed.
+	void Discard(const std::string& partial_path)
+	{
+		m_disk_writer.Submit(ftp_disk_writer::Key(partial_path),
+			[partial_path]() -> void
+			{
+				std::error_code ec;
+				std::filesystem::remove(partial_path, ec);
+			});
+	}
+
+	//Must be called before the connection starts reading.
+	void Register(ftp_connection& data_conn)
+	{
+		ftp_connection::body_stream_handler start_handler;
+
+		//file id, start offset, file size and range length, the whole payload
+		start_handler.prefix_size = sizeof(unsigned int) + 3 * sizeof(uint64_t);
+
+		start_handler.on_begin = [this](std::shared_ptr<ftp_connection>, const ftp_request_header&, ftp_request_reader& prefix) -> void
+		{
+			OnDownloadStart(prefix);
+		};
+
+		start_handler.on_slice = [](const unsigned char*, std::size_t) -> void {};
+		start_handler.on_end = []() -> void {};
+
+		data_conn.SetBodyStreamHandler(ftp_request_header::ftp_operation::DOWNLOAD_START, std::move(start_handler));
+
+		auto stream = std::make_shared<chunk_stream>();
+
+		ftp_connection::body_stream_handler chunk_handler;
+
+		//file id, CRC32C of the chunk and the length of the file bytes block
+		chunk_handler.prefix_size = sizeof(unsigned int) + sizeof(uint32_t) + sizeof(std::size_t);
+
+		chunk_handler.on_begin = [this, stream](std::shared_ptr<ftp_connection>, const ftp_request_header&, ftp_request_reader& prefix) -> void
+		{
+			OnChunkBegin(*stream, prefix);
+		};
+
+		chunk_handler.on_slice = [this, stream](const unsigned char* data, std::size_t length) -> void
+		{
+			OnChunkSlice(*stream, data, length);
+		};
+
+		chunk_handler.on_end = [this, stream]() -> void
+		{
+			OnChunkEnd(*stream);
+		};
+
+		chunk_handler.on_abort = [stream]() -> void
+		{
+			OnChunkAbort(*stream);
+		};
+
+		data_conn.SetBodyStreamHandler(ftp_request_header::ftp_operation::DOWNLOAD_FILE, std::move(chunk_handler));
+
+		ftp_connection::body_stream_handler finished_handler;
+
+		//file id and the digest of the bytes the server has sent
+		finished_handler.prefix_size = sizeof(unsigned int) + sizeof(uint64_t);
+
+		finished_handler.on_begin = [this](std::shared_ptr<ftp_connection>, const ftp_request_header&, ftp_request_reader& prefix) -> void
+		{
+			OnDownloadFinished(prefix);
+		};
+
+		finished_handler.on_slice = [](const unsigned char*, std::size_t) -> void {};
+		finished_handler.on_end = []() -> void {};
+
+		data_conn.SetBodyStreamHandler(ftp_request_header::ftp_operation::DOWNLOAD_FINISHED, std::move(finished_handler));
+	}
+
+	ftp_disk_writer::writer_stats GetStats() const
+	{
+		return m_disk_writer.GetStats();
+	}
+
+	//Finishes every submitted write and report.
+	void Stop()
+	{
+		m_disk_writer.Stop();
+	}
+
+private:
+	struct download
+	{
+		std::string partial_path;
+		bool preallocated = false;
+		unsigned int writer_key = 0;
+
+		//opened on the writer once the server tells where the download starts
+		std::shared_ptr<std::ofstream> file_dest = std::make_shared<std::ofstream>();
+
+		//of the intact chunks, only touched by the io thread
+		ftp_file_digest digest;
+	};
+
+	//state of the DOWNLOAD_FILE frame that is currently being streamed on a connection
+	struct chunk_stream
+	{
+		unsigned int file_id = 0;
+		std::shared_ptr<download> file;
+
+		uint32_t expected_crc = 0;
+		uint32_t crc = 0;
+		std::size_t chunk_size = 0;
+
+		//the chunk's bytes, borrowed from ftp_buffer_pool; written only once the whole chunk matched its CRC32C
+		std::vector<ftp_buffer_pool::buffer> bytes;
+	};
+
+	report_handler m_report;
+
+	std::map<unsigned int, std::shared_ptr<download>> m_downloads;
+	std::mutex m_downloads_mutex;
+
+	ftp_disk_writer m_disk_writer{ DISK_WRITER_COUNT };
+
+	std::shared_ptr<download> Find(unsigned int file_id)
+	{
+		std::lock_guard<std::mutex> downloads_lock(m_downloads_mutex);
+
+		const auto download_it = m_downloads.find(file_id);
+		return download_it != m_downloads.end() ? download_it->second : nullptr;
+	}
+
+	void OnDownloadStart(ftp_request_reader& prefix)
+	{
+		unsigned int file_id;
+		uint64_t start_offset;
+		uint64_t file_size;
+		uint64_t range_length;
+		prefix.ReadTrivial(file_id, start_offset, file_size, range_length);
+
+		const auto started = Find(file_id);
+
+		if (!started)
+			return;
+
+		m_disk_writer.Submit(started->writer_key,
+			[started, start_offset]() -> void
+			{
+				auto& file_dest = *started->file_dest;
+
+				if (started->preallocated)
+				{
+					file_dest.open(started->partial_path, std::ios::binary | std::ios::in | std::ios::out);
+					file_dest.seekp(start_offset);
+				}
+				else
+				{
+					//bytes past where the server resumes, ex. written by another download of the copy, are cut off
+					std::error_code ec;
+					const auto partial_size = std::filesystem::file_size(started->partial_path, ec);
+
+					if (start_offset > 0 && !ec && partial_size > start_offset)
+						std::filesystem::resize_file(started->partial_path, start_offset, ec);
+
+					file_dest.open(started->partial_path, std::ios::binary | (start_offset > 0 ? std::ios::app : std::ios::trunc));
+				}
+			});
+
+		ftp_request start_report;
+		start_report.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_START;
+		start_report.InsertTrivialToBuffer(file_id, start_offset, file_size, range_length);
+		m_report(std::move(start_report));
+	}
+
+	void OnChunkBegin(chunk_stream& stream, ftp_request_reader& prefix)
+	{
+		prefix.ReadTrivial(stream.file_id, stream.expected_crc, stream.chunk_size);
+
+		stream.file = Find(stream.file_id);
+		stream.crc = 0;
+	}
+
+	void OnChunkSlice(chunk_stream& stream, const unsigned char* data, std::size_t length)
+	{
+		//chunks of failed or retried downloads may still be on their way
+		if (!stream.file)
+			return;
+
+		stream.crc = ftp_crc32c::Update(stream.crc, data, length);
+
+		//the slice buffer is reused for the next slice, so the bytes are copied into pool buffers that the writer takes over
+		while (length > 0)
+		{
+			if (stream.bytes.empty() || stream.bytes.back().size() == ftp_buffer_pool::BUFFER_CAPACITY)
+				stream.bytes.push_back(ftp_buffer_pool::Shared().Acquire());
+
+			auto& pending_bytes = stream.bytes.back();
+			const auto taken = std::min(length, ftp_buffer_pool::BUFFER_CAPACITY - pending_bytes.size());
+
+			pending_bytes.insert(pending_bytes.end(), data, data + taken);
+			data += taken;
+			length -= taken;
+		}
+	}
+
+	void OnChunkEnd(chunk_stream& stream)
+	{
+		if (!stream.file)
+			return;
+
+		const auto file = std::move(stream.file);
+		const bool intact = stream.crc == stream.expected_crc;
+
+		for (auto& pending_bytes : stream.bytes)
+		{
+			if (intact)
+			{
+				file->digest.Update(pending_bytes.data(), pending_bytes.size());
+				m_disk_writer.Write(file->writer_key, file->file_dest, std::move(pending_bytes));
+			}
+			else
+			{
+				ftp_buffer_pool::Shared().Release(std::move(pending_bytes));
+			}
+		}
+
+		stream.bytes.clear();
+
+		//later chunks of the id would be written behind the missing one, the range is requested again under a new id
+		if (!intact)
+			Forget(stream.file_id);
+
+		//reported behind the writes, so only bytes that are on disk are counted as received
+		m_disk_writer.Submit(file->writer_key,
+			[this, file_id = stream.file_id, chunk_size = static_cast<uint64_t>(stream.chunk_size), intact]() mutable -> void
+			{
+				uint8_t intact_flag = intact ? 1 : 0;
+
+				ftp_request chunk_report;
+				chunk_report.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FILE;
+				chunk_report.InsertTrivialToBuffer(file_id, chunk_size, intact_flag);
+				m_report(std::move(chunk_report));
+			});
+	}
+
+	//the cut chunk is requested again once the download is resumed
+	static void OnChunkAbort(chunk_stream& stream)
+	{
+		for (auto& pending_bytes : stream.bytes)
+			ftp_buffer_pool::Shared().Release(std::move(pending_bytes));
+
+		stream.bytes.clear();
+		stream.file.reset();
+	}
+
+	void OnDownloadFinished(ftp_request_reader& prefix)
+	{
+		unsigned int file_id;
+		uint64_t file_digest;
+		prefix.ReadTrivial(file_id, file_digest);
+
+		std::shared_ptr<download> finished;
+
+		{
+			std::lock_guard<std::mutex> downloads_lock(m_downloads_mutex);
+
+			const auto download_it = m_downloads.find(file_id);
+			if (download_it == m_downloads.end())
+				return;
+
+			finished = std::move(download_it->second);
+			m_downloads.erase(download_it);
+		}
+
+		m_disk_writer.Submit(finished->writer_key,
+			[this, file_dest = finished->file_dest, file_id, file_digest, received_digest = finished->digest.Value()]() mutable -> void
+			{
+				file_dest->close();
+
+				ftp_request finished_report;
+				finished_report.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FINISHED;
+				finished_report.InsertTrivialToBuffer(file_id, file_digest, received_digest);
+				m_report(std::move(finished_report));
+			});
+	}
+};
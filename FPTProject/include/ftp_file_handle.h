@@ -0,0 +1,159 @@
+#pragma once
+#include<asio.hpp>
+#include<memory>
+#include<string>
+#include<system_error>
+
+#if defined(__linux__)
+#include<cerrno>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/sendfile.h>
+#define FTP_HAS_SENDFILE 1
+#endif
+
+//Native file handle used to send file bytes without copying them through user space.
+//It is shared by all frames sending parts of the same file and closed once the last of them is written.
+//Open returns nullptr on platforms without zero-copy support, callers then fall back to buffered reads.
+//Uploads opened with OpenForWrite are written at explicit offsets, see ftp_disk_writer.
+class ftp_file_handle
+{
+public:
+	using socket_handle = asio::ip::tcp::socket::native_handle_type;
+
+	static std::shared_ptr<ftp_file_handle> Open(const std::string& file_path)
+	{
+#if defined(FTP_HAS_SENDFILE)
+		const int fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0)
+			return nullptr;
+
+		return std::shared_ptr<ftp_file_handle>(new ftp_file_handle(fd));
+#else
+		return nullptr;
+#endif
+	}
+
+	//The file must already exist, it is neither created nor truncated.
+	static std::shared_ptr<ftp_file_handle> OpenForWrite(const std::string& file_path)
+	{
+#if defined(FTP_HAS_SENDFILE)
+		const int fd = ::open(file_path.c_str(), O_WRONLY | O_CLOEXEC);
+
+		if (fd < 0)
+			return nullptr;
+
+		return std::shared_ptr<ftp_file_handle>(new ftp_file_handle(fd));
+#else
+		return nullptr;
+#endif
+	}
+
+	~ftp_file_handle()
+	{
+#if defined(FTP_HAS_SENDFILE)
+		::close(m_fd);
+#endif
+	}
+
+	ftp_file_handle(const ftp_file_handle&) = delete;
+	ftp_file_handle& operator=(const ftp_file_handle&) = delete;
+
+	//Sends up to length bytes, starting at offset, from the page cache straight to the socket.
+	//The socket must be in non-blocking mode. Returns the number of bytes sent;
+	//ec is set to operation_would_block when the socket buffer is full
+	//and to not_supported when the kernel can't send from this file.
+	std::size_t SendTo(socket_handle socket, uint64_t offset, std::size_t length, std::error_code& ec) const
+	{
+		ec.clear();
+
+#if defined(FTP_HAS_SENDFILE)
+		while (true)
+		{
+			off_t file_offset = static_cast<off_t>(offset);
+			const auto sent = ::sendfile(socket, m_fd, &file_offset, length);
+
+			if (sent > 0)
+				return static_cast<std::size_t>(sent);
+
+			if (sent == 0)
+				ec = std::make_error_code(std::errc::io_error);
+
+			else if (errno == EINTR)
+				continue;
+
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				ec = std::make_error_code(std::errc::operation_would_block);
+
+			else if (errno == EINVAL || errno == ENOSYS)
+				ec = std::make_error_code(std::errc::not_supported);
+
+			else
+				ec = std::error_code(errno, std::system_category());
+
+			return 0;
+		}
+#else
+		ec = std::make_error_code(std::errc::not_supported);
+		return 0;
+#endif
+	}
+
+	//Positional read used when the bytes can't be sent directly.
+	std::size_t ReadAt(unsigned char* dest, uint64_t offset, std::size_t length) const
+	{
+		std::size_t total_read = 0;
+
+#if defined(FTP_HAS_SENDFILE)
+		while (total_read < length)
+		{
+			const auto bytes_read = ::pread(m_fd, dest + total_read, length - total_read, static_cast<off_t>(offset + total_read));
+
+			if (bytes_read < 0 && errno == EINTR)
+				continue;
+
+			if (bytes_read <= 0)
+				break;
+
+			total_read += static_cast<std::size_t>(bytes_read);
+		}
+#endif
+
+		return total_read;
+	}
+
+	//Positional write, returns the number of bytes written.
+	std::size_t WriteAt(const unsigned char* src, uint64_t offset, std::size_t length) const
+	{
+		std::size_t total_written = 0;
+
+#if defined(FTP_HAS_SENDFILE)
+		while (total_written < length)
+		{
+			const auto bytes_written = ::pwrite(m_fd, src + total_written, length - total_written, static_cast<off_t>(offset + total_written));
+
+			if (bytes_written < 0 && errno == EINTR)
+				continue;
+
+			if (bytes_written <= 0)
+				break;
+
+			total_written += static_cast<std::size_t>(bytes_written);
+		}
+#endif
+
+		return total_written;
+	}
+
+	//file descriptor, -1 where there is none
+	int NativeHandle() const
+	{
+		return m_fd;
+	}
+
+private:
+	explicit ftp_file_handle(int t_fd) : m_fd(t_fd) {}
+
+	int m_fd = -1;
+};
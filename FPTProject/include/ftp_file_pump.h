@@ -0,0 +1,440 @@
+#pragma once
+#include<asio.hpp>
+#include<algorithm>
+#include<atomic>
+#include<deque>
+#include<iostream>
+#include<optional>
+#include<vector>
+#include"ftpconnection.h"
+#include"ftp_io_uring.h"
+#include"ftp_transfer_scheduler.h"
+
+//Completion-driven sender of files over one connection.
+//The next chunk of a file is read only when one of its previous chunks has been written to the socket,
+//so at most MAX_CHUNKS_IN_FLIGHT chunks per file are queued at any time and nothing ever sleeps or polls.
+//Across files, the pump stops producing while the connection is above its send high watermark.
+//Every chunk is paid for with credit from the server's ftp_transfer_scheduler, which shares the server between clients;
+//the pump itself serves its files round robin, one quantum sized chunk per file per round.
+//Chunks are read straight into the frame that sends them, so every byte is read from disk once
+//and the bytes that are checksummed are the bytes that are sent.
+//On connections that negotiated compression, chunks whose samples compress well are sent compressed.
+//Every chunk carries its CRC32C, and DOWNLOAD_FINISHED with the digest of the whole range follows the last one.
+//Both are computed on the io thread while the previous chunks are still being written.
+//With an ftp_file_reader, chunks are read through io_uring without blocking the io thread,
+//the reads of all files are in flight together and each chunk is sent once the chunks before it were.
+//Their frames send the reader's buffer itself and hand it back once written, see ftp_file_reader::read_buffer::Keep.
+//All transfer state is touched only on the connection's io thread.
+class ftp_file_pump : public std::enable_shared_from_this<ftp_file_pump>
+{
+public:
+	static constexpr std::size_t TRANSFER_CHUNK_SIZE = ftp_transfer_scheduler::QUANTUM;
+	static constexpr std::size_t MAX_CHUNKS_IN_FLIGHT = 4;
+
+	//a client with weight 2 gets twice the share of the server of a client with weight 1;
+	//the weight is shared with the server, which can change it while the pump runs, nullptr stands for 1
+	ftp_file_pump(std::shared_ptr<ftp_connection> t_receiver, ftp_transfer_scheduler& t_scheduler,
+		std::shared_ptr<ftp_file_reader> t_file_reader = nullptr, std::shared_ptr<const std::atomic<unsigned int>> t_weight = nullptr)
+		: m_receiver(std::move(t_receiver)), m_scheduler(t_scheduler), m_file_reader(std::move(t_file_reader)), m_weight(t_weight)
+	{}
+
+	//Sends the file's remaining_bytes starting at start_offset, file_src must already be positioned there.
+	//Safe to call from any thread.
+	void AddFile(std::shared_ptr<File::FileLocal> file, const std::string& file_path, uint64_t start_offset = 0)
+	{
+		//buffered reads through file_src are used when there is no native handle
+		auto file_handle = ftp_file_handle::Open(file_path);
+
+		//without a free slot in the reader's file table the file is read with pread
+		std::shared_ptr<ftp_file_reader::registered_file> registered_file;
+
+		if (m_file_reader && file_handle)
+			registered_file = m_file_reader->RegisterFile(file_handle->NativeHandle());
+
+		asio::post(m_receiver->GetExecutor(),
+			[self = shared_from_this(), file = std::move(file), file_handle = std::move(file_handle),
+			registered_file = std::move(registered_file), start_offset]() mutable -> void
+			{
+				if (self->m_stopped)
+					return;
+
+				self->m_transfers.push_back({ std::move(file), std::move(file_handle), std::move(registered_file), start_offset });
+				self->Pump();
+			});
+	}
+
+	//Drops the remaining transfers and gives all of the pump's credit back to the scheduler.
+	//Safe to call from any thread.
+	void Stop()
+	{
+		asio::post(m_receiver->GetExecutor(),
+			[self = shared_from_this()]() -> void
+			{
+				self->Shutdown();
+			});
+	}
+
+private:
+	//chunk whose read was submitted to the file reader
+	struct pending_chunk
+	{
+		uint64_t offset = 0;
+		std::size_t size = 0;
+		std::optional<ftp_file_reader::read_buffer> bytes = std::nullopt;
+	};
+
+	struct transfer
+	{
+		std::shared_ptr<File::FileLocal> file;
+		std::shared_ptr<ftp_file_handle> file_handle;
+		std::shared_ptr<ftp_file_reader::registered_file> registered_file;
+		uint64_t next_offset = 0;
+		//in file order, chunks are sent from the front once their bytes are there
+		std::deque<pending_chunk> pending_chunks = {};
+		std::size_t chunks_in_flight = 0;
+		bool finish_sent = false;
+	};
+
+	std::shared_ptr<ftp_connection> m_receiver;
+	std::deque<transfer> m_transfers;
+	bool m_awaiting_writable = false;
+
+	ftp_transfer_scheduler& m_scheduler;
+	std::shared_ptr<ftp_file_reader> m_file_reader;
+	std::shared_ptr<const std::atomic<unsigned int>> m_weight;
+	//granted by the scheduler and not spent yet
+	std::size_t m_credit = 0;
+	//spent on chunks that are not written yet
+	std::size_t m_bytes_in_flight = 0;
+	bool m_awaiting_credit = false;
+	bool m_stopped = false;
+
+	static bool IsReady(const transfer& entry)
+	{
+		return entry.file->remaining_bytes > 0 && entry.chunks_in_flight < MAX_CHUNKS_IN_FLIGHT;
+	}
+
+	static std::size_t NextChunkSize(const transfer& entry)
+	{
+		return std::min(TRANSFER_CHUNK_SIZE, entry.file->remaining_bytes);
+	}
+
+	void Pump()
+	{
+		if (m_stopped)
+			return;
+
+		if (!m_receiver->IsSocketOpen())
+		{
+			Shutdown();
+			return;
+		}
+
+		bool producing = true;
+		bool needs_credit = false;
+
+		while (producing && !needs_credit)
+		{
+			producing = false;
+
+			//one chunk per file per round, so files share the connection's window
+			for (auto& curr_transfer : m_transfers)
+			{
+				if (!m_receiver->IsWritable())
+					break;
+
+				if (!IsReady(curr_transfer))
+					continue;
+
+				if (NextChunkSize(curr_transfer) > m_credit)
+				{
+					needs_credit = true;
+					break;
+				}
+
+				SendNextChunk(curr_transfer);
+				producing = true;
+
+				//a chunk that could not be read stopped the pump and dropped the transfers
+				if (m_stopped)
+					return;
+			}
+		}
+
+		for (auto& curr_transfer : m_transfers)
+		{
+			if (curr_transfer.file->remaining_bytes <= 0 && curr_transfer.pending_chunks.empty() && !curr_transfer.finish_sent)
+				SendFinished(curr_transfer);
+		}
+
+		//files are done once their last chunk has left the write queue
+		m_transfers.erase(
+			std::remove_if(m_transfers.begin(), m_transfers.end(),
+				[](const transfer& entry)
+				{
+					return entry.finish_sent && entry.chunks_in_flight == 0;
+				}),
+			m_transfers.end()
+		);
+
+		if (needs_credit && !m_awaiting_credit)
+		{
+			m_awaiting_credit = true;
+
+			m_scheduler.RequestCredit(m_weight ? m_weight->load(std::memory_order_relaxed) : 1,
+				[self = shared_from_this()](std::size_t granted) -> void
+				{
+					asio::post(self->m_receiver->GetExecutor(),
+						[self, granted]() -> void
+						{
+							self->OnCreditGranted(granted);
+						});
+				});
+		}
+
+		//unused credit of an idle client goes back to the others
+		if (m_transfers.empty() && m_credit > 0)
+		{
+			m_scheduler.ReturnCredit(m_credit);
+			m_credit = 0;
+		}
+
+		if (!m_receiver->IsWritable() && !m_awaiting_writable)
+		{
+			m_awaiting_writable = true;
+
+			m_receiver->NotifyWhenWritable(
+				[self = shared_from_this()]() -> void
+				{
+					self->m_awaiting_writable = false;
+					self->Pump();
+				});
+		}
+	}
+
+	void SendNextChunk(transfer& curr_transfer)
+	{
+		auto& curr_file = *curr_transfer.file;
+		const auto chunk_size = NextChunkSize(curr_transfer);
+		const auto chunk_offset = curr_transfer.next_offset;
+
+		curr_file.remaining_bytes -= chunk_size;
+		curr_transfer.next_offset += chunk_size;
+		curr_transfer.chunks_in_flight++;
+
+		m_credit -= chunk_size;
+		m_bytes_in_flight += chunk_size;
+
+		if (curr_transfer.registered_file)
+		{
+			curr_transfer.pending_chunks.push_back({ chunk_offset, chunk_size });
+
+			m_file_reader->Read(curr_transfer.registered_file, chunk_offset, chunk_size,
+				[self = shared_from_this(), file = curr_transfer.file, chunk_offset](ftp_file_reader::read_buffer bytes) -> void
+				{
+					asio::post(self->m_receiver->GetExecutor(),
+						[self, file, chunk_offset, bytes = std::move(bytes)]() mutable -> void
+						{
+							self->OnChunkRead(file, chunk_offset, std::move(bytes));
+						});
+				});
+
+			return;
+		}
+
+		SendChunkFromFile(curr_transfer, chunk_offset, chunk_size);
+	}
+
+	//Reads the chunk at chunk_offset straight into its frame and sends it.
+	void SendChunkFromFile(transfer& curr_transfer, uint64_t chunk_offset, std::size_t chunk_size)
+	{
+		auto& curr_file = *curr_transfer.file;
+
+		ftp_request file_bytes_response;
+		file_bytes_response.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FILE;
+		file_bytes_response.InsertTrivialToBuffer(curr_file.client_file_id);
+
+		const auto chunk_bytes = curr_transfer.file_handle
+			? file_bytes_response.InsertChunkRead(chunk_size,
+				[&file_handle = *curr_transfer.file_handle, chunk_offset](unsigned char* dest, std::size_t count) -> std::size_t
+				{
+					return file_handle.ReadAt(dest, chunk_offset, count);
+				})
+			: file_bytes_response.InsertChunkFromStream(*curr_file.file_src, chunk_size);
+
+		if (chunk_bytes.size() != chunk_size)
+		{
+			FailTransfers(curr_file, chunk_offset, chunk_bytes.size(), chunk_size);
+			return;
+		}
+
+		curr_file.digest.Update(chunk_bytes.data(), chunk_bytes.size());
+
+		file_bytes_response.Compress(m_receiver->GetCompression());
+		WriteChunk(curr_transfer, std::move(file_bytes_response).Freeze(), chunk_size);
+	}
+
+	//Sends the chunk read through io_uring, the frame carries the reader's buffer until it is written.
+	void SendReadChunk(transfer& curr_transfer, ftp_file_reader::read_buffer chunk_bytes)
+	{
+		auto& curr_file = *curr_transfer.file;
+		const auto chunk_size = chunk_bytes.size();
+
+		ftp_request file_bytes_response;
+		file_bytes_response.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FILE;
+		file_bytes_response.InsertTrivialToBuffer(curr_file.client_file_id);
+
+		const auto crc = ftp_crc32c::Compute(chunk_bytes.data(), chunk_size);
+		curr_file.digest.Update(chunk_bytes.data(), chunk_size);
+
+		const auto codec = m_receiver->GetCompression();
+
+		//compressed chunks are built in the request anyway, and past the reader's cap the bytes are copied there too
+		if (ftp_chunk_codec::LooksCompressible(codec, chunk_bytes.data(), chunk_size) || !chunk_bytes.Keep())
+		{
+			file_bytes_response.InsertChunk(chunk_bytes.data(), chunk_size, crc);
+			file_bytes_response.Compress(codec);
+			WriteChunk(curr_transfer, std::move(file_bytes_response).Freeze(), chunk_size);
+			return;
+		}
+
+		//the checksum and block length are packed here, the block itself is the memory tail of the frame
+		file_bytes_response.InsertTrivialToBuffer(crc, chunk_size);
+
+		auto kept_bytes = std::make_shared<const ftp_file_reader::read_buffer>(std::move(chunk_bytes));
+		auto chunk_frame = std::move(file_bytes_response).Freeze();
+		chunk_frame.AttachMemoryTail(std::shared_ptr<const unsigned char>(kept_bytes, kept_bytes->data()), chunk_size);
+		WriteChunk(curr_transfer, std::move(chunk_frame), chunk_size);
+	}
+
+	void WriteChunk(transfer& curr_transfer, ftp_frame chunk_frame, std::size_t chunk_size)
+	{
+		m_receiver->Write(std::move(chunk_frame),
+			[self = shared_from_this(), file = curr_transfer.file, chunk_size]() -> void
+			{
+				self->OnChunkWritten(file, chunk_size);
+			});
+	}
+
+	void OnChunkRead(const std::shared_ptr<File::FileLocal>& file, uint64_t chunk_offset, ftp_file_reader::read_buffer bytes)
+	{
+		if (m_stopped)
+			return;
+
+		const auto transfer_it = FindTransfer(file);
+
+		if (transfer_it == m_transfers.end())
+			return;
+
+		auto& pending_chunks = transfer_it->pending_chunks;
+
+		for (auto& chunk : pending_chunks)
+		{
+			if (chunk.offset == chunk_offset)
+			{
+				chunk.bytes = std::move(bytes);
+				break;
+			}
+		}
+
+		while (!pending_chunks.empty() && pending_chunks.front().bytes)
+		{
+			auto chunk = std::move(pending_chunks.front());
+			pending_chunks.pop_front();
+
+			//a failed read is retried with pread
+			if (chunk.bytes->size() != chunk.size)
+			{
+				chunk.bytes.reset();
+				SendChunkFromFile(*transfer_it, chunk.offset, chunk.size);
+
+				if (m_stopped)
+					return;
+
+				continue;
+			}
+
+			SendReadChunk(*transfer_it, std::move(*chunk.bytes));
+		}
+
+		Pump();
+	}
+
+	//Written behind the last chunk of the file, with the digest of every byte of the range.
+	void SendFinished(transfer& curr_transfer)
+	{
+		curr_transfer.finish_sent = true;
+
+		ftp_request finished_response;
+		finished_response.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FINISHED;
+
+		auto file_digest = curr_transfer.file->digest.Value();
+		finished_response.InsertTrivialToBuffer(curr_transfer.file->client_file_id, file_digest);
+
+		m_receiver->Write(std::move(finished_response));
+	}
+
+	void OnChunkWritten(const std::shared_ptr<File::FileLocal>& file, std::size_t chunk_size)
+	{
+		//credit of a stopped pump has already been returned
+		if (m_stopped)
+			return;
+
+		m_bytes_in_flight -= chunk_size;
+		m_scheduler.ReturnCredit(chunk_size);
+
+		const auto transfer_it = FindTransfer(file);
+
+		if (transfer_it != m_transfers.end())
+			transfer_it->chunks_in_flight--;
+
+		Pump();
+	}
+
+	std::deque<transfer>::iterator FindTransfer(const std::shared_ptr<File::FileLocal>& file)
+	{
+		return std::find_if(m_transfers.begin(), m_transfers.end(),
+			[&file](const transfer& entry)
+			{
+				return entry.file == file;
+			});
+	}
+
+	void OnCreditGranted(std::size_t granted)
+	{
+		m_awaiting_credit = false;
+
+		if (m_stopped)
+		{
+			m_scheduler.ReturnCredit(granted);
+			return;
+		}
+
+		m_credit += granted;
+		Pump();
+	}
+
+	//A chunk shorter than announced, ex. of a file truncated while it is sent, would desync the receiver's stream
+	//and its checksums would vouch for bytes that are not in the file, so the pump stops and the connection is closed instead.
+	void FailTransfers(const File::FileLocal& failed_file, uint64_t chunk_offset, std::size_t read_count, std::size_t chunk_size)
+	{
+		std::cout << "File [" << failed_file.client_file_id << "]: read " << read_count << " of " << chunk_size << " bytes at "
+			<< chunk_offset << ", the file changed while it was sent. Closing the connection.\n";
+
+		Shutdown();
+		m_receiver->Disconnect();
+	}
+
+	void Shutdown()
+	{
+		if (m_stopped)
+			return;
+
+		m_stopped = true;
+		m_transfers.clear();
+
+		m_scheduler.ReturnCredit(m_credit + m_bytes_in_flight);
+		m_credit = 0;
+		m_bytes_in_flight = 0;
+	}
+};
@@ -0,0 +1,853 @@
+#pragma once
+#include<asio.hpp>
+#include<atomic>
+#include<cstdint>
+#include<cstring>
+#include<deque>
+#include<functional>
+#include<iostream>
+#include<memory>
+#include<mutex>
+#include<vector>
+
+//io_uring is compiled in on Linux when the kernel headers have it, define FTP_NO_IO_URING to leave it out.
+//Rings are set up with the raw system calls, there is no liburing to link.
+//Where the kernel refuses them at runtime, ex. in containers that filter io_uring, Create returns nullptr
+//and callers keep using pread and pwrite.
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && !defined(FTP_NO_IO_URING)
+#include<cerrno>
+#include<linux/io_uring.h>
+#include<sys/eventfd.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<sys/uio.h>
+#include<unistd.h>
+#define FTP_HAS_IO_URING 1
+#endif
+
+//One submission and completion ring. Operations are queued with the Prepare functions
+//and handed to the kernel together by Submit, so a batch of reads or writes costs one system call.
+//Not thread safe, every ring is used by one thread or strand.
+class ftp_io_uring
+{
+public:
+	struct buffer_region
+	{
+		unsigned char* data = nullptr;
+		std::size_t size = 0;
+	};
+
+	static std::unique_ptr<ftp_io_uring> Create(unsigned entries)
+	{
+#if defined(FTP_HAS_IO_URING)
+		std::unique_ptr<ftp_io_uring> ring(new ftp_io_uring());
+		return ring->Setup(entries) ? std::move(ring) : nullptr;
+#else
+		return nullptr;
+#endif
+	}
+
+	~ftp_io_uring()
+	{
+#if defined(FTP_HAS_IO_URING)
+		if (m_sqes != nullptr)
+			::munmap(m_sqes, m_sqes_size);
+
+		if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring)
+			::munmap(m_cq_ring, m_cq_ring_size);
+
+		if (m_sq_ring != nullptr)
+			::munmap(m_sq_ring, m_sq_ring_size);
+
+		if (m_ring_fd >= 0)
+			::close(m_ring_fd);
+#endif
+	}
+
+	ftp_io_uring(const ftp_io_uring&) = delete;
+	ftp_io_uring& operator=(const ftp_io_uring&) = delete;
+
+	//Pins the regions once, so reads into them skip mapping the pages for every operation, see PrepareReadFixed.
+	bool RegisterBuffers(const std::vector<buffer_region>& buffers)
+	{
+#if defined(FTP_HAS_IO_URING)
+		std::vector<iovec> regions;
+
+		for (const auto& buffer : buffers)
+			regions.push_back({ buffer.data, buffer.size });
+
+		return Register(IORING_REGISTER_BUFFERS, regions.data(), static_cast<unsigned>(regions.size())) == 0;
+#else
+		return false;
+#endif
+	}
+
+	//Empty table of count fixed files, see UpdateFile.
+	bool RegisterFiles(unsigned count)
+	{
+#if defined(FTP_HAS_IO_URING)
+		std::vector<int> fds(count, -1);
+		return Register(IORING_REGISTER_FILES, fds.data(), count) == 0;
+#else
+		return false;
+#endif
+	}
+
+	//Puts fd in slot index of the fixed file table, -1 empties the slot.
+	//Operations on fixed files skip looking the descriptor up every time. Safe to call from any thread.
+	bool UpdateFile(unsigned index, int fd)
+	{
+#if defined(FTP_HAS_IO_URING)
+		io_uring_files_update update;
+		std::memset(&update, 0, sizeof(update));
+		update.offset = index;
+		update.fds = reinterpret_cast<uint64_t>(&fd);
+
+		return Register(IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+#else
+		return false;
+#endif
+	}
+
+	//The eventfd is signalled for every completion, which lets an event loop wait for them.
+	bool RegisterEventFd(int event_fd)
+	{
+#if defined(FTP_HAS_IO_URING)
+		return Register(IORING_REGISTER_EVENTFD, &event_fd, 1) == 0;
+#else
+		return false;
+#endif
+	}
+
+	//Reads into registered buffer buffer_index from the file in slot file_index.
+	//Returns false when the submission queue is full.
+	bool PrepareReadFixed(unsigned file_index, unsigned char* dest, std::size_t length, uint64_t offset, unsigned buffer_index, uint64_t user_data)
+	{
+#if defined(FTP_HAS_IO_URING)
+		auto* sqe = NextSqe();
+
+		if (sqe == nullptr)
+			return false;
+
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = static_cast<int>(file_index);
+		sqe->off = offset;
+		sqe->addr = reinterpret_cast<uint64_t>(dest);
+		sqe->len = static_cast<uint32_t>(length);
+		sqe->buf_index = static_cast<uint16_t>(buffer_index);
+		sqe->user_data = user_data;
+
+		CommitSqe();
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	//Returns false when the submission queue is full.
+	bool PrepareWrite(int fd, const unsigned char* src, std::size_t length, uint64_t offset, uint64_t user_data)
+	{
+#if defined(FTP_HAS_IO_URING)
+		auto* sqe = NextSqe();
+
+		if (sqe == nullptr)
+			return false;
+
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->off = offset;
+		sqe->addr = reinterpret_cast<uint64_t>(src);
+		sqe->len = static_cast<uint32_t>(length);
+		sqe->user_data = user_data;
+
+		CommitSqe();
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	//Hands the prepared operations to the kernel and waits until at least wait_for completions are ready.
+	//Returns false on errors other than interruptions, the prepared operations are then left queued.
+	bool Submit(unsigned wait_for = 0)
+	{
+#if defined(FTP_HAS_IO_URING)
+		while (true)
+		{
+			const auto result = ::syscall(__NR_io_uring_enter, m_ring_fd, m_unsubmitted, wait_for,
+				wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+			if (result >= 0)
+			{
+				const auto submitted = std::min<unsigned>(m_unsubmitted, static_cast<unsigned>(result));
+				m_unsubmitted -= submitted;
+				m_in_flight += submitted;
+
+				if (m_unsubmitted == 0 || wait_for > 0)
+					return true;
+
+				continue;
+			}
+
+			if (errno != EINTR)
+				return false;
+		}
+#else
+		return false;
+#endif
+	}
+
+	//Calls on_completion(user_data, result) for every ready completion, result is negative errno on failure.
+	template<typename completion_handler>
+	std::size_t ReapCompletions(completion_handler&& on_completion)
+	{
+		std::size_t reaped = 0;
+
+#if defined(FTP_HAS_IO_URING)
+		auto head = *m_cq_head;
+		const auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++head, ++reaped)
+		{
+			const auto& cqe = m_cqes[head & *m_cq_mask];
+			on_completion(cqe.user_data, cqe.res);
+		}
+
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+		m_in_flight -= std::min<std::size_t>(m_in_flight, reaped);
+#endif
+
+		return reaped;
+	}
+
+	//Operations handed to the kernel whose completions are not reaped yet.
+	unsigned InFlight() const
+	{
+#if defined(FTP_HAS_IO_URING)
+		return m_in_flight;
+#else
+		return 0;
+#endif
+	}
+
+	//Waits until every operation handed to the kernel has completed, without submitting the prepared ones.
+	//For callers giving up on a ring whose Submit failed: the prepared operations then never reach the kernel,
+	//and once this returns true no buffer of the submitted ones is touched by it anymore.
+	bool WaitForInFlight()
+	{
+#if defined(FTP_HAS_IO_URING)
+		while (m_in_flight > 0)
+		{
+			const auto result = ::syscall(__NR_io_uring_enter, m_ring_fd, 0, m_in_flight, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+			if (result >= 0)
+				return true;
+
+			if (errno != EINTR)
+				return false;
+		}
+#endif
+
+		return true;
+	}
+
+private:
+	ftp_io_uring() = default;
+
+#if defined(FTP_HAS_IO_URING)
+	int m_ring_fd = -1;
+
+	void* m_sq_ring = nullptr;
+	void* m_cq_ring = nullptr;
+	std::size_t m_sq_ring_size = 0;
+	std::size_t m_cq_ring_size = 0;
+
+	io_uring_sqe* m_sqes = nullptr;
+	std::size_t m_sqes_size = 0;
+
+	unsigned* m_sq_head = nullptr;
+	unsigned* m_sq_tail = nullptr;
+	unsigned* m_sq_mask = nullptr;
+	unsigned* m_sq_array = nullptr;
+	unsigned m_sq_entries = 0;
+	//prepared and not taken by the kernel yet
+	unsigned m_unsubmitted = 0;
+	//taken by the kernel and not reaped yet
+	unsigned m_in_flight = 0;
+
+	unsigned* m_cq_head = nullptr;
+	unsigned* m_cq_tail = nullptr;
+	unsigned* m_cq_mask = nullptr;
+	io_uring_cqe* m_cqes = nullptr;
+
+	bool Setup(unsigned entries)
+	{
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+
+		m_ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+
+		if (m_ring_fd < 0)
+			return false;
+
+		m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		//newer kernels map both rings with one call
+		const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+		if (single_mmap)
+			m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+		m_sq_ring = MapRing(m_sq_ring_size, IORING_OFF_SQ_RING);
+
+		if (m_sq_ring == nullptr)
+			return false;
+
+		m_cq_ring = single_mmap ? m_sq_ring : MapRing(m_cq_ring_size, IORING_OFF_CQ_RING);
+
+		if (m_cq_ring == nullptr)
+			return false;
+
+		m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		m_sqes = static_cast<io_uring_sqe*>(MapRing(m_sqes_size, IORING_OFF_SQES));
+
+		if (m_sqes == nullptr)
+			return false;
+
+		auto* sq_ring = static_cast<unsigned char*>(m_sq_ring);
+		m_sq_head = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.head);
+		m_sq_tail = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.tail);
+		m_sq_mask = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.ring_mask);
+		m_sq_array = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.array);
+		m_sq_entries = params.sq_entries;
+
+		auto* cq_ring = static_cast<unsigned char*>(m_cq_ring);
+		m_cq_head = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.head);
+		m_cq_tail = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.tail);
+		m_cq_mask = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe*>(cq_ring + params.cq_off.cqes);
+
+		return true;
+	}
+
+	void* MapRing(std::size_t size, uint64_t offset)
+	{
+		void* ring = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, static_cast<off_t>(offset));
+		return ring == MAP_FAILED ? nullptr : ring;
+	}
+
+	long Register(unsigned opcode, void* arg, unsigned count)
+	{
+		return ::syscall(__NR_io_uring_register, m_ring_fd, opcode, arg, count);
+	}
+
+	io_uring_sqe* NextSqe()
+	{
+		const auto head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+		const auto tail = *m_sq_tail;
+
+		if (tail - head >= m_sq_entries)
+			return nullptr;
+
+		auto* sqe = &m_sqes[tail & *m_sq_mask];
+		std::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	void CommitSqe()
+	{
+		const auto tail = *m_sq_tail;
+		m_sq_array[tail & *m_sq_mask] = tail & *m_sq_mask;
+
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		m_unsubmitted++;
+	}
+#endif
+};
+
+
+//Positional file reads through io_uring, completed on an asio io_context.
+//Reads go into READ_BUFFER_COUNT registered buffers from files in the ring's fixed file table,
+//so one io thread keeps up to READ_BUFFER_COUNT reads in flight for all transfers together.
+//Reads issued while every buffer is taken wait for one to be handed back.
+//Buffers kept past the read, such as by frames that send them, are capped at MAX_KEPT_BUFFERS,
+//so the reads of other transfers still get buffers while the kept ones wait on slow sockets.
+//The ring signals an eventfd the io_context waits on; all ring state is touched only on the reader's strand.
+class ftp_file_reader : public std::enable_shared_from_this<ftp_file_reader>
+{
+public:
+	static constexpr unsigned QUEUE_DEPTH = 64;
+	static constexpr std::size_t READ_BUFFER_COUNT = 32;
+	static constexpr std::size_t MAX_KEPT_BUFFERS = READ_BUFFER_COUNT / 2;
+	static constexpr unsigned MAX_FILES = 256;
+
+	struct reader_stats
+	{
+		uint64_t reads = 0;
+		uint64_t bytes_read = 0;
+		std::size_t max_reads_in_flight = 0;
+	};
+
+	//Bytes of a completed read, in one of the registered buffers. The buffer is handed back once this is destroyed.
+	class read_buffer
+	{
+	public:
+		read_buffer() = default;
+
+		read_buffer(std::shared_ptr<ftp_file_reader> t_reader, unsigned t_index, const unsigned char* t_data, std::size_t t_size)
+			: m_reader(std::move(t_reader)), m_index(t_index), m_data(t_data), m_size(t_size)
+		{}
+
+		read_buffer(read_buffer&& other) noexcept
+			: m_reader(std::move(other.m_reader)), m_index(other.m_index), m_data(other.m_data), m_size(other.m_size), m_kept(other.m_kept)
+		{
+			other.m_kept = false;
+		}
+
+		read_buffer& operator=(read_buffer&& other) noexcept
+		{
+			if (this != &other)
+			{
+				Release();
+				m_reader = std::move(other.m_reader);
+				m_index = other.m_index;
+				m_data = other.m_data;
+				m_size = other.m_size;
+				m_kept = other.m_kept;
+				other.m_kept = false;
+			}
+
+			return *this;
+		}
+
+		~read_buffer()
+		{
+			Release();
+		}
+
+		const unsigned char* data() const
+		{
+			return m_data;
+		}
+
+		std::size_t size() const
+		{
+			return m_size;
+		}
+
+		//Asks to hold on to the buffer for longer than it takes to handle the read, e.g. until the bytes are written.
+		//Returns false when the reader already has MAX_KEPT_BUFFERS kept, the bytes have to be copied then.
+		bool Keep()
+		{
+			if (!m_kept && m_reader)
+				m_kept = m_reader->TryKeepBuffer();
+
+			return m_kept;
+		}
+
+	private:
+		std::shared_ptr<ftp_file_reader> m_reader;
+		unsigned m_index = 0;
+		const unsigned char* m_data = nullptr;
+		std::size_t m_size = 0;
+		bool m_kept = false;
+
+		void Release()
+		{
+			if (m_reader)
+				m_reader->ReleaseBuffer(m_index, m_kept);
+
+			m_reader.reset();
+			m_kept = false;
+		}
+	};
+
+	//Slot of a file in the fixed file table, emptied once the last read of the file is done.
+	class registered_file
+	{
+	public:
+		registered_file(std::shared_ptr<ftp_file_reader> t_reader, unsigned t_index, int t_fd)
+			: m_reader(std::move(t_reader)), m_index(t_index), m_fd(t_fd)
+		{
+#if defined(FTP_HAS_IO_URING)
+			//reads done with pread once the ring failed may outlive the caller's descriptor, like the fixed file table's own reference
+			m_fd = ::dup(t_fd);
+#endif
+		}
+
+		~registered_file()
+		{
+			m_reader->UnregisterFile(m_index);
+
+#if defined(FTP_HAS_IO_URING)
+			if (m_fd >= 0)
+				::close(m_fd);
+#endif
+		}
+
+		registered_file(const registered_file&) = delete;
+		registered_file& operator=(const registered_file&) = delete;
+
+		unsigned Index() const
+		{
+			return m_index;
+		}
+
+		//for reading without the ring once it failed
+		int Fd() const
+		{
+			return m_fd;
+		}
+
+	private:
+		std::shared_ptr<ftp_file_reader> m_reader;
+		unsigned m_index;
+		int m_fd;
+	};
+
+	//Shorter buffers than the length asked for mean the file ended or the read failed.
+	using read_handler = std::function<void(read_buffer)>;
+
+	//Returns nullptr where io_uring is not available, reads of buffer_size bytes at most are supported.
+	static std::shared_ptr<ftp_file_reader> Create(asio::io_context& context, std::size_t buffer_size)
+	{
+#if defined(FTP_HAS_IO_URING)
+		std::shared_ptr<ftp_file_reader> reader(new ftp_file_reader(context, buffer_size));
+
+		if (!reader->Setup())
+			return nullptr;
+
+		reader->WaitForCompletions();
+		return reader;
+#else
+		(void)context;
+		(void)buffer_size;
+		return nullptr;
+#endif
+	}
+
+	~ftp_file_reader()
+	{
+#if defined(FTP_HAS_IO_URING)
+		//the kernel may still hold pinned pages of the buffers, unmapping only drops this process' view of them
+		m_ring.reset();
+
+		if (m_buffers != nullptr)
+			::munmap(m_buffers, m_buffer_size * READ_BUFFER_COUNT);
+#endif
+	}
+
+	ftp_file_reader(const ftp_file_reader&) = delete;
+	ftp_file_reader& operator=(const ftp_file_reader&) = delete;
+
+	//Puts the descriptor in the fixed file table. Returns nullptr when the table is full or the ring failed,
+	//the file has to be read without the reader then. Safe to call from any thread.
+	std::shared_ptr<registered_file> RegisterFile(int fd)
+	{
+		std::lock_guard<std::mutex> files_lock(m_files_mutex);
+
+		if (m_ring_failed || m_free_files.empty() || !m_ring->UpdateFile(m_free_files.back(), fd))
+			return nullptr;
+
+		const auto index = m_free_files.back();
+		m_free_files.pop_back();
+
+		return std::make_shared<registered_file>(shared_from_this(), index, fd);
+	}
+
+	//Reads length bytes at offset, handler is called on the reader's strand. Safe to call from any thread.
+	void Read(std::shared_ptr<registered_file> file, uint64_t offset, std::size_t length, read_handler handler)
+	{
+		asio::post(m_strand,
+			[self = shared_from_this(), file = std::move(file), offset, length, handler = std::move(handler)]() mutable -> void
+			{
+				self->m_waiting_reads.push_back({ std::move(file), offset, std::min(length, self->m_buffer_size), 0, std::move(handler) });
+				self->StartWaitingReads();
+			});
+	}
+
+	reader_stats GetStats() const
+	{
+		std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+		return m_stats;
+	}
+
+private:
+	struct read_operation
+	{
+		std::shared_ptr<registered_file> file;
+		uint64_t offset = 0;
+		std::size_t length = 0;
+		std::size_t bytes_read = 0;
+		read_handler handler;
+	};
+
+	asio::strand<asio::io_context::executor_type> m_strand;
+	std::unique_ptr<ftp_io_uring> m_ring;
+
+	unsigned char* m_buffers = nullptr;
+	std::size_t m_buffer_size;
+	std::vector<unsigned> m_free_buffers;
+
+	//in flight, by the index of the buffer they read into
+	std::vector<read_operation> m_reads_in_flight;
+	std::size_t m_reads_in_flight_count = 0;
+	std::deque<read_operation> m_waiting_reads;
+	bool m_submit_posted = false;
+	//set once a submit failed, the ring is not submitted to again and reads are done with pread on the strand
+	std::atomic<bool> m_ring_failed = false;
+
+	std::vector<unsigned> m_free_files;
+	std::mutex m_files_mutex;
+
+	reader_stats m_stats;
+	mutable std::mutex m_stats_mutex;
+
+	//buffers whose read_buffer was kept, see read_buffer::Keep
+	std::atomic<std::size_t> m_kept_buffers = 0;
+
+#if defined(FTP_HAS_IO_URING)
+	asio::posix::stream_descriptor m_completion_event;
+
+	ftp_file_reader(asio::io_context& context, std::size_t buffer_size)
+		: m_strand(asio::make_strand(context)), m_buffer_size(buffer_size), m_reads_in_flight(READ_BUFFER_COUNT), m_completion_event(context)
+	{}
+
+	bool Setup()
+	{
+		m_ring = ftp_io_uring::Create(QUEUE_DEPTH);
+
+		if (!m_ring)
+			return false;
+
+		void* buffers = ::mmap(nullptr, m_buffer_size * READ_BUFFER_COUNT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (buffers == MAP_FAILED)
+			return false;
+
+		m_buffers = static_cast<unsigned char*>(buffers);
+
+		std::vector<ftp_io_uring::buffer_region> regions;
+
+		for (unsigned i = 0; i < READ_BUFFER_COUNT; ++i)
+		{
+			regions.push_back({ m_buffers + i * m_buffer_size, m_buffer_size });
+			m_free_buffers.push_back(i);
+		}
+
+		for (unsigned i = 0; i < MAX_FILES; ++i)
+			m_free_files.push_back(i);
+
+		const int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (event_fd < 0)
+			return false;
+
+		m_completion_event.assign(event_fd);
+
+		//older kernels limit pinned memory to a few KB, those are left to pread as well
+		return m_ring->RegisterBuffers(regions) && m_ring->RegisterFiles(MAX_FILES) && m_ring->RegisterEventFd(event_fd);
+	}
+
+	void WaitForCompletions()
+	{
+		m_completion_event.async_wait(asio::posix::stream_descriptor::wait_read,
+			asio::bind_executor(m_strand,
+				[self = shared_from_this()](const asio::error_code& ec) -> void
+				{
+					if (ec)
+						return;
+
+					uint64_t signalled = 0;
+					(void)!::read(self->m_completion_event.native_handle(), &signalled, sizeof(signalled));
+
+					self->m_ring->ReapCompletions(
+						[&self](uint64_t buffer_index, int result) -> void
+						{
+							self->OnReadCompleted(static_cast<unsigned>(buffer_index), result);
+						});
+
+					self->WaitForCompletions();
+				}));
+	}
+#else
+	ftp_file_reader(asio::io_context& context, std::size_t buffer_size)
+		: m_strand(asio::make_strand(context)), m_buffer_size(buffer_size)
+	{}
+#endif
+
+	void StartWaitingReads()
+	{
+		while (!m_waiting_reads.empty() && !m_free_buffers.empty())
+		{
+			const auto buffer_index = m_free_buffers.back();
+			auto& operation = m_waiting_reads.front();
+
+			if (!m_ring_failed && !m_ring->PrepareReadFixed(operation.file->Index(), m_buffers + buffer_index * m_buffer_size, operation.length,
+				operation.offset, buffer_index, buffer_index))
+			{
+				break;
+			}
+
+			m_free_buffers.pop_back();
+			m_reads_in_flight[buffer_index] = std::move(operation);
+			m_waiting_reads.pop_front();
+			m_reads_in_flight_count++;
+
+			std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+			m_stats.max_reads_in_flight = std::max(m_stats.max_reads_in_flight, m_reads_in_flight_count);
+		}
+
+		SubmitLater();
+	}
+
+	//reads prepared by handlers that run before the submit are handed to the kernel together
+	void SubmitLater()
+	{
+		if (m_submit_posted)
+			return;
+
+		m_submit_posted = true;
+
+		asio::post(m_strand,
+			[self = shared_from_this()]() -> void
+			{
+				self->m_submit_posted = false;
+
+				if (!self->m_ring_failed && !self->m_ring->Submit())
+					self->AbandonRing();
+
+				if (self->m_ring_failed)
+					self->ReadInFlightWithoutRing();
+			});
+	}
+
+	//The reads left prepared in the ring would go to the kernel with the next submit, long after their buffers
+	//were handed on, so the ring is not submitted to again. Reads the kernel already took are waited for.
+	void AbandonRing()
+	{
+		std::cout << "File reader: io_uring submit failed, reading with pread from now on\n";
+
+		m_ring_failed = true;
+
+		if (m_ring->WaitForInFlight())
+		{
+			m_ring->ReapCompletions(
+				[this](uint64_t buffer_index, int result) -> void
+				{
+					OnReadCompleted(static_cast<unsigned>(buffer_index), result);
+				});
+		}
+	}
+
+	//Finishes every read in flight, from where the ring left it, with pread.
+	void ReadInFlightWithoutRing()
+	{
+		for (unsigned buffer_index = 0; buffer_index < m_reads_in_flight.size(); ++buffer_index)
+		{
+			auto& operation = m_reads_in_flight[buffer_index];
+
+			if (!operation.handler)
+				continue;
+
+#if defined(FTP_HAS_IO_URING)
+			auto* buffer = m_buffers + buffer_index * m_buffer_size;
+
+			while (operation.bytes_read < operation.length)
+			{
+				const auto result = ::pread(operation.file->Fd(), buffer + operation.bytes_read, operation.length - operation.bytes_read,
+					static_cast<off_t>(operation.offset + operation.bytes_read));
+
+				if (result < 0 && errno == EINTR)
+					continue;
+
+				if (result <= 0)
+					break;
+
+				operation.bytes_read += static_cast<std::size_t>(result);
+			}
+#endif
+
+			CompleteRead(buffer_index);
+		}
+	}
+
+	void OnReadCompleted(unsigned buffer_index, int result)
+	{
+		auto& operation = m_reads_in_flight[buffer_index];
+		auto* buffer = m_buffers + buffer_index * m_buffer_size;
+
+		//completions the ring delivers after it was abandoned, of reads already finished with pread
+		if (!operation.handler)
+			return;
+
+		if (result > 0)
+			operation.bytes_read += static_cast<std::size_t>(result);
+
+		//a short read before the end of the file continues where it stopped,
+		//without the ring it is left in flight for ReadInFlightWithoutRing
+		if (result > 0 && operation.bytes_read < operation.length
+			&& (m_ring_failed || m_ring->PrepareReadFixed(operation.file->Index(), buffer + operation.bytes_read, operation.length - operation.bytes_read,
+				operation.offset + operation.bytes_read, buffer_index, buffer_index)))
+		{
+			SubmitLater();
+			return;
+		}
+
+		CompleteRead(buffer_index);
+	}
+
+	void CompleteRead(unsigned buffer_index)
+	{
+		auto& operation = m_reads_in_flight[buffer_index];
+		auto* buffer = m_buffers + buffer_index * m_buffer_size;
+
+		auto completed = std::move(operation);
+		operation = read_operation();
+		m_reads_in_flight_count--;
+
+		{
+			std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+			m_stats.reads++;
+			m_stats.bytes_read += completed.bytes_read;
+		}
+
+		completed.handler(read_buffer(shared_from_this(), buffer_index, buffer, completed.bytes_read));
+	}
+
+	bool TryKeepBuffer()
+	{
+		auto kept = m_kept_buffers.load(std::memory_order_relaxed);
+
+		while (kept < MAX_KEPT_BUFFERS)
+		{
+			if (m_kept_buffers.compare_exchange_weak(kept, kept + 1, std::memory_order_relaxed))
+				return true;
+		}
+
+		return false;
+	}
+
+	void ReleaseBuffer(unsigned buffer_index, bool kept)
+	{
+		if (kept)
+			m_kept_buffers.fetch_sub(1, std::memory_order_relaxed);
+
+		asio::post(m_strand,
+			[self = shared_from_this(), buffer_index]() -> void
+			{
+				self->m_free_buffers.push_back(buffer_index);
+				self->StartWaitingReads();
+			});
+	}
+
+	void UnregisterFile(unsigned file_index)
+	{
+		std::lock_guard<std::mutex> files_lock(m_files_mutex);
+
+		m_ring->UpdateFile(file_index, -1);
+		m_free_files.push_back(file_index);
+	}
+};
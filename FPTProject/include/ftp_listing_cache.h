@@ -0,0 +1,306 @@
+#pragma once
+#include<cstdint>
+#include<filesystem>
+#include<list>
+#include<map>
+#include<string>
+#include<unordered_map>
+#include<vector>
+#include"ftp_request.h"
+
+#if defined(__linux__)
+#include<cerrno>
+#include<sys/inotify.h>
+#include<unistd.h>
+#define FTP_HAS_INOTIFY 1
+#endif
+
+//Encoded listings by directory path, so listing a directory again costs no directory scan.
+//A directory can have several listings, ex. the CHANGE_DIRECTORY response and the LIST_DIRECTORY pages
+//for a page size and order, each is one or more frames that share their payload with every connection they are written to.
+//On Linux each cached directory is watched with inotify and its listings are dropped on any change inside it.
+//Elsewhere a listing is valid while the directory's modification time stays the same, which catches files
+//being added, removed or renamed (uploads always end with a rename) but not files changed in place.
+//Listings are evicted least recently used first above MEMORY_CAP bytes or MAX_DIRECTORIES directories.
+//Not thread safe.
+class ftp_listing_cache
+{
+public:
+	static constexpr std::size_t MEMORY_CAP = 64 * 1024 * 1024;
+	static constexpr std::size_t MAX_DIRECTORIES = 1024;
+
+	//version of directories whose listings are never cached, ex. ones that could not be watched
+	static constexpr uint64_t UNCACHEABLE = ~0ull;
+
+	struct cache_stats
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t invalidations = 0;
+		uint64_t evictions = 0;
+		std::size_t listings = 0;
+		std::size_t memory = 0;
+	};
+
+	ftp_listing_cache()
+	{
+#if defined(FTP_HAS_INOTIFY)
+		m_inotify_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	}
+
+	~ftp_listing_cache()
+	{
+#if defined(FTP_HAS_INOTIFY)
+		if (m_inotify_fd >= 0)
+			::close(m_inotify_fd);
+#endif
+	}
+
+	ftp_listing_cache(const ftp_listing_cache&) = delete;
+	ftp_listing_cache& operator=(const ftp_listing_cache&) = delete;
+
+	//Copies the cached frames of directory's listing named variant into listing. On a miss, version receives
+	//what Insert needs to tell whether the directory changed while it was being listed.
+	bool Find(const std::string& directory, const std::string& variant, std::vector<ftp_frame>& listing, uint64_t& version)
+	{
+		DrainEvents();
+
+		auto* curr_entry = Watch(directory);
+		version = curr_entry ? CurrentVersion(directory, *curr_entry) : UNCACHEABLE;
+
+		if (curr_entry && version != UNCACHEABLE && curr_entry->version == version)
+		{
+			if (const auto listing_it = curr_entry->listings.find(variant); listing_it != curr_entry->listings.end())
+			{
+				m_stats.hits++;
+				listing = listing_it->second;
+				return true;
+			}
+		}
+
+		m_stats.misses++;
+		return false;
+	}
+
+	//Caches the listing unless the directory changed since Find returned version.
+	void Insert(const std::string& directory, const std::string& variant, uint64_t version, const std::vector<ftp_frame>& listing)
+	{
+		DrainEvents();
+
+		const auto entry_it = m_entries.find(directory);
+		const auto listing_size = ListingSize(listing);
+
+		if (version == UNCACHEABLE || entry_it == m_entries.end() || listing_size > MEMORY_CAP
+			|| CurrentVersion(directory, entry_it->second) != version)
+		{
+			return;
+		}
+
+		auto& curr_entry = entry_it->second;
+
+		//listings of an older version of the directory, modification times only change between Find calls
+		if (curr_entry.version != version)
+			DropListings(curr_entry);
+
+		if (const auto listing_it = curr_entry.listings.find(variant); listing_it != curr_entry.listings.end())
+		{
+			m_stats.memory -= ListingSize(listing_it->second);
+			curr_entry.listings.erase(listing_it);
+		}
+
+		curr_entry.version = version;
+		curr_entry.listings[variant] = listing;
+		m_stats.memory += listing_size;
+
+		EvictOverCap();
+	}
+
+	cache_stats GetStats() const
+	{
+		auto stats = m_stats;
+		stats.listings = m_entries.size();
+		return stats;
+	}
+
+private:
+	struct entry
+	{
+		std::map<std::string, std::vector<ftp_frame>> listings;
+		uint64_t version = 0;
+		int watch = -1;
+		std::list<std::string>::iterator lru_position;
+	};
+
+	std::unordered_map<std::string, entry> m_entries;
+	//most recently used first
+	std::list<std::string> m_lru;
+	cache_stats m_stats;
+
+	int m_inotify_fd = -1;
+	std::unordered_map<int, std::string> m_watched_directories;
+
+	//Entry of the directory, moved to the front of the LRU list. With inotify, directories are watched
+	//from their first Find on, before they are listed, so changes made while they are listed are seen.
+	//Returns nullptr for directories that can't be cached.
+	entry* Watch(const std::string& directory)
+	{
+		if (const auto entry_it = m_entries.find(directory); entry_it != m_entries.end())
+		{
+			m_lru.splice(m_lru.begin(), m_lru, entry_it->second.lru_position);
+			return &entry_it->second;
+		}
+
+		entry new_entry;
+
+#if defined(FTP_HAS_INOTIFY)
+		if (m_inotify_fd < 0)
+			return nullptr;
+
+		new_entry.watch = ::inotify_add_watch(m_inotify_fd, directory.c_str(),
+			IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+
+		if (new_entry.watch < 0)
+			return nullptr;
+
+		//the same directory is already cached under another path
+		if (m_watched_directories.count(new_entry.watch) > 0)
+			return nullptr;
+
+		m_watched_directories[new_entry.watch] = directory;
+#endif
+
+		m_lru.push_front(directory);
+		new_entry.lru_position = m_lru.begin();
+
+		auto& inserted_entry = m_entries.insert({ directory, std::move(new_entry) }).first->second;
+		EvictOverCap();
+
+		return &inserted_entry;
+	}
+
+	//With inotify, the number of times the directory was seen changing; its modification time otherwise.
+	uint64_t CurrentVersion(const std::string& directory, const entry& curr_entry) const
+	{
+#if defined(FTP_HAS_INOTIFY)
+		(void)directory;
+		return curr_entry.version;
+#else
+		(void)curr_entry;
+		std::error_code ec;
+		const auto modified = std::filesystem::last_write_time(directory, ec);
+
+		if (ec)
+			return UNCACHEABLE;
+
+		return static_cast<uint64_t>(modified.time_since_epoch().count());
+#endif
+	}
+
+	//Drops the listings of the directories that changed since the last call.
+	void DrainEvents()
+	{
+#if defined(FTP_HAS_INOTIFY)
+		if (m_inotify_fd < 0)
+			return;
+
+		alignas(inotify_event) char events[16 * 1024];
+
+		while (true)
+		{
+			const auto length = ::read(m_inotify_fd, events, sizeof(events));
+
+			if (length <= 0)
+				break;
+
+			for (ssize_t offset = 0; offset < length; )
+			{
+				const auto* event = reinterpret_cast<const inotify_event*>(events + offset);
+				offset += sizeof(inotify_event) + event->len;
+
+				//events were lost, nothing cached can be trusted and watches of removed directories may be dead
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					while (!m_lru.empty())
+					{
+						Invalidate(m_entries.at(m_lru.back()));
+						RemoveDirectory(m_lru.back());
+					}
+
+					continue;
+				}
+
+				const auto watched_it = m_watched_directories.find(event->wd);
+
+				if (watched_it == m_watched_directories.end())
+					continue;
+
+				if (const auto entry_it = m_entries.find(watched_it->second); entry_it != m_entries.end())
+					Invalidate(entry_it->second);
+
+				//the watch is gone with the directory
+				if (event->mask & IN_IGNORED)
+					RemoveDirectory(watched_it->second);
+			}
+		}
+#endif
+	}
+
+	void Invalidate(entry& curr_entry)
+	{
+		m_stats.invalidations += curr_entry.listings.size();
+
+		curr_entry.version++;
+		DropListings(curr_entry);
+	}
+
+	void DropListings(entry& curr_entry)
+	{
+		for (const auto& [variant, listing] : curr_entry.listings)
+			m_stats.memory -= ListingSize(listing);
+
+		curr_entry.listings.clear();
+	}
+
+	static std::size_t ListingSize(const std::vector<ftp_frame>& listing)
+	{
+		std::size_t listing_size = 0;
+
+		for (const auto& frame : listing)
+			listing_size += frame.PayloadSize();
+
+		return listing_size;
+	}
+
+	void EvictOverCap()
+	{
+		while (!m_lru.empty() && (m_stats.memory > MEMORY_CAP || m_entries.size() > MAX_DIRECTORIES))
+		{
+			m_stats.evictions++;
+			RemoveDirectory(m_lru.back());
+		}
+	}
+
+	//by value, callers pass names owned by the entry that is removed
+	void RemoveDirectory(std::string directory)
+	{
+		const auto entry_it = m_entries.find(directory);
+
+		if (entry_it == m_entries.end())
+			return;
+
+		auto& curr_entry = entry_it->second;
+		DropListings(curr_entry);
+
+#if defined(FTP_HAS_INOTIFY)
+		if (curr_entry.watch >= 0)
+		{
+			::inotify_rm_watch(m_inotify_fd, curr_entry.watch);
+			m_watched_directories.erase(curr_entry.watch);
+		}
+#endif
+
+		m_lru.erase(curr_entry.lru_position);
+		m_entries.erase(entry_it);
+	}
+};
@@ -0,0 +1,314 @@
+#pragma once
+#include<asio.hpp>
+#include<algorithm>
+#include<cstring>
+#include<filesystem>
+#include<functional>
+#include<optional>
+#include<string>
+#include<vector>
+#include"ftpconnection.h"
+
+//Sends directory listings over one connection in LIST_DIRECTORY pages of up to page_size entries,
+//each with the payload [uint32 listing_id][uint8 last_page][file details...], listing_id echoing the request's.
+//Listings in DIRECTORY order are sent while the directory is read, so the first page of a huge directory
+//leaves before the rest of it was even read; other orders read the whole directory, sort it and then send it.
+//Either way the directory is read MAX_SCANNED_PER_STEP entries per handler, and pages are only produced
+//while the connection is writable, so neither the io thread nor the send queue is held by one listing.
+//A connection lists one directory at a time: a new listing ends the one in progress with an empty last page.
+//All listing state is touched only on the connection's io thread.
+class ftp_listing_stream : public std::enable_shared_from_this<ftp_listing_stream>
+{
+public:
+	static constexpr std::size_t DEFAULT_PAGE_SIZE = 1000;
+	static constexpr std::size_t MAX_PAGE_SIZE = 64 * 1024;
+	static constexpr std::size_t MAX_SCANNED_PER_STEP = 4096;
+
+	struct listing_request
+	{
+		std::filesystem::path directory;
+		std::size_t page_size = DEFAULT_PAGE_SIZE;
+		File::listing_order order = File::listing_order::DIRECTORY;
+		//only entries whose names start with it are listed
+		std::string name_prefix;
+		//never listed, ex. the chunk store
+		std::filesystem::path hidden_path;
+		//chosen by the client, sent back in every page
+		uint32_t listing_id = 0;
+	};
+
+	//Called on the io thread with every page of a listing that was sent in full.
+	using listed_handler = std::function<void(std::vector<ftp_frame>)>;
+
+	explicit ftp_listing_stream(std::shared_ptr<ftp_connection> t_receiver)
+		: m_receiver(std::move(t_receiver))
+	{}
+
+	//Safe to call from any thread.
+	void List(listing_request request, listed_handler on_listed = nullptr)
+	{
+		asio::post(m_receiver->GetExecutor(),
+			[self = shared_from_this(), request = std::move(request), on_listed = std::move(on_listed)]() mutable -> void
+			{
+				if (self->m_stopped)
+					return;
+
+				self->EndListing();
+
+				request.page_size = std::clamp<std::size_t>(request.page_size == 0 ? DEFAULT_PAGE_SIZE : request.page_size, 1, MAX_PAGE_SIZE);
+
+				auto& curr_listing = self->m_listing.emplace();
+				curr_listing.request = std::move(request);
+				curr_listing.on_listed = std::move(on_listed);
+
+				//a directory that can't be read is listed as empty
+				std::error_code ec;
+				curr_listing.next_entry = std::filesystem::directory_iterator(curr_listing.request.directory, ec);
+
+				self->ScheduleStep();
+			});
+	}
+
+	//Sends the pages of an earlier listing, ex. from ftp_listing_cache, as the pages of listing_id.
+	//Safe to call from any thread.
+	void Replay(std::vector<ftp_frame> pages, uint32_t listing_id)
+	{
+		asio::post(m_receiver->GetExecutor(),
+			[self = shared_from_this(), pages = std::move(pages), listing_id]() mutable -> void
+			{
+				if (self->m_stopped)
+					return;
+
+				self->EndListing();
+
+				for (auto& page : pages)
+					self->m_receiver->Write(WithListingId(page, listing_id));
+			});
+	}
+
+	//Drops the listing in progress. Safe to call from any thread.
+	void Stop()
+	{
+		asio::post(m_receiver->GetExecutor(),
+			[self = shared_from_this()]() -> void
+			{
+				self->m_stopped = true;
+				self->m_listing.reset();
+			});
+	}
+
+private:
+	struct listing
+	{
+		listing_request request;
+		std::filesystem::directory_iterator next_entry;
+		bool read_done = false;
+
+		//read and not sent yet from next_unsent on; sorted listings keep every entry until the last page
+		std::vector<File::FileDetails> entries;
+		std::size_t next_unsent = 0;
+
+		listed_handler on_listed;
+		std::vector<ftp_frame> sent_pages;
+	};
+
+	std::shared_ptr<ftp_connection> m_receiver;
+	std::optional<listing> m_listing;
+	bool m_step_scheduled = false;
+	bool m_stopped = false;
+
+	void ScheduleStep()
+	{
+		if (m_step_scheduled)
+			return;
+
+		m_step_scheduled = true;
+
+		asio::post(m_receiver->GetExecutor(),
+			[self = shared_from_this()]() -> void
+			{
+				self->m_step_scheduled = false;
+				self->Step();
+			});
+	}
+
+	void Step()
+	{
+		if (!m_listing)
+			return;
+
+		if (!m_receiver->IsSocketOpen())
+		{
+			m_listing.reset();
+			return;
+		}
+
+		if (!m_receiver->IsWritable())
+		{
+			m_step_scheduled = true;
+
+			m_receiver->NotifyWhenWritable(
+				[self = shared_from_this()]() -> void
+				{
+					self->m_step_scheduled = false;
+					self->Step();
+				});
+
+			return;
+		}
+
+		auto& curr_listing = *m_listing;
+		const auto page_size = curr_listing.request.page_size;
+		const bool sorted = curr_listing.request.order != File::listing_order::DIRECTORY;
+
+		if (!curr_listing.read_done)
+			ReadEntries(curr_listing);
+
+		//a sorted listing has no first page before the whole directory was read
+		while ((!sorted || curr_listing.read_done) && m_receiver->IsWritable())
+		{
+			const auto unsent = curr_listing.entries.size() - curr_listing.next_unsent;
+
+			if (curr_listing.read_done && unsent <= page_size)
+			{
+				SendPage(curr_listing, unsent, true);
+
+				if (curr_listing.on_listed)
+					curr_listing.on_listed(std::move(curr_listing.sent_pages));
+
+				m_listing.reset();
+				return;
+			}
+
+			if (unsent < page_size)
+				break;
+
+			SendPage(curr_listing, page_size, false);
+		}
+
+		if (!sorted)
+		{
+			curr_listing.entries.erase(curr_listing.entries.begin(), curr_listing.entries.begin() + curr_listing.next_unsent);
+			curr_listing.next_unsent = 0;
+		}
+
+		ScheduleStep();
+	}
+
+	static void ReadEntries(listing& curr_listing)
+	{
+		const auto& request = curr_listing.request;
+		const std::filesystem::directory_iterator end_entry;
+
+		std::error_code ec;
+
+		for (std::size_t scanned = 0; curr_listing.next_entry != end_entry && scanned < MAX_SCANNED_PER_STEP; ++scanned)
+		{
+			const auto& entry = *curr_listing.next_entry;
+			auto file_name = entry.path().filename().string();
+
+			if (file_name.compare(0, request.name_prefix.size(), request.name_prefix) == 0
+				&& entry.path().lexically_normal() != request.hidden_path)
+			{
+				const bool is_directory = entry.is_directory(ec);
+				const auto file_size = is_directory ? 0 : entry.file_size(ec);
+
+				curr_listing.entries.emplace_back(file_name, ec ? 0 : static_cast<std::size_t>(file_size),
+					is_directory ? File::file_type::DIR : File::file_type::FILE, File::FileTime(entry.path()));
+			}
+
+			//entries that vanish while the directory is read end the listing early
+			curr_listing.next_entry.increment(ec);
+
+			if (ec)
+				curr_listing.next_entry = end_entry;
+		}
+
+		if (curr_listing.next_entry == end_entry)
+		{
+			curr_listing.read_done = true;
+			Sort(curr_listing.entries, request.order);
+		}
+	}
+
+	static void Sort(std::vector<File::FileDetails>& entries, File::listing_order order)
+	{
+		switch (order)
+		{
+		case File::listing_order::NAME:
+			std::sort(entries.begin(), entries.end(),
+				[](const File::FileDetails& left, const File::FileDetails& right) -> bool
+				{
+					return left.file_name < right.file_name;
+				});
+			break;
+
+		case File::listing_order::SIZE:
+			std::sort(entries.begin(), entries.end(),
+				[](const File::FileDetails& left, const File::FileDetails& right) -> bool
+				{
+					return left.file_size != right.file_size ? left.file_size > right.file_size : left.file_name < right.file_name;
+				});
+			break;
+
+		case File::listing_order::TIME:
+			std::sort(entries.begin(), entries.end(),
+				[](const File::FileDetails& left, const File::FileDetails& right) -> bool
+				{
+					return left.file_time != right.file_time ? left.file_time > right.file_time : left.file_name < right.file_name;
+				});
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	void SendPage(listing& curr_listing, std::size_t entry_count, bool last_page)
+	{
+		ftp_request page;
+		page.header.operation = ftp_request_header::ftp_operation::LIST_DIRECTORY;
+
+		uint8_t last_page_flag = last_page ? 1 : 0;
+		page.InsertTrivialToBuffer(curr_listing.request.listing_id, last_page_flag);
+
+		for (std::size_t i = 0; i < entry_count; ++i)
+		{
+			auto& entry = curr_listing.entries[curr_listing.next_unsent + i];
+			File::InsertFileDetails(page, entry.file_name, entry.file_size, entry.type, entry.file_time);
+		}
+
+		curr_listing.next_unsent += entry_count;
+
+		auto page_frame = std::move(page).Freeze();
+
+		if (curr_listing.on_listed)
+			curr_listing.sent_pages.push_back(page_frame);
+
+		m_receiver->Write(std::move(page_frame));
+	}
+
+	//cached pages carry the id of the listing they were first sent for, the copy gets the new one
+	static ftp_frame WithListingId(const ftp_frame& page, uint32_t listing_id)
+	{
+		auto payload = *page.payload;
+
+		if (payload.size() >= sizeof(listing_id))
+			std::memcpy(payload.data(), &listing_id, sizeof(listing_id));
+
+		ftp_frame replayed_page = page;
+		replayed_page.payload = std::make_shared<const std::vector<unsigned char>>(std::move(payload));
+
+		return replayed_page;
+	}
+
+	//the client still waits for the last page of a listing that is dropped
+	void EndListing()
+	{
+		if (!m_listing)
+			return;
+
+		SendPage(*m_listing, 0, true);
+		m_listing.reset();
+	}
+};
@@ -0,0 +1,220 @@
+#pragma once
+#include<atomic>
+#include<condition_variable>
+#include<cstdint>
+#include<functional>
+#include<memory>
+#include<mutex>
+#include<vector>
+
+//Bounded multi-producer/single-consumer queue.
+//Producers (io threads) and the consumer (request dispatcher) never share a lock on the fast path:
+//slots are claimed with a CAS on the enqueue position and published through per-slot sequence numbers.
+//The mutex and condition variables are only used to put an idle consumer, or producers facing a full queue, to sleep;
+//they are only signalled when someone is actually waiting.
+template<class T>
+class ftp_mpsc_queue
+{
+public:
+	explicit ftp_mpsc_queue(std::size_t min_capacity)
+	{
+		std::size_t capacity = 2;
+		while (capacity < min_capacity)
+			capacity <<= 1;
+
+		m_cells = std::make_unique<cell[]>(capacity);
+		m_mask = capacity - 1;
+
+		for (std::size_t i = 0; i < capacity; ++i)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	ftp_mpsc_queue(const ftp_mpsc_queue&) = delete;
+	ftp_mpsc_queue& operator=(const ftp_mpsc_queue&) = delete;
+
+	//Called by the producer after each value it queued, for consumers that wait in an event loop rather than on the queue.
+	//Must be set before any producer runs.
+	void SetPushHandler(std::function<void()> on_pushed)
+	{
+		m_on_pushed = std::move(on_pushed);
+	}
+
+	//Returns false without touching value when the queue is full.
+	bool TryPush(T&& value)
+	{
+		cell* target;
+		auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			target = &m_cells[pos & m_mask];
+			const auto sequence = target->sequence.load(std::memory_order_acquire);
+			const auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+
+			if (diff == 0)
+			{
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+
+			else
+				pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		}
+
+		target->value = std::move(value);
+		target->sequence.store(pos + 1, std::memory_order_release);
+
+		if (m_on_pushed)
+			m_on_pushed();
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_consumer_waiting.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> wait_lock(m_wait_mutex);
+			m_consumer_cond.notify_one();
+		}
+
+		return true;
+	}
+
+	//Blocks the producer while the queue is full. Returns false if the queue was closed meanwhile.
+	bool Push(T&& value)
+	{
+		while (!TryPush(std::move(value)))
+		{
+			std::unique_lock<std::mutex> wait_lock(m_wait_mutex);
+			m_producers_waiting.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			m_producer_cond.wait(wait_lock, [this]() -> bool
+				{
+					return m_closed || !Full();
+				});
+
+			m_producers_waiting.fetch_sub(1, std::memory_order_relaxed);
+
+			if (m_closed)
+				return false;
+		}
+
+		return true;
+	}
+
+	//Consumer only.
+	bool TryPop(T& value)
+	{
+		auto& source = m_cells[m_dequeue_pos & m_mask];
+		const auto sequence = source.sequence.load(std::memory_order_acquire);
+
+		if (static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(m_dequeue_pos + 1) < 0)
+			return false;
+
+		value = std::move(source.value);
+		source.sequence.store(m_dequeue_pos + m_mask + 1, std::memory_order_release);
+		++m_dequeue_pos;
+
+		return true;
+	}
+
+	//Consumer only. Moves up to max_count queued values to the back of out and returns how many were moved.
+	std::size_t DrainInto(std::vector<T>& out, std::size_t max_count)
+	{
+		std::size_t drained = 0;
+		T value;
+
+		while (drained < max_count && TryPop(value))
+		{
+			out.push_back(std::move(value));
+			drained++;
+		}
+
+		if (drained > 0)
+			WakeProducers();
+
+		return drained;
+	}
+
+	//Consumer only. Sleeps until something is queued or the queue is closed, then drains like DrainInto.
+	std::size_t WaitAndDrainInto(std::vector<T>& out, std::size_t max_count)
+	{
+		while (true)
+		{
+			if (const auto drained = DrainInto(out, max_count); drained > 0)
+				return drained;
+
+			std::unique_lock<std::mutex> wait_lock(m_wait_mutex);
+			m_consumer_waiting.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			m_consumer_cond.wait(wait_lock, [this]() -> bool
+				{
+					return m_closed || !Empty();
+				});
+
+			m_consumer_waiting.store(false, std::memory_order_relaxed);
+
+			if (m_closed && Empty())
+				return 0;
+		}
+	}
+
+	//Consumer only.
+	bool Empty() const
+	{
+		const auto sequence = m_cells[m_dequeue_pos & m_mask].sequence.load(std::memory_order_acquire);
+		return static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(m_dequeue_pos + 1) < 0;
+	}
+
+	//Wakes every waiting producer and the consumer, nothing blocks on the queue afterwards.
+	void Close()
+	{
+		{
+			std::lock_guard<std::mutex> wait_lock(m_wait_mutex);
+			m_closed = true;
+		}
+
+		m_consumer_cond.notify_all();
+		m_producer_cond.notify_all();
+	}
+
+private:
+	struct cell
+	{
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<cell[]> m_cells;
+	std::size_t m_mask;
+
+	alignas(64) std::atomic<std::size_t> m_enqueue_pos = 0;
+	alignas(64) std::size_t m_dequeue_pos = 0;
+
+	std::mutex m_wait_mutex;
+	std::condition_variable m_consumer_cond;
+	std::condition_variable m_producer_cond;
+	std::atomic_bool m_consumer_waiting = false;
+	std::atomic<std::size_t> m_producers_waiting = 0;
+	bool m_closed = false;
+
+	std::function<void()> m_on_pushed;
+
+	bool Full() const
+	{
+		const auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		const auto sequence = m_cells[pos & m_mask].sequence.load(std::memory_order_acquire);
+		return static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos) < 0;
+	}
+
+	void WakeProducers()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_producers_waiting.load(std::memory_order_relaxed) > 0)
+		{
+			std::lock_guard<std::mutex> wait_lock(m_wait_mutex);
+			m_producer_cond.notify_all();
+		}
+	}
+};
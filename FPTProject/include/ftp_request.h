@@ -1,10 +1,26 @@
 #pragma once
 #include <filesystem>
+#include<algorithm>
 #include<fstream>
 #include<vector>
+#include<deque>
 #include<iostream>
+#include<cstring>
+#include<atomic>
+#include<memory>
+#include<mutex>
+#include<stdexcept>
+#include<string_view>
+#include<type_traits>
+#include"ftp_buffer_pool.h"
+#include"ftp_checksum.h"
+#include"ftp_compression.h"
+#include"ftp_dedup.h"
+#include"ftp_delta.h"
 
 class ftp_connection;
+class ftp_file_handle;
+struct ftp_frame;
 
 struct ftp_request_header
 {
@@ -31,15 +47,53 @@ struct ftp_request_header
 		UPLOAD_ACCEPT,
 		UPLOAD_REJECT,
 		UPLOAD_DATA,
-		UPLOAD_FINISHED
+		//the client's digest of an uploaded file, answered with UPLOAD_RESULT, the server's verdict on it
+		UPLOAD_FINISHED,
+		UPLOAD_RESULT,
+
+		//download file operations
+		DOWNLOAD_START,
+
+		//codecs offered by the client and the one chosen by the server, see ftp_connection::OfferCompression
+		NEGOTIATE_COMPRESSION,
+
+		//integrity checks, see ftp_crc32c and ftp_file_digest
+		DOWNLOAD_FINISHED,
+		CHUNK_CORRUPT,
+
+		//chunk hashes of a file sent ahead of its bytes, answered with the chunks the server is missing, see ftp_cdc
+		UPLOAD_DEDUP,
+
+		//block signatures of the server's copy of a file, and the delta of the new version against them, see ftp_delta
+		UPLOAD_DELTA,
+		DELTA_INSTRUCTIONS,
+
+		//directory listing sent in pages while the directory is read, see ftp_listing_stream
+		LIST_DIRECTORY
 	};
 
 	ftp_operation operation;
+	//takes the padding in front of request_size, so the header size is unchanged
+	ftp_compression compression = ftp_compression::NONE;
 	uint64_t request_size = 0;
 
 };
 
 
+//Non-owning view over a block of bytes inside a request payload.
+struct ftp_byte_view
+{
+	const unsigned char* bytes = nullptr;
+	std::size_t length = 0;
+
+	const unsigned char* data() const { return bytes; }
+	std::size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+
+	const char* chars() const { return reinterpret_cast<const char*>(bytes); }
+};
+
+
 struct ftp_request
 {
 	ftp_request_header header;
@@ -48,6 +102,16 @@ struct ftp_request
 
 	ftp_request() = default;
 
+	ftp_request(const ftp_request&) = default;
+	ftp_request(ftp_request&&) = default;
+	ftp_request& operator=(const ftp_request&) = default;
+	ftp_request& operator=(ftp_request&&) = default;
+
+	//borrowed chunk buffers go back to the pool, see ReserveBuffer
+	~ftp_request()
+	{
+		ftp_buffer_pool::Shared().Release(std::move(mem_buffer));
+	}
 
 	auto GetSize() const
 	{
@@ -78,44 +142,6 @@ struct ftp_request
 	}
 
 
-	//Variadic template to extract only trivially copyable parameters from the ftp_request.
-	//The order of the given parameters must agree with the order of the packed parameters.
-	template<class Arg, class... Data>
-	void ExtractTrivialFromBuffer(Arg& arg, Data&... data)
-	{
-
-		std::memcpy(&arg, mem_buffer.data(), sizeof Arg);
-
-		mem_buffer.erase(mem_buffer.cbegin(), mem_buffer.cbegin() + sizeof Arg);
-		
-		//mem_buffer = std::vector<uint8_t>{ mem_buffer.cbegin() + sizeof(Arg), mem_buffer.cend() };
-
-		header.request_size = GetSize();
-
-		if constexpr (sizeof...(data) > 0u)
-			ExtractTrivialFromBuffer(data...);
-	}
-
-
-	//Extraction and insertion of not trivially copyable structures, ex. string.
-	void ExtractStringFromBuffer(std::string& str)
-	{
-		//extracting string length
-		//it should always be inserted BEFORE corresponding string
-		//other way, can't determine the length, so extracting is not possible
-		std::size_t str_length;
-		ExtractTrivialFromBuffer(str_length);
-
-
-		std::vector<unsigned char> str_binary(mem_buffer.cbegin(), mem_buffer.cbegin() + str_length);
-		std::string extract_str(str_binary.cbegin(), str_binary.cend());
-
-		mem_buffer.erase(mem_buffer.cbegin(), mem_buffer.cbegin() + str_length);
-
-		header.request_size = GetSize();
-		str = extract_str;
-	}
-
 	void InsertStringToBuffer(std::string& str)
 	{
 		//always inserting string length before actual string.
@@ -147,22 +173,311 @@ struct ftp_request
 		header.request_size = GetSize();
 	}
 
-	template<typename VecArg>
-	void ExtractToVector(std::vector<VecArg>& extract_to)
+	//Makes room for a payload of total_size bytes.
+	//Chunk sized payloads are moved into a buffer borrowed from ftp_buffer_pool.
+	void ReserveBuffer(std::size_t total_size)
 	{
-		std::size_t file_size;
-		ExtractTrivialFromBuffer(file_size);
+		if (mem_buffer.capacity() >= total_size || !ftp_buffer_pool::IsChunkSized(total_size))
+		{
+			mem_buffer.reserve(total_size);
+			return;
+		}
 
-		std::copy(
-			mem_buffer.cbegin(),
-			mem_buffer.cbegin() + file_size,
-			std::back_inserter(extract_to)
-		);
+		auto borrowed = ftp_buffer_pool::Shared().Acquire();
+		borrowed.assign(mem_buffer.cbegin(), mem_buffer.cend());
+		mem_buffer.swap(borrowed);
+	}
 
-		mem_buffer.erase(mem_buffer.cbegin(), mem_buffer.cbegin() + file_size);
+	//Length-prefixed byte block read straight from the stream into the request buffer,
+	//so file chunks don't go through an intermediate vector. Returns the number of bytes read.
+	std::size_t InsertBytesFromStream(std::istream& src, std::size_t count)
+	{
+		ReserveBuffer(mem_buffer.size() + sizeof(count) + count);
+		InsertTrivialToBuffer(count);
+
+		const auto length_position = mem_buffer.size() - sizeof(count);
+		const auto block_start = mem_buffer.size();
+		mem_buffer.resize(block_start + count);
+		src.read(reinterpret_cast<char*>(mem_buffer.data() + block_start), count);
+
+		//a short read, ex. of a file truncated meanwhile, only packs the bytes that were read
+		const auto read_count = static_cast<std::size_t>(src.gcount());
+		mem_buffer.resize(block_start + read_count);
+		std::memcpy(mem_buffer.data() + length_position, &read_count, sizeof(read_count));
+
+		header.request_size = GetSize();
+		return read_count;
+	}
+
+	//Replaces the payload with its size followed by the payload compressed with codec, and marks the header.
+	//Returns false, leaving the request as it was, when samples of the payload or the payload itself
+	//do not compress well enough, see ftp_chunk_codec.
+	bool Compress(ftp_compression codec)
+	{
+		if (header.compression != ftp_compression::NONE || !ftp_chunk_codec::LooksCompressible(codec, mem_buffer.data(), mem_buffer.size()))
+			return false;
+
+		const uint64_t raw_size = mem_buffer.size();
+		const auto compressed_limit = ftp_chunk_codec::CompressedLimit(mem_buffer.size());
+
+		ftp_request compressed_request;
+		compressed_request.ReserveBuffer(sizeof(raw_size) + compressed_limit);
+		compressed_request.mem_buffer.resize(sizeof(raw_size) + compressed_limit);
+		std::memcpy(compressed_request.mem_buffer.data(), &raw_size, sizeof(raw_size));
+
+		const auto compressed_size = ftp_chunk_codec::CompressBytes(codec, mem_buffer.data(), mem_buffer.size(),
+			compressed_request.mem_buffer.data() + sizeof(raw_size), compressed_limit);
+
+		if (compressed_size == 0)
+			return false;
+
+		compressed_request.mem_buffer.resize(sizeof(raw_size) + compressed_size);
+
+		//the raw payload leaves with compressed_request and goes back to the pool if it was borrowed
+		mem_buffer.swap(compressed_request.mem_buffer);
+		header.compression = codec;
+		header.request_size = GetSize();
+		return true;
+	}
+
+	//Restores the payload of a compressed request. Returns false for payloads that can't be decompressed.
+	bool Decompress()
+	{
+		if (header.compression == ftp_compression::NONE)
+			return true;
+
+		uint64_t raw_size;
+
+		if (mem_buffer.size() < sizeof(raw_size))
+			return false;
+
+		std::memcpy(&raw_size, mem_buffer.data(), sizeof(raw_size));
+
+		if (raw_size > ftp_chunk_codec::MAX_DECOMPRESSED_SIZE)
+			return false;
+
+		ftp_request raw_request;
+		raw_request.ReserveBuffer(raw_size);
+		raw_request.mem_buffer.resize(raw_size);
+
+		if (!ftp_chunk_codec::DecompressBytes(header.compression, mem_buffer.data() + sizeof(raw_size), mem_buffer.size() - sizeof(raw_size),
+			raw_request.mem_buffer.data(), raw_size))
+			return false;
+
+		mem_buffer.swap(raw_request.mem_buffer);
+		header.compression = ftp_compression::NONE;
+		header.request_size = GetSize();
+		return true;
+	}
+
+	//File chunk: CRC32C of the chunk bytes followed by the bytes as a length-prefixed block, see ftp_request_reader::ReadChunk.
+	//Returns a view of the bytes inside the request, ex. to add them to a file digest.
+	ftp_byte_view InsertChunkFromStream(std::istream& src, std::size_t count)
+	{
+		uint32_t crc = 0;
+		InsertTrivialToBuffer(crc);
+		const auto crc_position = GetSize() - sizeof(crc);
+
+		const auto read_count = InsertBytesFromStream(src, count);
+
+		const auto* chunk_bytes = mem_buffer.data() + GetSize() - read_count;
+		crc = ftp_crc32c::Compute(chunk_bytes, read_count);
+		std::memcpy(mem_buffer.data() + crc_position, &crc, sizeof(crc));
+
+		return { chunk_bytes, read_count };
+	}
+
+	//Same chunk layout, with the bytes read straight into the request by read_into(dest, count), which returns how many it read.
+	//Only the bytes read are packed and checksummed.
+	template<typename chunk_reader>
+	ftp_byte_view InsertChunkRead(std::size_t count, chunk_reader&& read_into)
+	{
+		uint32_t crc = 0;
+		ReserveBuffer(GetSize() + sizeof(crc) + sizeof(count) + count);
+		InsertTrivialToBuffer(crc, count);
+
+		const auto crc_position = GetSize() - sizeof(count) - sizeof(crc);
+		const auto block_start = GetSize();
+		mem_buffer.resize(block_start + count);
+
+		const auto read_count = std::min(read_into(mem_buffer.data() + block_start, count), count);
+		mem_buffer.resize(block_start + read_count);
+
+		const auto* chunk_bytes = mem_buffer.data() + block_start;
+		crc = ftp_crc32c::Compute(chunk_bytes, read_count);
+		std::memcpy(mem_buffer.data() + crc_position, &crc, sizeof(crc));
+		std::memcpy(mem_buffer.data() + crc_position + sizeof(crc), &read_count, sizeof(read_count));
+
+		header.request_size = GetSize();
+		return { chunk_bytes, read_count };
+	}
+
+	//Same chunk layout for bytes that are already in memory and checksummed.
+	void InsertChunk(const unsigned char* chunk_bytes, std::size_t count, uint32_t crc)
+	{
+		ReserveBuffer(GetSize() + sizeof(crc) + sizeof(count) + count);
+		InsertTrivialToBuffer(crc, count);
 
+		mem_buffer.insert(mem_buffer.end(), chunk_bytes, chunk_bytes + count);
 		header.request_size = GetSize();
 	}
+
+	//Turns the request into an immutable, refcounted frame ready to be written.
+	//The payload is moved, not copied, and the frame can be queued on any number of connections.
+	ftp_frame Freeze() &&;
+};
+
+
+//Request as it sits in a connection's write queue.
+//Copying a frame only copies the header and bumps the payload refcount.
+struct ftp_frame
+{
+	ftp_request_header header;
+	std::shared_ptr<const std::vector<unsigned char>> payload;
+
+	//Optional part of the body in memory owned elsewhere, sent in the same write right after the payload.
+	//The frame keeps its owner alive until the frame is written.
+	std::shared_ptr<const unsigned char> memory_tail = nullptr;
+	std::size_t memory_tail_length = 0;
+
+	//Optional part of the body sent straight from a file after the in-memory payload.
+	std::shared_ptr<ftp_file_handle> file_tail = nullptr;
+	uint64_t file_tail_offset = 0;
+	std::size_t file_tail_length = 0;
+
+	const unsigned char* PayloadData() const
+	{
+		return payload ? payload->data() : nullptr;
+	}
+
+	std::size_t PayloadSize() const
+	{
+		return payload ? payload->size() : 0;
+	}
+
+	void AttachMemoryTail(std::shared_ptr<const unsigned char> bytes, std::size_t length)
+	{
+		memory_tail = std::move(bytes);
+		memory_tail_length = length;
+
+		header.request_size = PayloadSize() + memory_tail_length + file_tail_length;
+	}
+
+	void AttachFileTail(std::shared_ptr<ftp_file_handle> file, uint64_t offset, std::size_t length)
+	{
+		file_tail = std::move(file);
+		file_tail_offset = offset;
+		file_tail_length = length;
+
+		header.request_size = PayloadSize() + memory_tail_length + file_tail_length;
+	}
+};
+
+inline ftp_frame ftp_request::Freeze() &&
+{
+	header.request_size = GetSize();
+
+	if (!ftp_buffer_pool::Shared().Owns(mem_buffer))
+		return { header, std::make_shared<const std::vector<unsigned char>>(std::move(mem_buffer)) };
+
+	//the last frame sharing a pooled payload hands the buffer back
+	std::shared_ptr<const std::vector<unsigned char>> pooled_payload(
+		new std::vector<unsigned char>(std::move(mem_buffer)),
+		[](const std::vector<unsigned char>* payload) -> void
+		{
+			auto* released = const_cast<std::vector<unsigned char>*>(payload);
+			ftp_buffer_pool::Shared().Release(std::move(*released));
+			delete released;
+		});
+
+	return { header, std::move(pooled_payload) };
+}
+
+
+
+//Read cursor over the payload of a received ftp_request.
+//Fields are decoded in place by advancing the cursor, the request buffer itself is never modified,
+//so decoding a payload of any size costs one pass over it.
+//The reader does not own the data, the request must outlive it.
+class ftp_request_reader
+{
+public:
+	explicit ftp_request_reader(const ftp_request& req)
+		: m_data(req.mem_buffer.data()), m_size(req.mem_buffer.size())
+	{}
+
+	ftp_request_reader(const unsigned char* t_data, std::size_t t_size)
+		: m_data(t_data), m_size(t_size)
+	{}
+
+	std::size_t Remaining() const
+	{
+		return m_size - m_offset;
+	}
+
+	bool Empty() const
+	{
+		return Remaining() == 0;
+	}
+
+	//Variadic template to read only trivially copyable parameters from the payload.
+	//The order of the given parameters must agree with the order of the packed parameters.
+	template<class Arg, class... Data>
+	void ReadTrivial(Arg& arg, Data&... data)
+	{
+		static_assert(std::is_trivially_copyable_v<Arg>, "Only trivially copyable types can be read directly.");
+
+		std::memcpy(&arg, Take(sizeof(Arg)), sizeof(Arg));
+
+		if constexpr (sizeof...(data) > 0u)
+			ReadTrivial(data...);
+	}
+
+	//Strings are always packed with their length first, see ftp_request::InsertStringToBuffer.
+	std::string_view ReadStringView()
+	{
+		const auto bytes = ReadBytes();
+		return { bytes.chars(), bytes.size() };
+	}
+
+	void ReadString(std::string& str)
+	{
+		str.assign(ReadStringView());
+	}
+
+	//Chunk as packed by ftp_request::InsertChunkFromStream. Returns false if the bytes don't match their CRC32C.
+	bool ReadChunk(ftp_byte_view& chunk)
+	{
+		uint32_t crc;
+		ReadTrivial(crc);
+		chunk = ReadBytes();
+
+		return ftp_crc32c::Compute(chunk.data(), chunk.size()) == crc;
+	}
+
+	//Length-prefixed byte block, as packed by ftp_request::CopyFromVector.
+	ftp_byte_view ReadBytes()
+	{
+		std::size_t block_length;
+		ReadTrivial(block_length);
+
+		return { Take(block_length), block_length };
+	}
+
+private:
+	const unsigned char* m_data;
+	std::size_t m_size;
+	std::size_t m_offset = 0;
+
+	const unsigned char* Take(std::size_t count)
+	{
+		if (count > Remaining())
+			throw std::out_of_range("ftp_request_reader: read past the end of the payload");
+
+		const auto* field = m_data + m_offset;
+		m_offset += count;
+		return field;
+	}
 };
 
 namespace File
@@ -173,6 +488,16 @@ namespace File
 		FILE
 	};
 
+	//order of LIST_DIRECTORY pages; DIRECTORY is the order entries are read in, the only one whose first page
+	//is sent before the whole directory was read. SIZE and TIME put the largest and newest files first.
+	enum class listing_order : uint32_t
+	{
+		DIRECTORY,
+		NAME,
+		SIZE,
+		TIME
+	};
+
 	//information about files
 	//used in client application
 	struct FileDetails
@@ -181,9 +506,11 @@ namespace File
 		std::string file_name;
 		std::size_t file_size;
 		file_type type;
+		//last write time on the server, used to resume downloads only from the same version of the file
+		int64_t file_time = 0;
 		FileDetails() {}
-		FileDetails(std::string& t_file_name, std::size_t t_file_size, file_type t_type)
-			: file_name(std::move(t_file_name)), file_size(t_file_size), type(t_type) {}
+		FileDetails(std::string& t_file_name, std::size_t t_file_size, file_type t_type, int64_t t_file_time = 0)
+			: file_name(std::move(t_file_name)), file_size(t_file_size), type(t_type), file_time(t_file_time) {}
 	};
 
 	//file that is being downloaded from client/server
@@ -194,6 +521,18 @@ namespace File
 		const std::size_t file_size = 0;
 		std::size_t remaining_bytes;
 		std::shared_ptr<ftp_connection> sender;
+		//bytes are written to partial_path and the file is moved to file_path once complete, see PartialFileName
+		std::string file_path;
+		std::string partial_path;
+		//version of the source file, see PartialFileName
+		int64_t file_time = 0;
+		//of the bytes received so far
+		ftp_file_digest digest;
+		//set when bytes are written at their offsets rather than appended through file_dest, see ftp_disk_writer
+		std::shared_ptr<ftp_file_handle> file_handle;
+		//held while received bytes are handed to the disk writer, so none follow the close of an upload another one took over
+		std::mutex write_mutex;
+		std::atomic<bool> cancelled = false;
 		FileRemote() {}
 		FileRemote(std::shared_ptr<std::ofstream> t_file_dest, std::size_t t_file_size, std::string& t_file_name, std::shared_ptr<ftp_connection> t_sen = nullptr)
 		:  file_dest(std::move(t_file_dest)), file_size(t_file_size), remaining_bytes(t_file_size), file_name(t_file_name), sender(t_sen)
@@ -205,9 +544,13 @@ namespace File
 	struct FileLocal
 	{
 		int client_file_id;
+		//of the bytes sent so far, compared with the receiver's digest after the last chunk
+		ftp_file_digest digest;
 		std::shared_ptr<std::ifstream> file_src;
 		std::size_t remaining_bytes;
 		std::shared_ptr<ftp_connection> receiver;
+		//(offset, length) ranges that are sent, in order, instead of the file from its current position, see UPLOAD_DEDUP
+		std::deque<std::pair<uint64_t, uint64_t>> send_ranges;
 		FileLocal() {}
 		FileLocal(std::shared_ptr<std::ifstream> t_file_src, std::size_t t_file_size, int t_file_id, std::shared_ptr<ftp_connection> t_rec = nullptr)
 		:  file_src(std::move(t_file_src)), remaining_bytes(t_file_size), client_file_id(t_file_id), receiver(std::move(t_rec))
@@ -218,15 +561,52 @@ namespace File
 
 
 	//helper methods to ease inserting/extracting file details from requests
-	static void InsertFileDetails(ftp_request& request, std::string& file_name, std::size_t& file_size, file_type& f_type)
+	static void InsertFileDetails(ftp_request& request, std::string& file_name, std::size_t& file_size, file_type& f_type, int64_t& file_time)
 	{
 		request.InsertStringToBuffer(file_name);
-		request.InsertTrivialToBuffer(file_size, f_type);
+		request.InsertTrivialToBuffer(file_size, f_type, file_time);
 	}
 
-	static void ExtractFileDetails(ftp_request& request, std::string& file_name, std::size_t& file_size, file_type& f_type)
+	static void ExtractFileDetails(ftp_request_reader& reader, std::string& file_name, std::size_t& file_size, file_type& f_type, int64_t& file_time)
 	{
-		request.ExtractStringFromBuffer(file_name);
-		request.ExtractTrivialFromBuffer(file_size, f_type);
+		reader.ReadString(file_name);
+		reader.ReadTrivial(file_size, f_type, file_time);
+	}
+
+	//Last write time as a plain number. It is only ever compared with times taken on the same machine.
+	static int64_t FileTime(const std::filesystem::path& file_path)
+	{
+		std::error_code ec;
+		const auto write_time = std::filesystem::last_write_time(file_path, ec);
+
+		return ec ? 0 : static_cast<int64_t>(write_time.time_since_epoch().count());
+	}
+
+	//Name a file is stored under while it is being transferred.
+	//It is tagged with the size and last write time of the source, so an interrupted transfer
+	//is only ever resumed from a partial copy of the very same file.
+	static std::string PartialFileName(const std::string& file_name, uint64_t file_size, int64_t file_time)
+	{
+		return file_name + "." + std::to_string(file_size) + "-" + std::to_string(file_time) + ".part";
+	}
+
+	//Number of bytes already transferred to partial_path, 0 when the transfer has to start over.
+	static uint64_t ResumeOffset(const std::string& partial_path, uint64_t file_size)
+	{
+		std::error_code ec;
+		const auto partial_size = std::filesystem::file_size(partial_path, ec);
+
+		return ec || partial_size > file_size ? 0 : partial_size;
+	}
+
+	//Closes the partial copy of a finished file and moves it in place of the destination file.
+	static bool CompletePartialFile(FileRemote& file)
+	{
+		if (file.file_dest)
+			file.file_dest->close();
+
+		std::error_code ec;
+		std::filesystem::rename(file.partial_path, file.file_path, ec);
+		return !ec;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,115 @@
+#pragma once
+#include<algorithm>
+#include<chrono>
+#include<cstdint>
+#include<mutex>
+
+//Rate limit shared by any number of connections, e.g. one bucket per client or one for the whole server.
+//Tokens are bytes, refilled at the configured rate up to the burst size.
+//Reserve never blocks: it always takes the tokens, letting the bucket go into debt,
+//and returns how long the caller has to wait before moving the bytes, see ftp_connection.
+//A rate of 0 means unlimited, the bucket then only measures the traffic.
+class ftp_token_bucket
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	static constexpr uint64_t MIN_BURST = 64 * 1024;
+
+	struct bucket_stats
+	{
+		uint64_t rate_limit = 0;
+		//bytes per second over the last measuring window
+		uint64_t current_rate = 0;
+		int64_t tokens = 0;
+		clock::duration throttled_time{ 0 };
+	};
+
+	explicit ftp_token_bucket(uint64_t bytes_per_second = 0, uint64_t burst_bytes = 0)
+	{
+		SetRate(bytes_per_second, burst_bytes);
+	}
+
+	//Can be changed while transfers are running. By default the bucket holds a quarter of a second of traffic.
+	void SetRate(uint64_t bytes_per_second, uint64_t burst_bytes = 0)
+	{
+		std::lock_guard<std::mutex> bucket_lock(m_bucket_mutex);
+
+		m_rate = bytes_per_second;
+		m_burst = burst_bytes > 0 ? burst_bytes : std::max(MIN_BURST, bytes_per_second / 4);
+		m_tokens = static_cast<double>(m_burst);
+		m_last_refill = clock::now();
+	}
+
+	clock::duration Reserve(std::size_t bytes)
+	{
+		std::lock_guard<std::mutex> bucket_lock(m_bucket_mutex);
+		const auto now = clock::now();
+
+		Measure(now, bytes);
+
+		if (m_rate == 0)
+			return clock::duration::zero();
+
+		const std::chrono::duration<double> elapsed = now - m_last_refill;
+		m_last_refill = now;
+		m_tokens = std::min(static_cast<double>(m_burst), m_tokens + elapsed.count() * m_rate);
+		m_tokens -= static_cast<double>(bytes);
+
+		if (m_tokens >= 0)
+			return clock::duration::zero();
+
+		const auto delay = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(-m_tokens / m_rate));
+		m_throttled_time += delay;
+		return delay;
+	}
+
+	bucket_stats GetStats()
+	{
+		std::lock_guard<std::mutex> bucket_lock(m_bucket_mutex);
+		const auto now = clock::now();
+
+		Measure(now, 0);
+
+		bucket_stats stats;
+		stats.rate_limit = m_rate;
+		stats.current_rate = m_measured_rate;
+
+		//nothing measured over a whole window yet
+		if (m_measured_rate == 0 && now > m_window_start)
+			stats.current_rate = static_cast<uint64_t>(m_window_bytes / std::chrono::duration<double>(now - m_window_start).count());
+
+		stats.tokens = static_cast<int64_t>(m_tokens);
+		stats.throttled_time = m_throttled_time;
+		return stats;
+	}
+
+private:
+	static constexpr clock::duration RATE_WINDOW = std::chrono::seconds(1);
+
+	std::mutex m_bucket_mutex;
+
+	uint64_t m_rate = 0;
+	uint64_t m_burst = 0;
+	double m_tokens = 0;
+	clock::time_point m_last_refill;
+
+	uint64_t m_window_bytes = 0;
+	clock::time_point m_window_start = clock::now();
+	uint64_t m_measured_rate = 0;
+	clock::duration m_throttled_time{ 0 };
+
+	void Measure(clock::time_point now, std::size_t bytes)
+	{
+		m_window_bytes += bytes;
+
+		const std::chrono::duration<double> window = now - m_window_start;
+
+		if (window >= RATE_WINDOW)
+		{
+			m_measured_rate = static_cast<uint64_t>(m_window_bytes / window.count());
+			m_window_bytes = 0;
+			m_window_start = now;
+		}
+	}
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include<algorithm>
+#include<deque>
+#include<functional>
+#include<mutex>
+#include<vector>
+
+//Server-wide deficit round robin between the clients downloading files.
+//At most MAX_BYTES_IN_FLIGHT bytes of file chunks are read and queued across all connections.
+//Whenever some of them are written, the freed budget is handed out as credit,
+//QUANTUM * weight bytes at a time, to the clients waiting for it in turn.
+//A client spends its credit one chunk at a time and keeps what is left for its next turn,
+//so a client downloading 40 files gets the same share of the server as a client downloading one.
+class ftp_transfer_scheduler
+{
+public:
+	static constexpr std::size_t QUANTUM = 256 * 1024;
+	static constexpr std::size_t MAX_BYTES_IN_FLIGHT = 32 * 1024 * 1024;
+
+	using credit_callback = std::function<void(std::size_t granted)>;
+
+	//Queues a client for its next quantum. on_granted is called once, on whichever thread frees the budget,
+	//and the client owns the granted bytes until it gives them back with ReturnCredit.
+	void RequestCredit(unsigned int weight, credit_callback on_granted)
+	{
+		{
+			std::lock_guard<std::mutex> scheduler_lock(m_scheduler_mutex);
+			m_waiting_clients.push_back({ std::max(weight, 1u), std::move(on_granted) });
+		}
+
+		Dispatch();
+	}
+
+	//Called when granted bytes have been written to a socket or are no longer needed.
+	void ReturnCredit(std::size_t bytes)
+	{
+		if (bytes == 0)
+			return;
+
+		{
+			std::lock_guard<std::mutex> scheduler_lock(m_scheduler_mutex);
+			m_bytes_in_flight -= std::min(bytes, m_bytes_in_flight);
+		}
+
+		Dispatch();
+	}
+
+	std::size_t BytesInFlight()
+	{
+		std::lock_guard<std::mutex> scheduler_lock(m_scheduler_mutex);
+		return m_bytes_in_flight;
+	}
+
+private:
+	struct waiting_client
+	{
+		unsigned int weight;
+		credit_callback on_granted;
+	};
+
+	std::mutex m_scheduler_mutex;
+	std::deque<waiting_client> m_waiting_clients;
+	std::size_t m_bytes_in_flight = 0;
+
+	void Dispatch()
+	{
+		std::vector<std::pair<credit_callback, std::size_t>> grants;
+
+		{
+			std::lock_guard<std::mutex> scheduler_lock(m_scheduler_mutex);
+
+			while (m_bytes_in_flight < MAX_BYTES_IN_FLIGHT && !m_waiting_clients.empty())
+			{
+				auto& next_client = m_waiting_clients.front();
+				const auto granted = QUANTUM * next_client.weight;
+
+				m_bytes_in_flight += granted;
+				grants.emplace_back(std::move(next_client.on_granted), granted);
+				m_waiting_clients.pop_front();
+			}
+		}
+
+		//clients are notified outside the lock, they may ask for more credit right away
+		for (auto& [on_granted, granted] : grants)
+			on_granted(granted);
+	}
+};
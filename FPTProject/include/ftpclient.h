@@ -1,12 +1,20 @@
 #pragma once
 #include<asio.hpp>
+#include<algorithm>
+#include<atomic>
 #include<deque>
+#include<functional>
+#include<mutex>
+#include<vector>
+#include"ftp_download_sink.h"
 #include"ftp_request.h"
 #include"ftpconnection.h"
 
 class ftp_client
 {
 private:
+	static constexpr std::size_t RESPONSE_QUEUE_CAPACITY = 256;
+
 	asio::io_context m_control_context;
 	asio::io_context m_data_context;
 
@@ -14,7 +22,6 @@ private:
 	std::thread m_thread_data_context;
 
 	asio::ip::tcp::socket m_control_socket;
-	asio::ip::tcp::socket m_data_socket;
 
 	asio::ip::tcp::resolver::results_type m_control_conn_endpoints;
 	asio::ip::tcp::resolver::results_type m_data_conn_endpoints;
@@ -22,18 +29,54 @@ private:
 	std::shared_ptr<ftp_connection> m_control_conn;
 	std::shared_ptr<ftp_connection> m_data_conn;
 
-	std::deque<ftp_request> m_control_requests;
-	std::deque<ftp_request> m_data_requests;
+	//all data connections, the first one is m_data_conn.
+	//The others are used to download segments of large files in parallel, one segment per connection.
+	std::vector<std::shared_ptr<ftp_connection>> m_data_conns;
+
+	//data connection each control request waiting for SERVER_OK is verified on, in the order the requests were sent
+	std::deque<std::size_t> m_verify_streams;
+	std::mutex m_verify_streams_mutex;
+
+	ftp_request_queue m_control_requests{ RESPONSE_QUEUE_CAPACITY };
+	ftp_request_queue m_data_requests{ RESPONSE_QUEUE_CAPACITY };
+
+	//see NotifyOnResponses
+	std::function<void()> m_on_responses;
+	std::mutex m_on_responses_mutex;
+	//set from the first response queued after the last TakeResponses until the next one
+	std::atomic_bool m_responses_signalled = false;
+
+	//downloaded bytes are written here, only its reports are queued as data responses, see Downloads
+	ftp_download_sink m_download_sink{ [this](ftp_request&& report) -> void
+		{
+			m_data_requests.Push(std::move(report));
+		} };
+
+	//applies to everything sent on the data connection, unlimited until configured
+	std::shared_ptr<ftp_token_bucket> m_upload_limit = std::make_shared<ftp_token_bucket>();
+
+	//codecs offered to the server on every data connection, see SetCompression
+	uint32_t m_offered_codecs = ftp_chunk_codec::SupportedCodecs();
 
 public:
-	ftp_client() : m_control_socket(m_control_context), m_data_socket(m_data_context)
+	ftp_client() : m_control_socket(m_control_context)
 	{
-		
+		m_control_requests.SetPushHandler([this]() -> void
+			{
+				SignalResponses();
+			});
+
+		m_data_requests.SetPushHandler([this]() -> void
+			{
+				SignalResponses();
+			});
 	}
 
 	~ftp_client()
 	{
-		
+		//reports of writes still queued must not wait for a consumer that is gone
+		m_data_requests.Close();
+		m_download_sink.Stop();
 	}
 
 
@@ -50,7 +93,6 @@ public:
 				ftp_connection::conn_type::control,
 				ftp_connection::conn_founder::client,
 				std::move(m_control_socket),
-				m_control_context,
 				m_control_requests
 				);
 
@@ -73,22 +115,31 @@ public:
 	}
 
 
-	bool EstablishDataConnection(const std::string& host, const uint16_t port)
+	//stream_count data connections are opened, see DataStreamCount.
+	bool EstablishDataConnection(const std::string& host, const uint16_t port, const std::size_t stream_count = 1)
 	{
 		try
 		{
 			asio::ip::tcp::resolver resolver(m_data_context);
 			auto endpoints = resolver.resolve(host, std::to_string(port));
 
-			m_data_conn = std::make_shared<ftp_connection>(
-				ftp_connection::conn_type::data,
-				ftp_connection::conn_founder::client,
-				std::move(m_data_socket),
-				m_data_context,
-				m_data_requests
-				);
+			for (std::size_t i = 0; i < std::max<std::size_t>(stream_count, 1); ++i)
+			{
+				auto data_conn = std::make_shared<ftp_connection>(
+					ftp_connection::conn_type::data,
+					ftp_connection::conn_founder::client,
+					asio::ip::tcp::socket(m_data_context),
+					m_data_requests
+					);
+
+				m_download_sink.Register(*data_conn);
+
+				ListenToServer(endpoints->endpoint(), data_conn, m_offered_codecs);
+				m_data_conns.push_back(std::move(data_conn));
+			}
 
-			ListenToServer(endpoints->endpoint(), m_data_conn);
+			m_data_conn = m_data_conns.front();
+			m_data_conn->AddEgressLimit(m_upload_limit);
 
 			m_thread_data_context = std::thread(
 				[this]() -> void
@@ -108,14 +159,18 @@ public:
 		return true;
 	}
 
-	void ListenToServer(const asio::ip::tcp::resolver::endpoint_type& t_serverEndpoint, std::shared_ptr<ftp_connection> t_conn) const
+	//offered_codecs are offered once the connection is open, see ftp_connection::OfferCompression
+	void ListenToServer(const asio::ip::tcp::resolver::endpoint_type& t_serverEndpoint, std::shared_ptr<ftp_connection> t_conn, const uint32_t offered_codecs = 0) const
 	{
 		t_conn->GetSocket().async_connect(t_serverEndpoint,
-			[this, t_conn](std::error_code ec) -> void
+			[this, t_conn, offered_codecs](std::error_code ec) -> void
 			{
 				if (!ec)
 				{
 					t_conn->StartReading();
+
+					if (offered_codecs != 0)
+						t_conn->OfferCompression(offered_codecs);
 				}
 			});
 	}
@@ -133,8 +188,11 @@ public:
 
 	void DataStreamDisconnect()
 	{
-		if (IsDataStreamConnected())
-			m_data_conn->Disconnect();
+		for (auto& data_conn : m_data_conns)
+		{
+			if (data_conn->IsSocketOpen())
+				data_conn->Disconnect();
+		}
 
 		m_data_context.stop();
 		if (m_thread_data_context.joinable())
@@ -159,34 +217,160 @@ public:
 			return false;
 	}
 
-	void SendControlRequest(const ftp_request& req)
+	std::size_t DataStreamCount() const
+	{
+		return m_data_conns.size();
+	}
+
+	//The server answers every control request with SERVER_OK, the request is then carried out
+	//on the data connection that verifies it, see VerifyDataStream.
+	void SendControlRequest(ftp_request&& req, const std::size_t data_stream = 0)
 	{
 
 		if(IsControlStreamConnected())
 		{
-			m_control_conn->Write(req);
+			{
+				std::lock_guard<std::mutex> verify_lock(m_verify_streams_mutex);
+				m_verify_streams.push_back(std::min(data_stream, DataStreamCount() - 1));
+			}
+
+			m_control_conn->Write(std::move(req));
 		}
 		 
 			
 	}
 
-	void SendDataRequest(const ftp_request& req)
+	//Answers SERVER_OK on the data connection chosen for the oldest unverified control request.
+	void VerifyDataStream(unsigned long request_hash)
+	{
+		std::size_t data_stream = 0;
+
+		{
+			std::lock_guard<std::mutex> verify_lock(m_verify_streams_mutex);
+
+			if (!m_verify_streams.empty())
+			{
+				data_stream = m_verify_streams.front();
+				m_verify_streams.pop_front();
+			}
+		}
+
+		if (data_stream >= DataStreamCount() || !m_data_conns[data_stream]->IsSocketOpen())
+			return;
+
+		ftp_request data_collect_request;
+		data_collect_request.header.operation = ftp_request_header::ftp_operation::DATA_STREAM_VERIFIED;
+		data_collect_request.InsertTrivialToBuffer(request_hash);
+
+		m_data_conns[data_stream]->Write(std::move(data_collect_request));
+	}
+
+	void SendDataRequest(ftp_request&& req)
 	{
 		if (IsDataStreamConnected())
 		{
-			m_data_conn->Write(req);
+			m_data_conn->Write(std::move(req));
+		}
+	}
+
+	//Bytes per second, 0 removes the limit. Can be changed during uploads.
+	void SetUploadRateLimit(uint64_t upload_rate)
+	{
+		m_upload_limit->SetRate(upload_rate);
+	}
+
+	//Takes effect on data connections established afterwards. Compression is on by default
+	//whenever the client is built with a codec, see ftp_chunk_codec.
+	void SetCompression(bool enabled)
+	{
+		m_offered_codecs = enabled ? ftp_chunk_codec::SupportedCodecs() : 0;
+	}
+
+	//Codec agreed on with the server for chunks uploaded on the data stream, NONE until the server has answered.
+	ftp_compression DataStreamCompression() const
+	{
+		return m_data_conn ? m_data_conn->GetCompression() : ftp_compression::NONE;
+	}
+
+	ftp_token_bucket::bucket_stats GetUploadRateStats()
+	{
+		return m_upload_limit->GetStats();
+	}
+
+	bool IsDataStreamWritable()
+	{
+		return IsDataStreamConnected() && m_data_conn->IsWritable();
+	}
+
+	//on_writable runs on the data io thread once the data stream's send queue has drained,
+	//see ftp_connection::NotifyWhenWritable. Without a running data stream it runs right away on the caller's thread.
+	void NotifyWhenDataStreamWritable(std::function<void()> on_writable)
+	{
+		if (!m_data_conn || m_data_context.stopped())
+		{
+			on_writable();
+			return;
+		}
+
+		m_data_conn->NotifyWhenWritable(std::move(on_writable));
+	}
+
+	//Downloads are written to disk as they arrive, the file ids requested must be announced to it first.
+	ftp_download_sink& Downloads()
+	{
+		return m_download_sink;
+	}
+
+	//on_responses is called on an io or disk writer thread when responses arrive while none were waiting to be taken,
+	//it should only wake the consumer, which then takes them in batches with TakeResponses. Responses that are already
+	//waiting are signalled right away. Once it returns, a previous handler is never called again; nullptr stops notifying.
+	void NotifyOnResponses(std::function<void()> on_responses)
+	{
+		{
+			std::lock_guard<std::mutex> on_responses_lock(m_on_responses_mutex);
+			m_on_responses = std::move(on_responses);
 		}
+
+		m_responses_signalled = false;
+		SignalResponses();
+	}
+
+	//Consumer only. Moves up to max_count control and data responses to the back of out and returns how many were moved.
+	//Responses queued from now on are signalled again, and so are the ones left over when max_count is reached.
+	std::size_t TakeResponses(std::vector<ftp_request>& out, std::size_t max_count)
+	{
+		m_responses_signalled = false;
+
+		auto taken = m_control_requests.DrainInto(out, max_count);
+		taken += m_data_requests.DrainInto(out, max_count - taken);
+
+		if (taken == max_count)
+			SignalResponses();
+
+		return taken;
 	}
 
-	
-	std::deque<ftp_request>& ReceivedControlResponses()
+	ftp_request_queue& ReceivedControlResponses()
 	{
 		return m_control_requests;
 	}
 
-	std::deque<ftp_request>& ReceivedDataResponses()
+	ftp_request_queue& ReceivedDataResponses()
 	{
 		return m_data_requests;
 	}
+
+private:
+	//one call per batch of responses, not per response
+	void SignalResponses()
+	{
+		if (m_responses_signalled.exchange(true))
+			return;
+
+		std::lock_guard<std::mutex> on_responses_lock(m_on_responses_mutex);
+
+		if (m_on_responses)
+			m_on_responses();
+	}
 };
 
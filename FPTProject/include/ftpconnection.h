@@ -1,11 +1,61 @@
 #pragma once
 #include<asio.hpp>
+#include<atomic>
 #include<deque>
+#include<functional>
+#include<map>
 #include"ftp_request.h"
+#include"ftp_file_handle.h"
+#include"ftp_mpsc_queue.h"
+#include"ftp_token_bucket.h"
+
+//Frames received by connections, consumed by a single dispatching thread.
+using ftp_request_queue = ftp_mpsc_queue<ftp_request>;
+
 class ftp_connection : public std::enable_shared_from_this<ftp_connection>
 {
 
 public:
+	//Consumer of frames whose body is handed over in slices as it arrives,
+	//instead of being read whole into memory and queued as a request.
+	//All callbacks run on the connection's io thread.
+	struct body_stream_handler
+	{
+		//number of leading payload bytes read in one piece and passed to on_begin, ex. ids and block lengths
+		std::size_t prefix_size = 0;
+
+		std::function<void(std::shared_ptr<ftp_connection>, const ftp_request_header&, ftp_request_reader&)> on_begin;
+		std::function<void(const unsigned char*, std::size_t)> on_slice;
+		std::function<void()> on_end;
+		//optional, called instead of on_end when the connection fails or is closed before the whole body arrived;
+		//the handler must drop everything it holds for the body, ex. the connection passed to on_begin
+		std::function<void()> on_abort;
+	};
+
+	static constexpr std::size_t BODY_SLICE_SIZE = 256 * 1024;
+
+	//small frames queued behind each other are sent together up to this many bytes
+	static constexpr std::size_t WRITE_GATHER_BUDGET = 64 * 1024;
+	static constexpr std::size_t MAX_GATHERED_FRAMES = 64;
+
+	//Producers should stop writing once this many bytes are queued on the connection
+	//and resume when the queue drains below the low watermark, see NotifyWhenWritable.
+	static constexpr std::size_t SEND_HIGH_WATERMARK = 16 * 1024 * 1024;
+	static constexpr std::size_t SEND_LOW_WATERMARK = 4 * 1024 * 1024;
+
+	struct write_stats
+	{
+		uint64_t frames_written = 0;
+		//vectored writes and file tail sends issued, each is normally one system call
+		uint64_t write_calls = 0;
+		uint64_t bytes_written = 0;
+
+		double FramesPerWrite() const
+		{
+			return write_calls > 0 ? static_cast<double>(frames_written) / write_calls : 0.0;
+		}
+	};
+
 	enum class conn_type
 	{
 		control,
@@ -23,9 +73,9 @@ public:
 	ftp_connection(conn_type t_conn_type, 
 		conn_founder t_conn_founder, 
 		asio::ip::tcp::socket t_conn_socket,
-		asio::io_context& t_conn_context,
-		std::deque<ftp_request>& t_received_requests)
-			: m_conn_socket(std::move(t_conn_socket)), m_conn_context(t_conn_context), m_recieved_requests(t_received_requests)
+		ftp_request_queue& t_received_requests)
+			: m_conn_socket(std::move(t_conn_socket)), m_conn_strand(asio::make_strand(m_conn_socket.get_executor())),
+			m_egress_timer(m_conn_strand), m_ingress_timer(m_conn_strand), m_recieved_requests(t_received_requests)
 	{
 		m_conn_type = t_conn_type;
 		m_conn_founder = t_conn_founder;
@@ -56,12 +106,13 @@ public:
 
 		ftp_request disconnect_request;
 		disconnect_request.header.operation = ftp_request_header::ftp_operation::DISCONNECT;
-		Write(disconnect_request);
+		Write(std::move(disconnect_request));
 
-		asio::post(m_conn_context,
-			[this]() -> void
+		asio::post(m_conn_strand,
+			[this, self = shared_from_this()]() -> void
 			{
 				m_conn_socket.close();
+				ReleaseWritableWaiters();
 			});
 	}
 
@@ -70,148 +121,653 @@ public:
 		return m_conn_socket.is_open();
 	}
 
-	void Write(const ftp_request& req)
+	void Write(ftp_request&& req)
 	{
-		asio::post(m_conn_context,
-			[this, req]() -> void
+		Write(std::move(req).Freeze());
+	}
+
+	//Frames share their payload, so the same frame can be written to many connections without copying it.
+	//on_written is invoked on the io thread once the whole frame has been written to the socket,
+	//it is dropped without being called if the connection fails first.
+	void Write(ftp_frame frame, std::function<void()> on_written = nullptr)
+	{
+		//counted before posting, so producers on other threads see their own writes right away
+		m_queued_bytes.fetch_add(FrameBytes(frame), std::memory_order_relaxed);
+
+		asio::post(m_conn_strand,
+			[this, self = shared_from_this(), frame = std::move(frame), on_written = std::move(on_written)]() mutable -> void
 			{
 				auto writing_message = !m_written_requests.empty();
-				m_written_requests.push_back(req);
+				m_written_requests.push_back({ std::move(frame), std::move(on_written) });
 
 				if(!writing_message)
 				{
-					AsyncWriteHeader();
+					AsyncWriteFrames();
 				}
 			});
 	}
 
+	//Bytes of frames written but not yet sent, including file tails.
+	std::size_t QueuedBytes() const
+	{
+		return m_queued_bytes.load(std::memory_order_relaxed);
+	}
+
+	bool IsWritable() const
+	{
+		return QueuedBytes() < SEND_HIGH_WATERMARK;
+	}
+
+	//on_writable is invoked once on the io thread when the queue drains below SEND_LOW_WATERMARK,
+	//right away if it already is, or when the connection is closed.
+	void NotifyWhenWritable(std::function<void()> on_writable)
+	{
+		asio::post(m_conn_strand,
+			[this, self = shared_from_this(), on_writable = std::move(on_writable)]() mutable -> void
+			{
+				if (QueuedBytes() < SEND_LOW_WATERMARK || !IsSocketOpen())
+					on_writable();
+
+				else
+					m_writable_waiters.push_back(std::move(on_writable));
+			});
+	}
+
+	//Bytes sent, and bytes of request bodies received, go through every bucket added here.
+	//The same bucket can be shared by several connections, e.g. for a server-wide cap.
+	void AddEgressLimit(std::shared_ptr<ftp_token_bucket> limit)
+	{
+		asio::post(m_conn_strand,
+			[this, self = shared_from_this(), limit = std::move(limit)]() mutable -> void
+			{
+				m_egress_limits.push_back(std::move(limit));
+			});
+	}
+
+	void AddIngressLimit(std::shared_ptr<ftp_token_bucket> limit)
+	{
+		asio::post(m_conn_strand,
+			[this, self = shared_from_this(), limit = std::move(limit)]() mutable -> void
+			{
+				m_ingress_limits.push_back(std::move(limit));
+			});
+	}
+
 	void StartReading()
 	{
-		AsyncReadHeader();
+		asio::post(m_conn_strand,
+			[this, self = shared_from_this()]() -> void
+			{
+				//frames are coalesced by the writer, Nagle would only delay small responses
+				asio::error_code option_ec;
+				m_conn_socket.set_option(asio::ip::tcp::no_delay(true), option_ec);
+
+				AsyncReadHeader();
+			});
+	}
+
+	//Sent by the client once the connection is open: offers every codec bit set in codecs, see ftp_chunk_codec.
+	//The server answers with the best common codec and both ends use it from then on, see GetCompression.
+	void OfferCompression(uint32_t codecs)
+	{
+		ftp_request offer_request;
+		offer_request.header.operation = ftp_request_header::ftp_operation::NEGOTIATE_COMPRESSION;
+		offer_request.InsertTrivialToBuffer(codecs);
+		Write(std::move(offer_request));
+	}
+
+	//Codec chunks sent on this connection should be compressed with, see ftp_request::Compress.
+	//Received frames are decompressed before they are queued or streamed, whatever their codec.
+	ftp_compression GetCompression() const
+	{
+		return m_compression.load(std::memory_order_relaxed);
+	}
+
+	write_stats GetWriteStats() const
+	{
+		write_stats stats;
+		stats.frames_written = m_frames_written.load(std::memory_order_relaxed);
+		stats.write_calls = m_write_calls.load(std::memory_order_relaxed);
+		stats.bytes_written = m_bytes_written.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	auto GetExecutor()
+	{
+		return m_conn_strand;
+	}
+
+	//Must be registered before StartReading, the handler map is only read from the io thread afterwards.
+	void SetBodyStreamHandler(ftp_request_header::ftp_operation operation, body_stream_handler handler)
+	{
+		m_body_stream_handlers[operation] = std::move(handler);
+	}
+
+	//on_closed is called once on the io thread when the connection fails or the peer closes it, also without a DISCONNECT frame.
+	//Must be registered before StartReading.
+	void SetCloseHandler(std::function<void(std::shared_ptr<ftp_connection>)> on_closed)
+	{
+		m_on_closed = std::move(on_closed);
 	}
 
 private:
 	conn_type m_conn_type;
 	conn_founder m_conn_founder;
 	asio::ip::tcp::socket m_conn_socket;
-	asio::io_context& m_conn_context;
-	std::deque<ftp_request> m_written_requests;
-	std::deque<ftp_request>& m_recieved_requests;
+	//every handler of the connection runs on this strand, so its read and write chains stay serialized
+	//even when the io_context is run by several threads
+	asio::strand<asio::ip::tcp::socket::executor_type> m_conn_strand;
+
+	struct queued_frame
+	{
+		ftp_frame frame;
+		std::function<void()> on_written;
+	};
+
+	std::deque<queued_frame> m_written_requests;
+	std::atomic<std::size_t> m_queued_bytes = 0;
+	std::vector<std::function<void()>> m_writable_waiters;
+	std::vector<asio::const_buffer> m_gather_buffers;
+	std::size_t m_gathered_frames = 0;
+	std::size_t m_tail_sent = 0;
+
+	//rate limits, waiting for tokens is a timer wait on the strand
+	std::vector<std::shared_ptr<ftp_token_bucket>> m_egress_limits;
+	std::vector<std::shared_ptr<ftp_token_bucket>> m_ingress_limits;
+	asio::steady_timer m_egress_timer;
+	asio::steady_timer m_ingress_timer;
+
+	std::atomic<ftp_compression> m_compression = ftp_compression::NONE;
+
+	std::atomic<uint64_t> m_frames_written = 0;
+	std::atomic<uint64_t> m_write_calls = 0;
+	std::atomic<uint64_t> m_bytes_written = 0;
+	std::vector<unsigned char> m_tail_buffer;
+	ftp_request_queue& m_recieved_requests;
 	ftp_request m_cache_request;
 	uint32_t m_conn_id;
 
-	void AsyncWriteHeader()
+	std::map<ftp_request_header::ftp_operation, body_stream_handler> m_body_stream_handlers;
+	std::function<void(std::shared_ptr<ftp_connection>)> m_on_closed;
+	body_stream_handler* m_active_stream = nullptr;
+	std::vector<unsigned char> m_stream_slice;
+	uint64_t m_stream_remaining = 0;
+
+	//Gathers the header, payload and memory tail of the front frame, plus as many following frames as fit in
+	//WRITE_GATHER_BUDGET, into one vectored write (a single writev unless the socket buffer fills up).
+	//A frame with a file tail ends the batch, its tail is sent on its own afterwards.
+	void AsyncWriteFrames()
 	{
-		asio::async_write(m_conn_socket, asio::buffer(&m_written_requests.front().header, sizeof ftp_request_header), asio::transfer_all(),
-		[this](std::error_code ec, std::size_t length) -> void
+		m_gather_buffers.clear();
+		m_gathered_frames = 0;
+		std::size_t gathered_bytes = 0;
+
+		for (const auto& queued : m_written_requests)
 		{
-			if(!ec)
+			const auto& frame = queued.frame;
+			const auto frame_bytes = sizeof(ftp_request_header) + frame.PayloadSize() + frame.memory_tail_length;
+
+			//the front frame is always sent, whatever its size
+			if (m_gathered_frames > 0 && (gathered_bytes + frame_bytes > WRITE_GATHER_BUDGET || m_gathered_frames == MAX_GATHERED_FRAMES))
+				break;
+
+			m_gather_buffers.push_back(asio::buffer(&frame.header, sizeof(ftp_request_header)));
+
+			if (frame.PayloadSize() > 0)
+				m_gather_buffers.push_back(asio::buffer(frame.PayloadData(), frame.PayloadSize()));
+
+			if (frame.memory_tail_length > 0)
+				m_gather_buffers.push_back(asio::buffer(frame.memory_tail.get(), frame.memory_tail_length));
+
+			gathered_bytes += frame_bytes;
+			m_gathered_frames++;
+
+			if (frame.file_tail)
+				break;
+		}
+
+		AfterRateLimit(m_egress_limits, m_egress_timer, gathered_bytes,
+			[this]() -> void
 			{
-				if(m_written_requests.front().header.request_size > 0)
-					AsyncWriteBuffer();
+				WriteGatheredFrames();
+			});
+	}
+
+	void WriteGatheredFrames()
+	{
+		m_write_calls.fetch_add(1, std::memory_order_relaxed);
 
+		asio::async_write(m_conn_socket, m_gather_buffers, asio::transfer_all(),
+			asio::bind_executor(m_conn_strand, [this, self = shared_from_this()](std::error_code ec, std::size_t length) -> void
+			{
+				if(!ec)
+				{
+					m_bytes_written.fetch_add(length, std::memory_order_relaxed);
+					OnFramesGathered();
+				}
 				else
 				{
-					m_written_requests.pop_front();
-
-					if (!m_written_requests.empty())
-						AsyncWriteHeader();
+					StopWriting("Writing frames stopped.");
 				}
-				 
-			}
-			else
+			}));
+	}
+
+	void OnFramesGathered()
+	{
+		const bool ends_with_tail = static_cast<bool>(m_written_requests[m_gathered_frames - 1].frame.file_tail);
+		const auto completed_frames = ends_with_tail ? m_gathered_frames - 1 : m_gathered_frames;
+
+		for (std::size_t i = 0; i < completed_frames; ++i)
+			CompleteFrontFrame();
+
+		if (ends_with_tail)
+			StartFileTail();
+
+		else if (!m_written_requests.empty())
+			AsyncWriteFrames();
+	}
+
+	void StartFileTail()
+	{
+		m_tail_sent = 0;
+
+		AfterRateLimit(m_egress_limits, m_egress_timer, m_written_requests.front().frame.file_tail_length,
+			[this]() -> void
 			{
-				if(IsSocketOpen())
+				AsyncWriteFileTail();
+			});
+	}
+
+	//Sends the file part of the front frame straight from the page cache (sendfile on Linux).
+	//Whenever the socket buffer fills up, sending resumes once the socket becomes writable again.
+	void AsyncWriteFileTail()
+	{
+		const auto& front_frame = m_written_requests.front().frame;
+
+		asio::error_code mode_ec;
+		m_conn_socket.non_blocking(true, mode_ec);
+
+		std::error_code ec;
+
+		while(!ec && m_tail_sent < front_frame.file_tail_length)
+		{
+			const auto sent = front_frame.file_tail->SendTo(
+				m_conn_socket.native_handle(),
+				front_frame.file_tail_offset + m_tail_sent,
+				front_frame.file_tail_length - m_tail_sent,
+				ec
+			);
+
+			m_tail_sent += sent;
+			m_write_calls.fetch_add(1, std::memory_order_relaxed);
+			m_bytes_written.fetch_add(sent, std::memory_order_relaxed);
+		}
+
+		if(!ec)
+			FinishFrontWrite();
+
+		else if(ec == std::errc::operation_would_block)
+		{
+			m_conn_socket.async_wait(asio::ip::tcp::socket::wait_write,
+				asio::bind_executor(m_conn_strand, [this, self = shared_from_this()](std::error_code wait_ec) -> void
 				{
-					std::cout << "Writing header stopped. \n";
-					m_conn_socket.close();
-				}
-			}
-		});
+					if(!wait_ec)
+						AsyncWriteFileTail();
+
+					else
+						StopWriting("Waiting for socket stopped.");
+				}));
+		}
+
+		//file system or kernel without zero-copy support for this file
+		else if(ec == std::errc::not_supported)
+			AsyncWriteFileTailBuffered();
+
+		else
+			StopWriting("Sending file stopped.");
 	}
 
-	void AsyncWriteBuffer()
+	void AsyncWriteFileTailBuffered()
 	{
-		asio::async_write(m_conn_socket, asio::buffer(m_written_requests.front().mem_buffer.data(), m_written_requests.front().header.request_size), asio::transfer_all(),
-			[this](std::error_code ec, std::size_t length) -> void
+		const auto& front_frame = m_written_requests.front().frame;
+		const auto tail_remaining = front_frame.file_tail_length - m_tail_sent;
+
+		m_tail_buffer.resize(tail_remaining);
+		front_frame.file_tail->ReadAt(m_tail_buffer.data(), front_frame.file_tail_offset + m_tail_sent, tail_remaining);
+
+		m_write_calls.fetch_add(1, std::memory_order_relaxed);
+
+		asio::async_write(m_conn_socket, asio::buffer(m_tail_buffer), asio::transfer_all(),
+			asio::bind_executor(m_conn_strand, [this, self = shared_from_this()](std::error_code ec, std::size_t length) -> void
 			{
 				if(!ec)
 				{
-					m_written_requests.pop_front();
-
-					if (!m_written_requests.empty())
-						AsyncWriteHeader();
+					m_bytes_written.fetch_add(length, std::memory_order_relaxed);
+					FinishFrontWrite();
 				}
 
 				else
-				{
-					if(IsSocketOpen())
-					{
-						std::cout << "Writing buffer stopped. \n";
-						m_conn_socket.close();
-					}
-				}
-			});
+					StopWriting("Writing file buffer stopped.");
+			}));
+	}
+
+	//Queued frames are dropped together with their completion callbacks.
+	void StopWriting(const char* reason)
+	{
+		for (const auto& queued : m_written_requests)
+			m_queued_bytes.fetch_sub(FrameBytes(queued.frame), std::memory_order_relaxed);
+
+		m_written_requests.clear();
+
+		if(IsSocketOpen())
+		{
+			LogConnection(reason);
+			m_conn_socket.close();
+		}
+
+		ReleaseWritableWaiters();
+		NotifyClosed();
+	}
+
+	//The body being streamed, if any, is aborted: its handler is never called again for it.
+	void StopReading(const char* reason)
+	{
+		if(m_active_stream)
+		{
+			auto* aborted_stream = m_active_stream;
+			m_active_stream = nullptr;
+			m_stream_remaining = 0;
+			m_stream_slice = std::vector<unsigned char>();
+
+			if(aborted_stream->on_abort)
+				aborted_stream->on_abort();
+		}
+
+		if(IsSocketOpen())
+		{
+			LogConnection(reason);
+			m_conn_socket.close();
+		}
+
+		NotifyClosed();
+	}
+
+	void NotifyClosed()
+	{
+		if (!m_on_closed)
+			return;
+
+		auto on_closed = std::move(m_on_closed);
+		m_on_closed = nullptr;
+
+		on_closed(shared_from_this());
+	}
+
+	void LogConnection(const char* message) const
+	{
+		std::cout << "[" << m_conn_id << "] " << message << "\n";
+	}
+
+	void CompleteFrontFrame()
+	{
+		auto on_written = std::move(m_written_requests.front().on_written);
+		const auto frame_bytes = FrameBytes(m_written_requests.front().frame);
+		m_written_requests.pop_front();
+		m_frames_written.fetch_add(1, std::memory_order_relaxed);
+
+		const auto queued_before = m_queued_bytes.fetch_sub(frame_bytes, std::memory_order_relaxed);
+
+		if (on_written)
+			on_written();
+
+		if (queued_before - frame_bytes < SEND_LOW_WATERMARK)
+			ReleaseWritableWaiters();
+	}
+
+	void ReleaseWritableWaiters()
+	{
+		if (m_writable_waiters.empty())
+			return;
+
+		auto waiters = std::move(m_writable_waiters);
+		m_writable_waiters.clear();
+
+		for (auto& on_writable : waiters)
+			on_writable();
+	}
+
+	static std::size_t FrameBytes(const ftp_frame& frame)
+	{
+		return sizeof(ftp_request_header) + frame.header.request_size;
+	}
+
+	//Completes the front frame once its file tail has been sent.
+	void FinishFrontWrite()
+	{
+		CompleteFrontFrame();
+
+		if (!m_written_requests.empty())
+			AsyncWriteFrames();
 	}
 
 	void AsyncReadHeader()
 	{
-		asio::async_read(m_conn_socket, asio::buffer(&m_cache_request.header, sizeof ftp_request_header), asio::transfer_all(),
-			[this](std::error_code ec, std::size_t length) -> void
+		asio::async_read(m_conn_socket, asio::buffer(&m_cache_request.header, sizeof(ftp_request_header)), asio::transfer_all(),
+			asio::bind_executor(m_conn_strand, [this, self = shared_from_this()](std::error_code ec, std::size_t length) -> void
 			{
 				if(!ec)
 				{
-					if(m_cache_request.header.request_size > 0)
+					const auto stream_it = m_body_stream_handlers.find(m_cache_request.header.operation);
+
+					//compressed bodies can't be streamed, a codec block is only decoded whole, so they are read whole,
+					//bounded by the largest payload a codec frame may carry, and sliced after decompressing, see DeliverToBodyStream
+					if(m_cache_request.header.compression != ftp_compression::NONE
+						&& m_cache_request.header.request_size > ftp_chunk_codec::MAX_COMPRESSED_FRAME_SIZE)
 					{
+						StopReading("Compressed request too large.");
+					}
+					else if(stream_it != m_body_stream_handlers.end() && m_cache_request.header.request_size >= stream_it->second.prefix_size
+						&& m_cache_request.header.compression == ftp_compression::NONE)
+					{
+						m_active_stream = &stream_it->second;
+						AsyncReadStreamPrefix();
+					}
+					else if(m_cache_request.header.request_size > 0)
+					{
+						m_cache_request.ReserveBuffer(m_cache_request.header.request_size);
 						m_cache_request.mem_buffer.resize(m_cache_request.header.request_size);
-						AsyncReadBuffer();
+
+						AfterRateLimit(m_ingress_limits, m_ingress_timer, m_cache_request.header.request_size,
+							[this]() -> void
+							{
+								AsyncReadBuffer();
+							});
 					}
 					else
 					{
 						//erasing left-over data from previous requests
-						m_cache_request.mem_buffer.erase(m_cache_request.mem_buffer.cbegin(), m_cache_request.mem_buffer.cend());
+						m_cache_request.mem_buffer.clear();
 						WriteCacheRequest();
 					}
 				}
 				else
-				{
-					if(IsSocketOpen())
-					{
-						std::cout << "Reading header stopped. \n";
-						m_conn_socket.close();
-					}
-				}
-			});
+					StopReading("Reading header stopped.");
+			}));
 	}
 
 	void AsyncReadBuffer()
 	{
 		asio::async_read(m_conn_socket, asio::buffer(m_cache_request.mem_buffer.data(), m_cache_request.header.request_size), asio::transfer_all(),
-			[this](std::error_code ec, std::size_t length) -> void
+			asio::bind_executor(m_conn_strand, [this, self = shared_from_this()](std::error_code ec, std::size_t length) -> void
 			{
 				if(!ec)
 				{
 					WriteCacheRequest();
 				}
 				else
+					StopReading("Reading buffer stopped.");
+			}));
+	}
+
+	//Reads the fixed prefix of a streamed body, then hands the rest over in BODY_SLICE_SIZE pieces.
+	//Only one slice is ever held in memory, whatever the size of the frame.
+	void AsyncReadStreamPrefix()
+	{
+		m_cache_request.mem_buffer.resize(m_active_stream->prefix_size);
+
+		asio::async_read(m_conn_socket, asio::buffer(m_cache_request.mem_buffer), asio::transfer_all(),
+			asio::bind_executor(m_conn_strand, [this, self = shared_from_this()](std::error_code ec, std::size_t length) -> void
+			{
+				if(!ec)
 				{
-					if(IsSocketOpen())
-					{
-					std::cout << "Reading buffer stopped. \n";
-					m_conn_socket.close();
-						
-					}
+					ftp_request_reader prefix_reader(m_cache_request);
+					m_active_stream->on_begin(shared_from_this(), m_cache_request.header, prefix_reader);
+
+					m_stream_remaining = m_cache_request.header.request_size - m_active_stream->prefix_size;
+					AsyncReadStreamSlice();
 				}
+				else
+					StopReading("Reading stream prefix stopped.");
+			}));
+	}
+
+	void AsyncReadStreamSlice()
+	{
+		if(m_stream_remaining == 0)
+		{
+			m_active_stream->on_end();
+			m_active_stream = nullptr;
+			AsyncReadHeader();
+			return;
+		}
+
+		m_stream_slice.resize(BODY_SLICE_SIZE);
+		const auto slice_size = static_cast<std::size_t>(std::min<uint64_t>(BODY_SLICE_SIZE, m_stream_remaining));
+
+		AfterRateLimit(m_ingress_limits, m_ingress_timer, slice_size,
+			[this, slice_size]() -> void
+			{
+				AsyncReadStreamSliceBytes(slice_size);
 			});
 	}
 
+	void AsyncReadStreamSliceBytes(std::size_t slice_size)
+	{
+		asio::async_read(m_conn_socket, asio::buffer(m_stream_slice.data(), slice_size), asio::transfer_all(),
+			asio::bind_executor(m_conn_strand, [this, self = shared_from_this()](std::error_code ec, std::size_t length) -> void
+			{
+				if(!ec)
+				{
+					m_active_stream->on_slice(m_stream_slice.data(), length);
+					m_stream_remaining -= length;
+					AsyncReadStreamSlice();
+				}
+				else
+					StopReading("Reading stream slice stopped.");
+			}));
+	}
+
+	//Calls next once every bucket in limits has tokens for bytes more bytes, right away if none is throttling.
+	//Only one operation per direction waits at a time, so one timer per direction is enough.
+	template<class Next>
+	void AfterRateLimit(std::vector<std::shared_ptr<ftp_token_bucket>>& limits, asio::steady_timer& limit_timer, std::size_t bytes, Next next)
+	{
+		auto delay = ftp_token_bucket::clock::duration::zero();
+
+		for (const auto& limit : limits)
+			delay = std::max(delay, limit->Reserve(bytes));
+
+		if (delay <= ftp_token_bucket::clock::duration::zero())
+		{
+			next();
+			return;
+		}
+
+		limit_timer.expires_after(delay);
+		limit_timer.async_wait(
+			asio::bind_executor(m_conn_strand, [self = shared_from_this(), next = std::move(next)](std::error_code ec) mutable -> void
+			{
+				if (!ec)
+					next();
+			}));
+	}
+
 	void WriteCacheRequest()
 	{
+		if(m_cache_request.header.operation == ftp_request_header::ftp_operation::NEGOTIATE_COMPRESSION)
+		{
+			OnCompressionNegotiation();
+			m_cache_request = ftp_request();
+			AsyncReadHeader();
+			return;
+		}
+
+		const bool was_compressed = m_cache_request.header.compression != ftp_compression::NONE;
+
+		if(!m_cache_request.Decompress())
+		{
+			StopReading("Decompressing request failed.");
+			return;
+		}
+
+		if(was_compressed && DeliverToBodyStream())
+		{
+			m_cache_request = ftp_request();
+			AsyncReadHeader();
+			return;
+		}
+
 		m_conn_founder == conn_founder::server ? m_cache_request.AssignSender(shared_from_this()) : m_cache_request.AssignSender(nullptr);
-		m_recieved_requests.push_back(m_cache_request);
+		//blocks the io thread while the queue is full, which stops reading from every socket it serves until the dispatcher catches up
+		m_recieved_requests.Push(std::move(m_cache_request));
+		m_cache_request = ftp_request();
 		AsyncReadHeader();
 	}
 
+	//Hands a decompressed body over to the stream handler of its operation in BODY_SLICE_SIZE slices, like a streamed one.
+	//Returns false if the operation is not streamed.
+	bool DeliverToBodyStream()
+	{
+		const auto stream_it = m_body_stream_handlers.find(m_cache_request.header.operation);
+
+		if(stream_it == m_body_stream_handlers.end() || m_cache_request.GetSize() < stream_it->second.prefix_size)
+			return false;
+
+		auto& stream_handler = stream_it->second;
+		const auto* body = m_cache_request.mem_buffer.data();
+		const auto prefix_size = stream_handler.prefix_size;
+
+		ftp_request_reader prefix_reader(body, prefix_size);
+		stream_handler.on_begin(shared_from_this(), m_cache_request.header, prefix_reader);
+
+		for(auto slice_offset = prefix_size; slice_offset < m_cache_request.GetSize(); slice_offset += BODY_SLICE_SIZE)
+			stream_handler.on_slice(body + slice_offset, std::min(BODY_SLICE_SIZE, m_cache_request.GetSize() - slice_offset));
+
+		stream_handler.on_end();
+		return true;
+	}
+
+	//The server picks the codec from the client's offer and answers with it, the client takes over the answer.
+	void OnCompressionNegotiation()
+	{
+		uint32_t codecs = 0;
+
+		if(m_cache_request.GetSize() >= sizeof(codecs))
+			ftp_request_reader(m_cache_request).ReadTrivial(codecs);
+
+		const auto codec = ftp_chunk_codec::Negotiate(codecs);
+		m_compression.store(codec, std::memory_order_relaxed);
+
+		if(m_conn_founder == conn_founder::server)
+		{
+			ftp_request answer_request;
+			answer_request.header.operation = ftp_request_header::ftp_operation::NEGOTIATE_COMPRESSION;
+			auto chosen_codecs = codec == ftp_compression::NONE ? 0u : ftp_chunk_codec::CodecBit(codec);
+			answer_request.InsertTrivialToBuffer(chosen_codecs);
+			Write(std::move(answer_request));
+		}
+	}
+
 
 	
 };
\ No newline at end of file
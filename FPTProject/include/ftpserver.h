@@ -3,50 +3,143 @@
 #include<asio/ts/internet.hpp>
 #include<filesystem>
 #include"ftpconnection.h"
+#include"ftp_file_pump.h"
+#include"ftp_disk_writer.h"
+#include"ftp_listing_cache.h"
+#include"ftp_listing_stream.h"
 #include<fstream>
 #include<map>
 #include<mutex>
+#include<set>
+#include<thread>
 
 class ftp_server
 {
 
 private:
-	std::deque<ftp_request> m_received_requests;
+	static constexpr std::size_t REQUEST_QUEUE_CAPACITY = 4096;
+	static constexpr std::size_t MAX_DISPATCH_BATCH = 64;
+
+	ftp_request_queue m_received_requests{ REQUEST_QUEUE_CAPACITY };
 
 	std::vector<std::shared_ptr<ftp_connection>> m_established_connections;
+	std::mutex m_connections_mutex;
+
+	//server-wide caps, and caps per client id shared by all connections of the client; unlimited until configured
+	struct client_rate_limits
+	{
+		std::shared_ptr<ftp_token_bucket> egress = std::make_shared<ftp_token_bucket>();
+		std::shared_ptr<ftp_token_bucket> ingress = std::make_shared<ftp_token_bucket>();
+		//the client's share of ftp_transfer_scheduler, read by its file pumps each time they ask for credit
+		std::shared_ptr<std::atomic<unsigned int>> weight = std::make_shared<std::atomic<unsigned int>>(1);
+	};
+
+	client_rate_limits m_global_rate_limits;
+	std::map<uint32_t, client_rate_limits> m_client_rate_limits;
+	std::mutex m_rate_limits_mutex;
 
-	std::deque < std::shared_ptr<File::FileLocal>> m_files_to_send;
+	//shares the server between the clients downloading files, see ftp_file_pump
+	ftp_transfer_scheduler m_transfer_scheduler;
 
-	std::deque <std::shared_ptr<File::FileLocal>> m_files_to_send_pending;
+	//one pump per data connection that is downloading files, only touched by the dispatcher
+	std::map <std::shared_ptr<ftp_connection>, std::shared_ptr<ftp_file_pump>> m_file_pumps;
+
+	//one listing stream per data connection that was sent LIST_DIRECTORY pages, only touched by the dispatcher
+	std::map <std::shared_ptr<ftp_connection>, std::shared_ptr<ftp_listing_stream>> m_listing_streams;
 
 	std::map <unsigned int, std::shared_ptr<File::FileRemote>> m_files_to_save;
+	std::mutex m_files_to_save_mutex;
 	unsigned int m_files_uploaded_counter = 0;
 
-	std::atomic_bool server_running = false;
+	//state of the UPLOAD_DATA frame that is currently being streamed on a connection
+	struct upload_stream
+	{
+		unsigned int file_id = 0;
+		std::shared_ptr<File::FileRemote> file;
+		//of the file's partial copy, see ftp_disk_writer::Key
+		unsigned int writer_key = 0;
+		std::shared_ptr<ftp_connection> client;
+
+		//CRC32C sent with the chunk, and the one of the bytes received so far
+		uint32_t expected_crc = 0;
+		uint32_t crc = 0;
+		uint64_t chunk_offset = 0;
+
+		//slices gathered for the disk writer, borrowed from ftp_buffer_pool, and the file offset they start at
+		ftp_buffer_pool::buffer pending_bytes;
+		uint64_t pending_offset = 0;
+	};
+
+	//uploaded bytes, and every operation on the files they go to, are handed to the disk writer
+	static constexpr std::size_t DISK_WRITER_COUNT = 2;
+	ftp_disk_writer m_disk_writer{ DISK_WRITER_COUNT };
 
-	std::atomic_bool quit_sending = false;
-	std::mutex m_send_mutex;
-	std::condition_variable m_send_cond;
+	std::atomic_bool server_running = false;
 
+	//every connection is bound to its own strand, so clients progress in parallel on all io threads
 	asio::io_context m_server_context;
 
-	std::thread m_context_thread;
+	//reads of downloaded files through io_uring, nullptr where it is not available
+	std::shared_ptr<ftp_file_reader> m_file_reader = ftp_file_reader::Create(m_server_context, ftp_file_pump::TRANSFER_CHUNK_SIZE);
 
-	std::thread m_file_send_thread;
+	std::size_t m_io_thread_count;
+
+	std::vector<std::thread> m_context_threads;
 
 	asio::ip::tcp::acceptor m_server_acceptor;
 
 	std::string default_server_path = std::filesystem::current_path().string();
 
-	std::map<unsigned long, ftp_request> data_request_unverified;
+	//encoded CHANGE_DIRECTORY responses and LIST_DIRECTORY pages; streamed listings are inserted from the io threads
+	ftp_listing_cache m_listing_cache;
+	std::mutex m_listing_cache_mutex;
 
-	std::mutex m_file_pending_mutex;
+	//chunks of deduplicated uploads, kept under default_server_path and hidden from listings
+	ftp_chunk_store m_chunk_store{ default_server_path };
+
+	//file uploaded as a list of chunks, see UPLOAD_DEDUP
+	struct dedup_upload
+	{
+		std::vector<ftp_cdc::chunk> recipe;
+		//recipe indices of the chunks the client sends, in order; their bytes are uploaded to staged_path
+		std::vector<uint32_t> missing_chunks;
+		uint64_t missing_size = 0;
+		uint64_t file_size = 0;
+		std::string file_name;
+		std::string file_path;
+		std::string partial_path;
+		std::string staged_path;
+		std::shared_ptr<ftp_connection> client;
+	};
+
+	//deduplicated uploads waiting for their missing chunks, only touched by the dispatcher
+	std::map<unsigned int, dedup_upload> m_dedup_uploads;
+
+	//new version of a file uploaded as a delta against the server's copy, see UPLOAD_DELTA
+	struct delta_upload
+	{
+		uint32_t block_size = 0;
+		ftp_delta::delta file_delta;
+		bool instructions_received = false;
+		uint64_t file_size = 0;
+		std::string file_name;
+		std::string file_path;
+		std::string partial_path;
+		//literal bytes of the delta are uploaded here
+		std::string staged_path;
+		std::shared_ptr<ftp_connection> client;
+	};
+
+	//delta uploads waiting for their instructions and literals, only touched by the dispatcher
+	std::map<unsigned int, delta_upload> m_delta_uploads;
 
-	const unsigned long long MAX_BANDWIDTH = 100000000; //100MB per packet
+	std::map<unsigned long, ftp_request> data_request_unverified;
+	uint32_t m_requests_hashed = 0;
 
 public:
-	ftp_server(uint16_t port)
-		:m_server_acceptor(m_server_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+	ftp_server(uint16_t port, std::size_t io_thread_count = std::thread::hardware_concurrency())
+		:m_io_thread_count(std::max<std::size_t>(io_thread_count, 1)),
+		m_server_acceptor(m_server_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
 	{}
 
 	~ftp_server()
@@ -62,19 +155,15 @@ public:
 			server_running = true;
 			AsyncAcceptClient();
 
-			m_context_thread = std::thread(
-				[this]() -> void
-				{
-					m_server_context.run();
-				}
-			);
-
-			m_file_send_thread = std::thread(
-				[this]() -> void
-				{
-					SendFileBytes();
-				}
-			);
+			for (std::size_t i = 0; i < m_io_thread_count; ++i)
+			{
+				m_context_threads.emplace_back(
+					[this]() -> void
+					{
+						m_server_context.run();
+					}
+				);
+			}
 		}
 		catch (std::exception& e)
 		{
@@ -82,24 +171,27 @@ public:
 			return;
 		}
 
-		std::cout << "Server started successfully. \n";
+		std::cout << "Server started successfully on " << m_io_thread_count << " io threads. \n";
 	}
 
 	void Stop()
 	{
 		server_running = false;
-		m_server_context.stop();
 
-		if (m_context_thread.joinable())
-			m_context_thread.join();
+		//unblocks io threads waiting for space in the queue and the dispatcher waiting for requests
+		m_received_requests.Close();
+		m_server_context.stop();
 
+		for (auto& context_thread : m_context_threads)
 		{
-			std::unique_lock<std::mutex> lock(m_send_mutex);
-			quit_sending = true;
+			if (context_thread.joinable())
+				context_thread.join();
 		}
 
-		m_send_cond.notify_one();
-		m_file_send_thread.join();
+		m_context_threads.clear();
+
+		//whatever was received is still written
+		m_disk_writer.Stop();
 
 		std::cout << "Server stopped \n";
 
@@ -120,16 +212,19 @@ public:
 							ftp_connection::conn_type::server_remote,
 							ftp_connection::conn_founder::server,
 							std::move(socket),
-							m_server_context,
 							m_received_requests
 							);
 
 					
-					m_established_connections.push_back(std::move(new_connection));
-					
-					ftp_server::ListenToClient(m_established_connections.back());
+					RegisterUploadStream(*new_connection);
+					RegisterCloseHandler(*new_connection);
+					ftp_server::ListenToClient(new_connection);
+					ApplyRateLimits(*new_connection);
 
-					std::cout << "[" << m_established_connections.back()->GetId() << "] New connection! \n";
+					std::cout << "[" << new_connection->GetId() << "] New connection! \n";
+
+					std::lock_guard<std::mutex> connections_lock(m_connections_mutex);
+					m_established_connections.push_back(std::move(new_connection));
 
 				}
 				else
@@ -141,6 +236,21 @@ public:
 			});
 	}
 
+	//A connection that drops without DISCONNECT, ex. when the client crashed, is cleaned up by the dispatcher like one that sent it:
+	//its file pump gives its credit back to the scheduler and the pump and listing stream are let go.
+	void RegisterCloseHandler(ftp_connection& new_connection)
+	{
+		new_connection.SetCloseHandler(
+			[this](std::shared_ptr<ftp_connection> closed_connection) -> void
+			{
+				ftp_request disconnect_request;
+				disconnect_request.header.operation = ftp_request_header::ftp_operation::DISCONNECT;
+				disconnect_request.AssignSender(std::move(closed_connection));
+
+				m_received_requests.Push(std::move(disconnect_request));
+			});
+	}
+
 	static void ListenToClient(std::shared_ptr<ftp_connection> m_client_conn)
 	{
 
@@ -151,107 +261,67 @@ public:
 	}
 
 
-	void SendFileBytes()
+	//Rates are in bytes per second, 0 removes the limit. Limits can be changed while clients are connected.
+	void SetGlobalRateLimits(uint64_t egress_rate, uint64_t ingress_rate)
 	{
+		m_global_rate_limits.egress->SetRate(egress_rate);
+		m_global_rate_limits.ingress->SetRate(ingress_rate);
+	}
 
-		while(server_running)
-		{
-			std::unique_lock<std::mutex> check_for_send_lock(m_send_mutex);
-			m_send_cond.wait(check_for_send_lock, [this]() -> bool
-				{
-					return quit_sending || (!m_files_to_send.empty() || !m_files_to_send_pending.empty());
-				});
-
-
-			if (quit_sending)
-				return;
-
-
-			Sleep(100);
-			for(auto& curr_file : m_files_to_send)
-			{
-				
-				if(curr_file->receiver->IsSocketOpen())
-				{
-					ftp_request file_bytes_response;
-					file_bytes_response.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FILE;
-					std::vector<char> buffer(std::min(MAX_BANDWIDTH, curr_file->remaining_bytes));
-
-					file_bytes_response.InsertTrivialToBuffer(curr_file->client_file_id);
-
-					curr_file->file_src->read(buffer.data(), buffer.size());
-
-					curr_file->remaining_bytes -= buffer.size();
-
-					file_bytes_response.CopyFromVector(buffer);
-
-					curr_file->receiver->Write(file_bytes_response);
-				}
-			}
-
-
-			if(!m_files_to_send.empty())
-			{
-				m_files_to_send.erase(
-					std::remove_if(m_files_to_send.begin(), m_files_to_send.end(),
-						[](std::shared_ptr<File::FileLocal> const entry)
-						{
-							return entry->remaining_bytes <= 0 || !entry->receiver->IsSocketOpen();
-						}),
-					m_files_to_send.end()
-				);
-			}
-
-			//locking the state of the pending vector
-			//to add all pending requests and erase them later
-
-			m_file_pending_mutex.lock();
-
-			for(auto& pending_file : m_files_to_send_pending)
-			{
-				m_files_to_send.push_back(std::move(pending_file));
-			}
-
-			if(!m_files_to_send_pending.empty())
-			{
-				
-				m_files_to_send_pending.erase(
-					std::remove_if(m_files_to_send_pending.begin(), m_files_to_send_pending.end(),
-						[](std::shared_ptr<File::FileLocal> const entry)
-						{
-							return entry == nullptr;
-						}),
-					m_files_to_send.end()
-							);
+	//client_id as returned by ftp_connection::GetId()
+	void SetClientRateLimits(uint32_t client_id, uint64_t egress_rate, uint64_t ingress_rate)
+	{
+		std::lock_guard<std::mutex> limits_lock(m_rate_limits_mutex);
 
-			}
+		auto& client_limits = m_client_rate_limits[client_id];
+		client_limits.egress->SetRate(egress_rate);
+		client_limits.ingress->SetRate(ingress_rate);
+	}
 
-			m_file_pending_mutex.unlock();
-		}
+	//The client gets weight times the download share of a client of weight 1, see ftp_transfer_scheduler.
+	//Takes effect on the next credit its file pumps ask for, also while it is connected.
+	void SetClientWeight(uint32_t client_id, unsigned int weight)
+	{
+		std::lock_guard<std::mutex> limits_lock(m_rate_limits_mutex);
+		m_client_rate_limits[client_id].weight->store(std::max(weight, 1u), std::memory_order_relaxed);
 	}
 
+	//Dispatches received requests until the server is stopped.
+	//The thread sleeps while there is nothing to do and handles bursts of requests in batches.
 	void CheckForRequests()
 	{
-		while(true)
+		std::vector<ftp_request> request_batch;
+		request_batch.reserve(MAX_DISPATCH_BATCH);
+
+		while(server_running)
 		{
+			request_batch.clear();
+			m_received_requests.WaitAndDrainInto(request_batch, MAX_DISPATCH_BATCH);
 
-			while (!m_received_requests.empty())
+			for (auto& new_request : request_batch)
 			{
 
-				auto new_request = m_received_requests.front();
-				m_received_requests.pop_front();
+				try
+				{
+					if (new_request.header.operation == ftp_request_header::ftp_operation::DATA_STREAM_VERIFIED)
+						OnDataRequest(new_request.sender, new_request);
 
-				if (new_request.header.operation == ftp_request_header::ftp_operation::DATA_STREAM_VERIFIED)
-					OnDataRequest(new_request.sender, new_request);
+					else if (new_request.header.operation == ftp_request_header::ftp_operation::UPLOAD_FINISHED)
+						OnUploadFinished(new_request.sender, new_request);
 
-				else if (new_request.header.operation == ftp_request_header::ftp_operation::UPLOAD_DATA)
-					OnUpload(new_request.sender, new_request);
+					else if (new_request.header.operation == ftp_request_header::ftp_operation::DELTA_INSTRUCTIONS)
+						OnDeltaInstructions(new_request);
 
-				else if (new_request.header.operation == ftp_request_header::ftp_operation::DISCONNECT)
-					OnDisconnectRequest(new_request.sender);
+					else if (new_request.header.operation == ftp_request_header::ftp_operation::DISCONNECT)
+						OnDisconnectRequest(new_request.sender);
 
-				else
-					OnControlRequest(new_request.sender, new_request);
+					else
+						OnControlRequest(new_request.sender, new_request);
+				}
+				catch (std::out_of_range& e)
+				{
+					std::cout << "[" << new_request.sender->GetId() << "] Malformed request: " << e.what() << "\n";
+				}
 
 			}
 		}
@@ -262,13 +332,13 @@ private:
 
 
 		//saving requested data
-		unsigned long request_hash = ftp_server::HashRequest(client->GetId());
+		unsigned long request_hash = HashRequest(client->GetId());
 		data_request_unverified.insert({ request_hash, std::move(req)});
 
 		ftp_request response;
 		response.header.operation = ftp_request_header::ftp_operation::SERVER_OK;
 		response.InsertTrivialToBuffer(request_hash);
-		client->Write(response);
+		client->Write(std::move(response));
 		
 	}
 
@@ -276,8 +346,14 @@ private:
 	{
 		unsigned long data_hash;
 
-		req.ExtractTrivialFromBuffer(data_hash);
-		auto& data_request = data_request_unverified[data_hash];
+		ftp_request_reader(req).ReadTrivial(data_hash);
+
+		const auto data_request_it = data_request_unverified.find(data_hash);
+		if (data_request_it == data_request_unverified.end())
+			return;
+
+		auto& data_request = data_request_it->second;
+		ftp_request_reader data_reader(data_request);
 
 		switch(data_request.header.operation)
 		{
@@ -286,24 +362,119 @@ private:
 
 			std::string user_path;
 			
-			data_request.ExtractStringFromBuffer(user_path);
+			data_reader.ReadString(user_path);
+
+			//one cache key per directory, however the client spells its path
+			auto directory = std::filesystem::path(default_server_path + user_path).lexically_normal();
+
+			if (!directory.has_filename())
+				directory = directory.parent_path();
+
+			const auto directory_path = directory.string();
+
+			std::vector<ftp_frame> listing;
+			uint64_t listing_version = 0;
+
+			{
+				std::lock_guard<std::mutex> cache_lock(m_listing_cache_mutex);
+
+				if (m_listing_cache.Find(directory_path, "", listing, listing_version))
+				{
+					data_request_unverified.erase(data_hash);
+					client->Write(std::move(listing.front()));
+					break;
+				}
+			}
 
 			ftp_request response;
 			response.header.operation = ftp_request_header::ftp_operation::CHANGE_DIRECTORY;
 
-			for (const auto& file : std::filesystem::directory_iterator(default_server_path + user_path))
+			for (const auto& file : std::filesystem::directory_iterator(directory_path))
 			{
+				if (file.path().lexically_normal() == m_chunk_store.Root())
+					continue;
 
 				std::string file_name = file.path().filename().string();
 				File::file_type file_type = file.is_directory() ? File::file_type::DIR : File::file_type::FILE;
 				std::size_t file_size = file.file_size();
+				int64_t file_time = File::FileTime(file.path());
 
-				File::InsertFileDetails(response, file_name, file_size, file_type);
+				File::InsertFileDetails(response, file_name, file_size, file_type, file_time);
 				
 			}
 
+			listing.push_back(std::move(response).Freeze());
+
+			{
+				std::lock_guard<std::mutex> cache_lock(m_listing_cache_mutex);
+				m_listing_cache.Insert(directory_path, "", listing_version, listing);
+			}
+
+			data_request_unverified.erase(data_hash);
+			client->Write(std::move(listing.front()));
+			break;
+			}
+
+		case ftp_request_header::ftp_operation::LIST_DIRECTORY:
+			{
+
+			std::string user_path;
+			uint32_t page_size;
+			File::listing_order order;
+
+			ftp_listing_stream::listing_request listing_request;
+
+			data_reader.ReadString(user_path);
+			data_reader.ReadTrivial(page_size, order, listing_request.listing_id);
+			data_reader.ReadString(listing_request.name_prefix);
+
+			auto directory = std::filesystem::path(default_server_path + user_path).lexically_normal();
+
+			if (!directory.has_filename())
+				directory = directory.parent_path();
+
+			listing_request.directory = directory;
+			listing_request.page_size = page_size;
+			listing_request.order = order;
+			listing_request.hidden_path = m_chunk_store.Root();
+
 			data_request_unverified.erase(data_hash);
-			client->Write(response);
+
+			auto& listing_stream = m_listing_streams[client];
+
+			if (!listing_stream)
+				listing_stream = std::make_shared<ftp_listing_stream>(client);
+
+			//filtered listings are rarely asked for twice, only full ones are cached
+			if (!listing_request.name_prefix.empty())
+			{
+				listing_stream->List(std::move(listing_request));
+				break;
+			}
+
+			const auto directory_path = directory.string();
+			const auto variant = "pages:" + std::to_string(page_size) + ":" + std::to_string(static_cast<uint32_t>(order));
+
+			std::vector<ftp_frame> pages;
+			uint64_t listing_version = 0;
+
+			{
+				std::lock_guard<std::mutex> cache_lock(m_listing_cache_mutex);
+
+				if (m_listing_cache.Find(directory_path, variant, pages, listing_version))
+				{
+					listing_stream->Replay(std::move(pages), listing_request.listing_id);
+					break;
+				}
+			}
+
+			listing_stream->List(std::move(listing_request),
+				[this, directory_path, variant, listing_version](std::vector<ftp_frame> listed_pages) -> void
+				{
+					std::lock_guard<std::mutex> cache_lock(m_listing_cache_mutex);
+					m_listing_cache.Insert(directory_path, variant, listing_version, listed_pages);
+				});
+
 			break;
 			}
 
@@ -312,32 +483,74 @@ private:
 			
 			std::string user_path;
 
-			data_request.ExtractStringFromBuffer(user_path);
+			data_reader.ReadString(user_path);
 			
 			ftp_request response;
 			response.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FILE;
-			while (!data_request.mem_buffer.empty())
+			while (!data_reader.Empty())
 			{
 				std::string file_name;
 				int file_id;
-				data_request.ExtractTrivialFromBuffer(file_id);
-				data_request.ExtractStringFromBuffer(file_name);
+				//the client asks to resume from start_offset if it still has the same version of the file
+				uint64_t start_offset;
+				uint64_t expected_size;
+				int64_t expected_time;
+				//only this many bytes are sent when the client downloads the file in segments, 0 means up to the end
+				uint64_t range_length;
+				data_reader.ReadTrivial(file_id);
+				data_reader.ReadString(file_name);
+				data_reader.ReadTrivial(start_offset, expected_size, expected_time, range_length);
 
 
+				const auto file_path = ServerFilePath(user_path, file_name);
+
 				std::shared_ptr<std::ifstream> file_src = 
-					std::make_shared<std::ifstream>(default_server_path + user_path + "\\" + file_name, std::ios::binary);
+					std::make_shared<std::ifstream>(file_path, std::ios::binary);
+
+				uint64_t file_size = std::filesystem::file_size(file_path);
+				const bool same_file = file_size == expected_size && File::FileTime(file_path) == expected_time;
 
-				auto file_size = std::filesystem::file_size(default_server_path + user_path + "\\" + file_name);
+				if (range_length > 0)
+				{
+					//a segment of a file that changed meanwhile is refused, nothing is sent for it
+					if (!same_file || start_offset > file_size || range_length > file_size - start_offset)
+						start_offset = range_length = 0;
+				}
+				else
+				{
+					if (!same_file || start_offset > file_size)
+						start_offset = 0;
 
-				m_file_pending_mutex.lock();
+					range_length = file_size - start_offset;
+				}
 
-				m_files_to_send_pending.emplace_back(
-					std::make_shared<File::FileLocal>(std::move(file_src), file_size, file_id, client)
-				);
+				file_src->seekg(start_offset);
 
-				m_file_pending_mutex.unlock();
+				//tells the client where the following chunks of the file start and how many of them follow
+				ftp_request start_response;
+				start_response.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_START;
+				start_response.InsertTrivialToBuffer(file_id, start_offset, file_size, range_length);
+				client->Write(std::move(start_response));
 
-				m_send_cond.notify_all();
+				auto& file_pump = m_file_pumps[client];
+
+				if (!file_pump)
+				{
+					std::shared_ptr<std::atomic<unsigned int>> client_weight;
+
+					{
+						std::lock_guard<std::mutex> limits_lock(m_rate_limits_mutex);
+						client_weight = m_client_rate_limits[client->GetId()].weight;
+					}
+
+					file_pump = std::make_shared<ftp_file_pump>(client, m_transfer_scheduler, m_file_reader, std::move(client_weight));
+				}
+
+				file_pump->AddFile(
+					std::make_shared<File::FileLocal>(std::move(file_src), range_length, file_id, client),
+					file_path,
+					start_offset
+				);
 			}
 
 			data_request_unverified.erase(data_hash);
@@ -346,54 +559,211 @@ private:
 
 		case ftp_request_header::ftp_operation::UPLOAD_FILE:
 			{
-			
-			ftp_request response;
-			response.header.operation = ftp_request_header::ftp_operation::UPLOAD_ACCEPT;
 
 			std::string user_path;
-			data_request.ExtractStringFromBuffer(user_path);
+			data_reader.ReadString(user_path);
 
-				while(data_request.header.request_size > 0)
+				while(!data_reader.Empty())
 				{
 					std::string file_name;
 					uintmax_t file_size;
-					data_request.ExtractStringFromBuffer(file_name);
-					data_request.ExtractTrivialFromBuffer(file_size);
+					int64_t file_time;
+					//echoed with UPLOAD_ACCEPT, the client matches it with its file by it
+					int client_file_id;
+					data_reader.ReadString(file_name);
+					data_reader.ReadTrivial(file_size, file_time, client_file_id);
+
+					//a partial copy left by an interrupted upload of the same file is continued
+					const auto partial_path = ServerFilePath(user_path, File::PartialFileName(file_name, file_size, file_time));
+					//an earlier upload of the same file, ex. one the client gave up on and sent again, stops writing to it
+					CancelUploadsOf(partial_path);
+
+					auto upload_file = std::make_shared<File::FileRemote>(nullptr, file_size, file_name, client);
+					upload_file->file_path = ServerFilePath(user_path, file_name);
+					upload_file->partial_path = partial_path;
+
+					const auto file_id = m_files_uploaded_counter++;
+
+					//the partial copy is measured and opened behind the writes of earlier uploads of it
+					m_disk_writer.Submit(ftp_disk_writer::Key(partial_path),
+						[this, file_id, client_file_id, upload_file, client]() -> void
+						{
+							const uint64_t start_offset = OpenUpload(file_id, upload_file, true);
 
-					std::shared_ptr<std::ofstream> file_dest =
-						std::make_shared<std::ofstream>(default_server_path + user_path + "\\" + file_name, std::ios::binary);
+							ftp_request response;
+							response.header.operation = ftp_request_header::ftp_operation::UPLOAD_ACCEPT;
+							response.InsertTrivialToBuffer(client_file_id, file_id, start_offset);
+							client->Write(std::move(response));
 
-					m_files_to_save.insert({
-						m_files_uploaded_counter,
-							std::make_shared<File::FileRemote>(std::move(file_dest), file_size, file_name, client)
+							//nothing left to send, the whole file was already there
+							if (upload_file->remaining_bytes == 0)
+								FinishUpload(*upload_file, client);
 						});
-					
-					response.InsertTrivialToBuffer(m_files_uploaded_counter);
-
-					m_files_uploaded_counter++;
 				}
 				data_request_unverified.erase(data_hash);
-				client->Write(response);
 			break;
 			}
 
 
+		case ftp_request_header::ftp_operation::UPLOAD_DEDUP:
+			{
+
+			std::string user_path;
+			std::string file_name;
+			uintmax_t file_size;
+			int64_t file_time;
+			//echoed with the missing chunks, the client matches them with its file by it
+			int client_file_id;
+			uint32_t chunk_count;
+			data_reader.ReadString(user_path);
+			data_reader.ReadString(file_name);
+			data_reader.ReadTrivial(file_size, file_time, client_file_id, chunk_count);
+
+			if (chunk_count > data_reader.Remaining() / (sizeof(ftp_sha256::hash) + sizeof(uint32_t)))
+				throw std::out_of_range("more chunks announced than sent");
+
+			dedup_upload upload;
+			upload.recipe.resize(chunk_count);
+			uint64_t recipe_size = 0;
+
+			//a chunk that occurs several times in the file is only asked for once
+			std::set<ftp_sha256::hash> requested_chunks;
+
+			for (uint32_t chunk_index = 0; chunk_index < chunk_count; ++chunk_index)
+			{
+				auto& chunk = upload.recipe[chunk_index];
+				data_reader.ReadTrivial(chunk.hash, chunk.length);
+
+				if (chunk.length == 0 || chunk.length > ftp_cdc::MAX_CHUNK_SIZE)
+					throw std::out_of_range("chunk length out of range");
+
+				chunk.offset = recipe_size;
+				recipe_size += chunk.length;
+
+				if (!m_chunk_store.Contains(chunk.hash) && requested_chunks.insert(chunk.hash).second)
+				{
+					upload.missing_chunks.push_back(chunk_index);
+					upload.missing_size += chunk.length;
+				}
+			}
+
+			if (recipe_size != file_size)
+				throw std::out_of_range("chunks don't add up to the file size");
+
+			upload.file_size = file_size;
+			upload.file_name = file_name;
+			upload.file_path = ServerFilePath(user_path, file_name);
+			upload.partial_path = ServerFilePath(user_path, File::PartialFileName(file_name, file_size, file_time));
+			upload.staged_path = ServerFilePath(user_path, File::PartialFileName(file_name + ".dedup", file_size, file_time));
+			upload.client = client;
+
+			const auto file_id = m_files_uploaded_counter++;
+			auto missing_count = static_cast<uint32_t>(upload.missing_chunks.size());
+
+			ftp_request response;
+			response.header.operation = ftp_request_header::ftp_operation::UPLOAD_DEDUP;
+			response.InsertTrivialToBuffer(client_file_id, file_id, missing_count);
+
+			for (auto chunk_index : upload.missing_chunks)
+				response.InsertTrivialToBuffer(chunk_index);
+
+			if (upload.missing_size > 0)
+			{
+				CancelUploadsOf(upload.staged_path);
+
+				//the missing chunks are uploaded back to back like a file of their own
+				auto staged_file = std::make_shared<File::FileRemote>(nullptr, upload.missing_size, file_name, client);
+				staged_file->file_path = upload.file_path;
+				staged_file->partial_path = upload.staged_path;
+
+				m_disk_writer.Submit(ftp_disk_writer::Key(upload.staged_path),
+					[this, file_id, staged_file, client, response = std::make_shared<ftp_request>(std::move(response))]() -> void
+					{
+						OpenUpload(file_id, staged_file, false);
+						client->Write(std::move(*response));
+					});
+
+				m_dedup_uploads.insert({ file_id, std::move(upload) });
+			}
+			else
+			{
+				client->Write(std::move(response));
+
+				//every chunk is already in the store
+				m_disk_writer.Submit(ftp_disk_writer::Key(upload.partial_path),
+					[this, upload = std::move(upload), client]() mutable -> void
+					{
+						AssembleDedupUpload(std::move(upload), client);
+					});
+			}
+
+			data_request_unverified.erase(data_hash);
+			break;
+			}
+
+		case ftp_request_header::ftp_operation::UPLOAD_DELTA:
+			{
+
+			std::string user_path;
+			std::string file_name;
+			uintmax_t file_size;
+			int64_t file_time;
+			//echoed with the signatures, the client matches them with its file by it
+			int client_file_id;
+			data_reader.ReadString(user_path);
+			data_reader.ReadString(file_name);
+			data_reader.ReadTrivial(file_size, file_time, client_file_id);
+
+			delta_upload upload;
+			upload.file_size = file_size;
+			upload.file_name = file_name;
+			upload.file_path = ServerFilePath(user_path, file_name);
+			upload.partial_path = ServerFilePath(user_path, File::PartialFileName(file_name + ".delta", file_size, file_time));
+			upload.staged_path = ServerFilePath(user_path, File::PartialFileName(file_name + ".literals", file_size, file_time));
+			upload.client = client;
+
+			std::error_code ec;
+			const auto old_file_size = std::filesystem::file_size(upload.file_path, ec);
+			upload.block_size = ftp_delta::BlockSize(ec ? 0 : old_file_size);
+
+			const auto file_id = m_files_uploaded_counter++;
+			CancelUploadsOf(upload.staged_path);
+
+			//the literals are uploaded like a file of their own, they are at most the whole new file
+			auto staged_file = std::make_shared<File::FileRemote>(nullptr, file_size, file_name, client);
+			staged_file->file_path = upload.file_path;
+			staged_file->partial_path = upload.staged_path;
+
+			//the client sends the literals once it has the signatures, which are sent behind the opening of the staged file
+			m_disk_writer.Submit(ftp_disk_writer::Key(upload.staged_path),
+				[this, file_id, staged_file]() -> void
+				{
+					OpenUpload(file_id, staged_file, false);
+				});
+
+			SendDeltaSignatures(upload.file_path, upload.block_size, client_file_id, file_id, upload.staged_path, client);
+			m_delta_uploads.insert({ file_id, std::move(upload) });
+
+			data_request_unverified.erase(data_hash);
+			break;
+			}
+
 		case ftp_request_header::ftp_operation::DELETE_FILE:
 			{
 			std::string user_path;
 
-			data_request.ExtractStringFromBuffer(user_path);
+			data_reader.ReadString(user_path);
 
 			ftp_request response;
 			response.header.operation = ftp_request_header::ftp_operation::DELETE_FILE;
-			while (!data_request.mem_buffer.empty())
+			while (!data_reader.Empty())
 			{
 				
 				std::string file_name;
 
-				data_request.ExtractStringFromBuffer(file_name);
+				data_reader.ReadString(file_name);
 
-				remove((default_server_path + user_path + "\\" + file_name).c_str());
+				remove(ServerFilePath(user_path, file_name).c_str());
 
 			}
 
@@ -401,80 +771,769 @@ private:
 			std::string server_response = "Files successfully deleted!";
 			response.InsertStringToBuffer(server_response);
 
-			client->Write(response);
+			client->Write(std::move(response));
 			break;
 			}
 
+		//only control requests are verified, anything else, ex. a response opcode a client sends by mistake, is dropped
+		default:
+			std::cout << "[" << client->GetId() << "] Dropped unexpected request, operation "
+				<< static_cast<uint32_t>(data_request.header.operation) << "\n";
+
+			data_request_unverified.erase(data_hash);
+			break;
 		}
 	}
 
 
-	void OnUpload(std::shared_ptr<ftp_connection> client, ftp_request& req)
+	//UPLOAD_DATA frames are not queued for the dispatcher, they are streamed into the destination file
+	//slice by slice on the io thread, see ftp_connection::body_stream_handler.
+	void RegisterUploadStream(ftp_connection& client_conn)
+	{
+		auto stream = std::make_shared<upload_stream>();
+
+		ftp_connection::body_stream_handler upload_handler;
+
+		//file id, CRC32C of the chunk and the length of the file bytes block
+		upload_handler.prefix_size = sizeof(unsigned int) + sizeof(uint32_t) + sizeof(std::size_t);
+
+		upload_handler.on_begin = [this, stream](std::shared_ptr<ftp_connection> client, const ftp_request_header&, ftp_request_reader& prefix) -> void
+		{
+			OnUploadBegin(*stream, std::move(client), prefix);
+		};
+
+		upload_handler.on_slice = [this, stream](const unsigned char* data, std::size_t length) -> void
+		{
+			OnUploadSlice(*stream, data, length);
+		};
+
+		upload_handler.on_end = [this, stream]() -> void
+		{
+			OnUploadEnd(*stream);
+		};
+
+		//the stream holds the connection while a body is read, which must not outlive a failed read
+		upload_handler.on_abort = [stream]() -> void
+		{
+			OnUploadAbort(*stream);
+		};
+
+		client_conn.SetBodyStreamHandler(ftp_request_header::ftp_operation::UPLOAD_DATA, std::move(upload_handler));
+	}
+
+	void OnUploadBegin(upload_stream& stream, std::shared_ptr<ftp_connection> client, ftp_request_reader& prefix)
+	{
+		prefix.ReadTrivial(stream.file_id, stream.expected_crc);
+
+		std::lock_guard<std::mutex> files_lock(m_files_to_save_mutex);
+
+		const auto file_it = m_files_to_save.find(stream.file_id);
+		stream.file = file_it != m_files_to_save.end() ? file_it->second : nullptr;
+		stream.client = std::move(client);
+		stream.crc = 0;
+
+		if (stream.file)
+		{
+			stream.chunk_offset = stream.file->file_size - stream.file->remaining_bytes;
+			stream.writer_key = ftp_disk_writer::Key(stream.file->partial_path);
+		}
+	}
+
+	void OnUploadSlice(upload_stream& stream, const unsigned char* data, std::size_t length)
+	{
+		//bytes of files that are no longer expected (ex. rejected or dropped ones) are discarded
+		if (!stream.file)
+			return;
+
+		stream.crc = ftp_crc32c::Update(stream.crc, data, length);
+		stream.file->digest.Update(data, length);
+
+		auto slice_offset = stream.file->file_size - stream.file->remaining_bytes;
+		stream.file->remaining_bytes -= std::min(length, stream.file->remaining_bytes);
+
+		//the slice buffer is reused for the next slice, so the bytes are copied into pool buffers that the writer takes over
+		while (length > 0)
+		{
+			if (stream.pending_bytes.capacity() == 0)
+			{
+				stream.pending_bytes = ftp_buffer_pool::Shared().Acquire();
+				stream.pending_offset = slice_offset;
+			}
+
+			const auto taken = std::min(length, ftp_buffer_pool::BUFFER_CAPACITY - stream.pending_bytes.size());
+			stream.pending_bytes.insert(stream.pending_bytes.end(), data, data + taken);
+			data += taken;
+			length -= taken;
+			slice_offset += taken;
+
+			if (stream.pending_bytes.size() == ftp_buffer_pool::BUFFER_CAPACITY)
+				FlushUploadBytes(stream);
+		}
+	}
+
+	void FlushUploadBytes(upload_stream& stream)
+	{
+		if (stream.pending_bytes.empty())
+			return;
+
+		std::lock_guard<std::mutex> write_lock(stream.file->write_mutex);
+
+		if (stream.file->cancelled)
+			ftp_buffer_pool::Shared().Release(std::move(stream.pending_bytes));
+		else if (stream.file->file_handle)
+			m_disk_writer.Write(stream.writer_key, stream.file->file_handle, stream.pending_offset, std::move(stream.pending_bytes));
+		else
+			m_disk_writer.Write(stream.writer_key, stream.file->file_dest, std::move(stream.pending_bytes));
+
+		stream.pending_bytes = ftp_buffer_pool::buffer();
+	}
+
+	//Drops the uploads still writing to partial_path, anything they hand to the disk writer afterwards is discarded.
+	//Their copy is closed behind the bytes they already handed over, see CloseUpload.
+	void CancelUploadsOf(const std::string& partial_path, bool on_writer = false)
+	{
+		std::vector<std::pair<unsigned int, std::shared_ptr<File::FileRemote>>> cancelled_uploads;
+
+		{
+			std::lock_guard<std::mutex> files_lock(m_files_to_save_mutex);
+
+			for (auto file_it = m_files_to_save.begin(); file_it != m_files_to_save.end();)
+			{
+				if (file_it->second->partial_path == partial_path)
+				{
+					cancelled_uploads.push_back(std::move(*file_it));
+					file_it = m_files_to_save.erase(file_it);
+				}
+				else
+					++file_it;
+			}
+		}
+
+		for (auto& [file_id, upload_file] : cancelled_uploads)
+		{
+			std::cout << "File [" << file_id << "]: taken over by a new upload of the same file\n";
+
+			//the dedup and delta states are only touched by the dispatcher, a writer leaves them to OnDisconnectRequest
+			if (!on_writer)
+			{
+				//a staged dedup or delta upload is replaced by the new one, which reuses its staged file
+				m_dedup_uploads.erase(file_id);
+				m_delta_uploads.erase(file_id);
+			}
+
+			CloseUpload(std::move(upload_file), on_writer);
+		}
+	}
+
+	//Stops an upload that was dropped from m_files_to_save. Called on the writer of its partial copy,
+	//the copy is closed right away: bytes already queued behind it were appended through file_dest and go nowhere,
+	//positional ones hold the same bytes of the same version of the file as the upload that takes over.
+	//write_mutex is not taken there, its holder may be waiting for this very writer to drain.
+	void CloseUpload(std::shared_ptr<File::FileRemote> upload_file, bool on_writer = false)
+	{
+		if (on_writer)
+		{
+			upload_file->cancelled = true;
+			upload_file->file_dest->close();
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> write_lock(upload_file->write_mutex);
+			upload_file->cancelled = true;
+		}
+
+		m_disk_writer.Submit(ftp_disk_writer::Key(upload_file->partial_path),
+			[upload_file]() -> void
+			{
+				upload_file->file_dest->close();
+			});
+	}
+
+	//Runs on the writer of the upload's partial copy, behind everything earlier uploads of the same file handed to it,
+	//so the copy is complete when its size is taken as the resume offset. Opens the copy, registers the upload
+	//for its UPLOAD_DATA frames and returns the offset it starts at, 0 unless resume is set.
+	uint64_t OpenUpload(unsigned int file_id, const std::shared_ptr<File::FileRemote>& upload_file, bool resume)
+	{
+		//uploads of the same file registered since the dispatcher cancelled the earlier ones
+		CancelUploadsOf(upload_file->partial_path, true);
+
+		const uint64_t start_offset = resume ? File::ResumeOffset(upload_file->partial_path, upload_file->file_size) : 0;
+
+		upload_file->file_dest = std::make_shared<std::ofstream>(upload_file->partial_path,
+			std::ios::binary | (start_offset > 0 ? std::ios::app : std::ios::trunc));
+		upload_file->remaining_bytes = upload_file->file_size - start_offset;
+		OpenUploadHandle(*upload_file);
+
+		if (upload_file->remaining_bytes > 0)
+		{
+			std::lock_guard<std::mutex> files_lock(m_files_to_save_mutex);
+			m_files_to_save.insert({ file_id, upload_file });
+		}
+
+		return start_offset;
+	}
+
+	//Uploads are written at their offsets when the disk writer has io_uring, file_dest only creates the file then.
+	void OpenUploadHandle(File::FileRemote& upload_file)
+	{
+		if (m_disk_writer.UsesIoUring())
+			upload_file.file_handle = ftp_file_handle::OpenForWrite(upload_file.partial_path);
+	}
+
+	void OnUploadEnd(upload_stream& stream)
+	{
+		if (stream.file)
+		{
+			//a frame's bytes are written in as few writes as possible, up to a pool buffer each
+			FlushUploadBytes(stream);
+
+			std::cout << "File [" << stream.file_id << "]: bytes remaining -> " << stream.file->remaining_bytes << "\n";
+
+			//the file is finished once the client's digest arrives, see OnUploadFinished
+			if (stream.crc != stream.expected_crc)
+				RejectCorruptChunk(stream);
+		}
+
+		stream.file.reset();
+		stream.client.reset();
+	}
+
+	//the bytes of the cut chunk are dropped, the upload is resumed from what is on disk
+	static void OnUploadAbort(upload_stream& stream)
+	{
+		if (stream.pending_bytes.capacity() > 0)
+			ftp_buffer_pool::Shared().Release(std::move(stream.pending_bytes));
+
+		stream.pending_bytes = ftp_buffer_pool::buffer();
+		stream.file.reset();
+		stream.client.reset();
+	}
+
+	//The partial copy is cut back to the start of the corrupt chunk and the upload is dropped.
+	//The client is told where once the partial copy is cut, uploading the file again resumes from that chunk.
+	void RejectCorruptChunk(upload_stream& stream)
+	{
+		std::cout << "File [" << stream.file_id << "]: corrupt chunk at byte " << stream.chunk_offset << "\n";
+
+		{
+			std::lock_guard<std::mutex> files_lock(m_files_to_save_mutex);
+			m_files_to_save.erase(stream.file_id);
+		}
+
+		m_disk_writer.Submit(stream.writer_key,
+			[file = stream.file, client = stream.client, file_id = stream.file_id, chunk_offset = stream.chunk_offset]() mutable -> void
+			{
+				file->file_dest->close();
+
+				std::error_code ec;
+				std::filesystem::resize_file(file->partial_path, chunk_offset, ec);
+
+				ftp_request corrupt_response;
+				corrupt_response.header.operation = ftp_request_header::ftp_operation::CHUNK_CORRUPT;
+				corrupt_response.InsertTrivialToBuffer(file_id, chunk_offset);
+				client->Write(std::move(corrupt_response));
+			});
+	}
+
+	//Sent by the client after the last chunk of a file, with the digest of the bytes it has sent.
+	void OnUploadFinished(std::shared_ptr<ftp_connection> client, ftp_request& req)
 	{
-		
 		unsigned int file_id;
-		req.ExtractTrivialFromBuffer(file_id);
+		uint64_t file_digest;
+		ftp_request_reader(req).ReadTrivial(file_id, file_digest);
+
+		std::shared_ptr<File::FileRemote> upload_file;
+
+		{
+			std::lock_guard<std::mutex> files_lock(m_files_to_save_mutex);
+
+			const auto file_it = m_files_to_save.find(file_id);
+			if (file_it == m_files_to_save.end())
+				return;
+
+			upload_file = std::move(file_it->second);
+			m_files_to_save.erase(file_it);
+		}
+
+		//behind the bytes of the upload, on the writer of the file they went to
+		const auto writer_key = ftp_disk_writer::Key(upload_file->partial_path);
 
-		std::vector<char> retrieved_file_buffer;
-		req.ExtractToVector(retrieved_file_buffer);
+		const auto dedup_it = m_dedup_uploads.find(file_id);
+		const bool deduplicated = dedup_it != m_dedup_uploads.end();
 
-		m_files_to_save[file_id]->file_dest->write(retrieved_file_buffer.data(), retrieved_file_buffer.size());
-		m_files_to_save[file_id]->remaining_bytes -= retrieved_file_buffer.size();
-		std::cout << "File [" << file_id << "]: bytes remaining -> " << m_files_to_save[file_id]->remaining_bytes << "\n";
+		const auto delta_it = m_delta_uploads.find(file_id);
+		const bool delta = delta_it != m_delta_uploads.end();
 
-		if (m_files_to_save[file_id]->remaining_bytes <= 0)
+		//the literals of a delta are usually far fewer bytes than the file the upload was opened for
+		const auto expected_size = delta ? delta_it->second.file_delta.literal_size : upload_file->file_size;
+		const bool complete = upload_file->file_size - upload_file->remaining_bytes == expected_size
+			&& (!delta || delta_it->second.instructions_received);
+
+		//the file is only touched behind its bytes that are still queued for the disk writer
+		if (complete && upload_file->digest.Value() == file_digest)
 		{
-			std::cout << "File uploaded! \n";
+			if (delta)
+			{
+				m_disk_writer.Submit(writer_key,
+					[this, upload_file, upload = std::move(delta_it->second), client]() mutable -> void
+					{
+						upload_file->file_dest->close();
+						ApplyDeltaUpload(std::move(upload), client);
+					});
+
+				m_delta_uploads.erase(delta_it);
+				return;
+			}
+
+			if (deduplicated)
+			{
+				m_disk_writer.Submit(writer_key,
+					[this, upload_file, upload = std::move(dedup_it->second), client]() mutable -> void
+					{
+						upload_file->file_dest->close();
+						AssembleDedupUpload(std::move(upload), client);
+					});
+
+				m_dedup_uploads.erase(dedup_it);
+				return;
+			}
 
-			ftp_request upload_finished_response;
-			upload_finished_response.header.operation = ftp_request_header::ftp_operation::UPLOAD_FINISHED;
-			std::string server_response = "File: " + m_files_to_save[file_id]->file_name + " successfully uploaded!";
+			m_disk_writer.Submit(writer_key,
+				[this, upload_file, client]() -> void
+				{
+					FinishUpload(*upload_file, client);
+				});
+
+			return;
+		}
+
+		std::cout << "File [" << file_id << "]: digest mismatch \n";
+
+		if (deduplicated)
+			m_dedup_uploads.erase(dedup_it);
+
+		if (delta)
+			m_delta_uploads.erase(delta_it);
+
+		m_disk_writer.Submit(writer_key,
+			[upload_file, client]() -> void
+			{
+				upload_file->file_dest->close();
+
+				std::error_code ec;
+				std::filesystem::remove(upload_file->partial_path, ec);
+
+				ftp_request upload_failed_response;
+				upload_failed_response.header.operation = ftp_request_header::ftp_operation::UPLOAD_RESULT;
+				std::string server_response = "File: " + upload_file->file_name + " failed the integrity check and was discarded!";
+				upload_failed_response.InsertStringToBuffer(server_response);
+
+				client->Write(std::move(upload_failed_response));
+			});
+	}
+
+	void FinishUpload(File::FileRemote& file, const std::shared_ptr<ftp_connection>& client)
+	{
+		std::cout << "File uploaded! \n";
 
-			upload_finished_response.InsertStringToBuffer(server_response);
+		ftp_request upload_finished_response;
+		upload_finished_response.header.operation = ftp_request_header::ftp_operation::UPLOAD_RESULT;
+		std::string server_response = File::CompletePartialFile(file)
+			? "File: " + file.file_name + " successfully uploaded!"
+			: "File: " + file.file_name + " uploaded, but could not be moved in place!";
 
-			client->Write(upload_finished_response);
+		upload_finished_response.InsertStringToBuffer(server_response);
 
-			m_files_to_save.erase(file_id);
+		client->Write(std::move(upload_finished_response));
+	}
+
+	//The signatures read the whole old file, so they are computed on the disk writer rather than by the dispatcher or an io thread.
+	void SendDeltaSignatures(std::string file_path, uint32_t block_size, int client_file_id, unsigned int file_id, const std::string& staged_path,
+		std::shared_ptr<ftp_connection> client)
+	{
+		m_disk_writer.Submit(ftp_disk_writer::Key(staged_path),
+			[file_path = std::move(file_path), block_size, client_file_id, file_id, client = std::move(client)]() mutable -> void
+			{
+				//without a copy on the server there are no signatures, and the whole file is sent as literals
+				std::ifstream old_src(file_path, std::ios::binary);
+				const auto signatures = old_src ? ftp_delta::Signatures(old_src, block_size) : std::vector<ftp_delta::block_signature>();
+
+				ftp_request signatures_response;
+				signatures_response.header.operation = ftp_request_header::ftp_operation::UPLOAD_DELTA;
+
+				auto block_count = static_cast<uint32_t>(signatures.size());
+				signatures_response.InsertTrivialToBuffer(client_file_id, file_id, block_size, block_count);
+
+				for (auto signature : signatures)
+					signatures_response.InsertTrivialToBuffer(signature.weak, signature.strong);
+
+				client->Write(std::move(signatures_response));
+			});
+	}
+
+	//Sent by the client on the data connection ahead of the literals, with the digest of the new file.
+	void OnDeltaInstructions(ftp_request& req)
+	{
+		ftp_request_reader instructions_reader(req);
+
+		unsigned int file_id;
+		uint64_t file_digest;
+		uint32_t instruction_count;
+		instructions_reader.ReadTrivial(file_id, file_digest, instruction_count);
+
+		const auto delta_it = m_delta_uploads.find(file_id);
+		if (delta_it == m_delta_uploads.end())
+			return;
+
+		if (instruction_count > instructions_reader.Remaining() / (sizeof(uint32_t) + sizeof(uint64_t)))
+			throw std::out_of_range("more instructions announced than sent");
+
+		auto& file_delta = delta_it->second.file_delta;
+		file_delta.instructions.resize(instruction_count);
+		file_delta.literal_size = 0;
+		file_delta.file_digest = file_digest;
+
+		for (auto& instruction : file_delta.instructions)
+		{
+			instructions_reader.ReadTrivial(instruction.source_block, instruction.length);
+
+			if (instruction.source_block == ftp_delta::LITERAL)
+				file_delta.literal_size += instruction.length;
 		}
 
+		delta_it->second.instructions_received = true;
 	}
-	void OnDisconnectRequest(std::shared_ptr<ftp_connection> client)
+
+	//Reads the old file and writes the new one whole, so it runs on the disk writer, behind the upload's literals.
+	void ApplyDeltaUpload(delta_upload&& upload, std::shared_ptr<ftp_connection> client)
 	{
+		ftp_request upload_finished_response;
+		upload_finished_response.header.operation = ftp_request_header::ftp_operation::UPLOAD_RESULT;
 
-		std::cout << "[" << client->GetId() << "] Client disconnected\n";
+		std::string server_response = ApplyDelta(upload)
+			? "File: " + upload.file_name + " successfully updated! (delta, "
+				+ std::to_string(upload.file_delta.literal_size / 1024) + " of " + std::to_string(upload.file_size / 1024) + " KB sent)"
+			: "File: " + upload.file_name + " could not be updated from its delta!";
 
-		
+		upload_finished_response.InsertStringToBuffer(server_response);
+
+		client->Write(std::move(upload_finished_response));
+	}
+
+	//Writes the new version from blocks of the old one and the uploaded literals, and moves it in place of the old one.
+	static bool ApplyDelta(delta_upload& upload)
+	{
+		std::ifstream old_src(upload.file_path, std::ios::binary);
+		std::ifstream literal_src(upload.staged_path, std::ios::binary);
+
+		File::FileRemote updated_file(std::make_shared<std::ofstream>(upload.partial_path, std::ios::binary | std::ios::trunc),
+			upload.file_size, upload.file_name);
+		updated_file.file_path = upload.file_path;
+		updated_file.partial_path = upload.partial_path;
+
+		std::vector<unsigned char> copy_buffer(ftp_delta::MAX_BLOCK_SIZE);
+		ftp_file_digest updated_digest;
+		bool applied = true;
+
+		for (const auto& instruction : upload.file_delta.instructions)
+		{
+			const bool literal = instruction.source_block == ftp_delta::LITERAL;
+			auto& instruction_src = literal ? literal_src : old_src;
+
+			if (!literal)
+				old_src.seekg(static_cast<uint64_t>(instruction.source_block) * upload.block_size);
+
+			for (auto remaining = instruction.length; remaining > 0 && applied;)
+			{
+				const auto copy_size = static_cast<std::size_t>(std::min<uint64_t>(remaining, copy_buffer.size()));
+				instruction_src.read(reinterpret_cast<char*>(copy_buffer.data()), copy_size);
+
+				applied = static_cast<std::size_t>(instruction_src.gcount()) == copy_size;
+
+				updated_digest.Update(copy_buffer.data(), copy_size);
+				updated_file.file_dest->write(reinterpret_cast<const char*>(copy_buffer.data()), copy_size);
+				remaining -= copy_size;
+			}
+
+			if (!applied)
+				break;
+		}
+
+		old_src.close();
+		literal_src.close();
+
+		std::error_code ec;
+		std::filesystem::remove(upload.staged_path, ec);
+
+		//the old copy may have changed since the signatures were sent
+		if (!applied || !*updated_file.file_dest || updated_digest.Value() != upload.file_delta.file_digest)
+		{
+			updated_file.file_dest->close();
+			std::filesystem::remove(upload.partial_path, ec);
+			return false;
+		}
+
+		return File::CompletePartialFile(updated_file);
+	}
+
+	//Stores the uploaded chunks and writes the file from the store.
+	//That reads and writes the whole file, so it is submitted to the disk writer rather than run by the dispatcher or an io thread.
+	void AssembleDedupUpload(dedup_upload&& upload, std::shared_ptr<ftp_connection> client)
+	{
+		ftp_request upload_finished_response;
+		upload_finished_response.header.operation = ftp_request_header::ftp_operation::UPLOAD_RESULT;
+
+		std::string server_response = AssembleFromChunks(upload)
+			? "File: " + upload.file_name + " successfully uploaded! (deduplicated, "
+				+ std::to_string(upload.missing_chunks.size()) + " of " + std::to_string(upload.recipe.size()) + " chunks sent)"
+			: "File: " + upload.file_name + " could not be assembled from its chunks!";
+
+		upload_finished_response.InsertStringToBuffer(server_response);
+
+		client->Write(std::move(upload_finished_response));
+	}
+
+	bool AssembleFromChunks(dedup_upload& upload)
+	{
+		std::vector<unsigned char> chunk_buffer;
+		std::error_code ec;
+
+		if (!upload.missing_chunks.empty())
+		{
+			std::ifstream staged_src(upload.staged_path, std::ios::binary);
+			bool stored = true;
+
+			for (const auto chunk_index : upload.missing_chunks)
+			{
+				const auto& chunk = upload.recipe[chunk_index];
+
+				chunk_buffer.resize(chunk.length);
+				staged_src.read(reinterpret_cast<char*>(chunk_buffer.data()), chunk.length);
+
+				//the store checks the bytes against the hash the client announced for them
+				if (static_cast<std::size_t>(staged_src.gcount()) != chunk.length || !m_chunk_store.Put(chunk.hash, chunk_buffer.data(), chunk.length))
+				{
+					stored = false;
+					break;
+				}
+			}
+
+			staged_src.close();
+			std::filesystem::remove(upload.staged_path, ec);
+
+			if (!stored)
+				return false;
+		}
+
+		File::FileRemote assembled_file(std::make_shared<std::ofstream>(upload.partial_path, std::ios::binary | std::ios::trunc),
+			upload.file_size, upload.file_name);
+		assembled_file.file_path = upload.file_path;
+		assembled_file.partial_path = upload.partial_path;
+
+		for (const auto& chunk : upload.recipe)
+		{
+			if (!m_chunk_store.CopyTo(chunk.hash, chunk.length, *assembled_file.file_dest, chunk_buffer))
+			{
+				assembled_file.file_dest->close();
+				std::filesystem::remove(upload.partial_path, ec);
+				return false;
+			}
+		}
+
+		return File::CompletePartialFile(assembled_file);
+	}
+
+	//Called for the DISCONNECT frame and again once the connection has closed, the second call only cleans up what is left.
+	void OnDisconnectRequest(std::shared_ptr<ftp_connection> client)
+	{
+		bool was_established = false;
 
 		//removing client from established connections
-		m_established_connections.erase(
-			std::remove(
-				m_established_connections.begin(), 
-				m_established_connections.end(), client), 
-			m_established_connections.end()
-		);
+		m_connections_mutex.lock();
+
+		const auto connection_it = std::find(m_established_connections.begin(), m_established_connections.end(), client);
+
+		if (connection_it != m_established_connections.end())
+		{
+			m_established_connections.erase(connection_it);
+			was_established = true;
+		}
+
+		m_connections_mutex.unlock();
+
+		if (was_established)
+			PrintConnectionStats(*client);
+
+		if (const auto pump_it = m_file_pumps.find(client); pump_it != m_file_pumps.end())
+		{
+			pump_it->second->Stop();
+			m_file_pumps.erase(pump_it);
+		}
+
+		if (const auto stream_it = m_listing_streams.find(client); stream_it != m_listing_streams.end())
+		{
+			stream_it->second->Stop();
+			m_listing_streams.erase(stream_it);
+		}
 
 		client.reset();
 
 		//if client disconnected during upload, we remove all files that he was uploading.
+		//their partial copies stay on disk, so the client can resume the uploads later.
+		std::vector<std::shared_ptr<File::FileRemote>> dropped_uploads;
+
+		{
+			std::lock_guard<std::mutex> files_lock(m_files_to_save_mutex);
+			auto map_it = m_files_to_save.begin();
+
+			while(map_it != m_files_to_save.end())
+			{
+				if (!map_it->second->sender->IsSocketOpen())
+				{
+					dropped_uploads.push_back(std::move(map_it->second));
+					map_it = m_files_to_save.erase(map_it);
+				}
+
+				else
+					++map_it;
+			}
+		}
+
+		//the disk writers may wait for the files lock, so the copies are closed once it is released
+		for (auto& dropped_upload : dropped_uploads)
+			CloseUpload(std::move(dropped_upload));
 
-		auto map_it = m_files_to_save.begin();
+		//deduplicated uploads can't be resumed, chunks are only stored once all of them arrived
+		auto dedup_it = m_dedup_uploads.begin();
 
-		while(map_it != m_files_to_save.end())
+		while (dedup_it != m_dedup_uploads.end())
 		{
-			if (!map_it->second->sender->IsSocketOpen())
-				map_it = m_files_to_save.erase(map_it);
+			if (!dedup_it->second.client->IsSocketOpen())
+			{
+				RemoveStagedFile(dedup_it->second.staged_path);
+				dedup_it = m_dedup_uploads.erase(dedup_it);
+			}
 
 			else
-				++map_it;
+				++dedup_it;
 		}
 
-		
-		
+		auto delta_it = m_delta_uploads.begin();
+
+		while (delta_it != m_delta_uploads.end())
+		{
+			if (!delta_it->second.client->IsSocketOpen())
+			{
+				RemoveStagedFile(delta_it->second.staged_path);
+				delta_it = m_delta_uploads.erase(delta_it);
+			}
+
+			else
+				++delta_it;
+		}
 
 	}
-	static unsigned int HashRequest(uint32_t client_id)
+
+	void PrintConnectionStats(ftp_connection& client)
+	{
+		const auto write_stats = client.GetWriteStats();
+		std::cout << "[" << client.GetId() << "] Client disconnected ("
+			<< write_stats.frames_written << " frames in " << write_stats.write_calls << " writes, "
+			<< write_stats.FramesPerWrite() << " frames per write)\n";
+
+		const auto pool_stats = ftp_buffer_pool::Shared().GetStats();
+		std::cout << "[SERVER] Chunk buffers: " << pool_stats.hits << " reused, " << pool_stats.misses << " allocated, "
+			<< pool_stats.outstanding << " in use, " << pool_stats.pooled << " pooled\n";
+
+		const auto writer_stats = m_disk_writer.GetStats();
+		std::cout << "[SERVER] Disk writer: " << writer_stats.queue_depth << " queued, " << writer_stats.writes << " writes ("
+			<< writer_stats.bytes_written << " bytes), write latency " << writer_stats.average_write_latency.count() << " us average, "
+			<< writer_stats.max_write_latency.count() << " us max, queued for " << writer_stats.average_queue_delay.count() << " us on average\n";
+
+		ftp_listing_cache::cache_stats listing_stats;
+
+		{
+			std::lock_guard<std::mutex> cache_lock(m_listing_cache_mutex);
+			listing_stats = m_listing_cache.GetStats();
+		}
+
+		std::cout << "[SERVER] Listing cache: " << listing_stats.hits << " hits, " << listing_stats.misses << " misses, "
+			<< listing_stats.invalidations << " invalidated, " << listing_stats.evictions << " evicted, "
+			<< listing_stats.listings << " directories, " << listing_stats.memory << " bytes\n";
+
+		if (m_file_reader)
+		{
+			const auto reader_stats = m_file_reader->GetStats();
+			std::cout << "[SERVER] io_uring reads: " << reader_stats.reads << " (" << reader_stats.bytes_read << " bytes), up to "
+				<< reader_stats.max_reads_in_flight << " in flight\n";
+		}
+
+		{
+			std::lock_guard<std::mutex> limits_lock(m_rate_limits_mutex);
+			auto& client_limits = m_client_rate_limits[client.GetId()];
+
+			std::cout << "[" << client.GetId() << "] Rates:\n";
+			PrintRateStats("egress", *client_limits.egress);
+			PrintRateStats("ingress", *client_limits.ingress);
+		}
+	}
+
+	//Behind the staged bytes still queued for the disk writer. A staged file a new upload of the same file took over is kept.
+	void RemoveStagedFile(const std::string& staged_path)
+	{
+		m_disk_writer.Submit(ftp_disk_writer::Key(staged_path),
+			[this, staged_path]() -> void
+			{
+				{
+					std::lock_guard<std::mutex> files_lock(m_files_to_save_mutex);
+
+					for (const auto& [file_id, upload_file] : m_files_to_save)
+					{
+						if (upload_file->partial_path == staged_path)
+							return;
+					}
+				}
+
+				std::error_code ec;
+				std::filesystem::remove(staged_path, ec);
+			});
+	}
+
+	//user paths are relative to the server directory, ex. "/dir/subdir"
+	std::string ServerFilePath(const std::string& user_path, const std::string& file_name) const
+	{
+		return (std::filesystem::path(default_server_path + user_path) / file_name).string();
+	}
+
+	void ApplyRateLimits(ftp_connection& connection)
+	{
+		client_rate_limits client_limits;
+
+		{
+			std::lock_guard<std::mutex> limits_lock(m_rate_limits_mutex);
+			client_limits = m_client_rate_limits[connection.GetId()];
+		}
+
+		connection.AddEgressLimit(m_global_rate_limits.egress);
+		connection.AddEgressLimit(std::move(client_limits.egress));
+		connection.AddIngressLimit(m_global_rate_limits.ingress);
+		connection.AddIngressLimit(std::move(client_limits.ingress));
+	}
+
+	static void PrintRateStats(const char* direction, ftp_token_bucket& limit)
+	{
+		const auto stats = limit.GetStats();
+		std::cout << "  " << direction << ": " << stats.current_rate << " B/s (limit " << stats.rate_limit << " B/s), "
+			<< stats.tokens << " tokens, throttled for "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(stats.throttled_time).count() << " ms\n";
+	}
+
+	//A client can have several requests waiting for verification at once (ex. one per download segment),
+	//so every request gets its own hash. Multiplying by an odd constant keeps the hashes of one client distinct.
+	unsigned int HashRequest(uint32_t client_id)
 	{
-		 return client_id ^ 0xB16B00B5;
+		 return client_id ^ 0xB16B00B5 ^ (m_requests_hashed++ * 0x9E3779B1u);
 	}
 
 };
\ No newline at end of file
@@ -3,7 +3,8 @@
 #include<wx/filepicker.h>
 #include<wx/listctrl.h>
 #include"ftpclient.h"
-#include"RequestHandlerThread.h"
+#include"declared_events.h"
+#include"ServerFilesList.h"
 #include<filesystem>
 #include<map>
 #include<fstream>
@@ -26,7 +27,8 @@ private:
 	wxToolBar* m_toolbar;
 	wxDirPickerCtrl* m_save_dir_picker = nullptr;
 	wxFilePickerCtrl* m_send_file_picker = nullptr;
-	wxListCtrl* m_server_files_list = nullptr;
+	ServerFilesList* m_server_files_list = nullptr;
+	wxTextCtrl* m_files_filter = nullptr;
 
 	wxImageList* m_file_image_list = nullptr;
 	
@@ -34,26 +36,106 @@ private:
 	wxButton* m_upload_button = nullptr;
 	wxListCtrl* m_logs_list = nullptr;
 
-	RequestHandlerThread* m_request_thread = nullptr;
+	//responses handled per wxEVT_SERVER_RESPONSE, the rest are taken on the next one so the window stays responsive
+	static constexpr std::size_t RESPONSE_BATCH_SIZE = 256;
+	std::vector<ftp_request> m_response_batch;
+
 	std::thread m_upload_thread;
 	std::mutex m_upload_request_mutex;
 	std::condition_variable m_upload_request_cond;
 
+	//chunks and hashes the files of dedup and delta uploads, which reads them whole, while the upload thread keeps sending
+	std::thread m_hashing_thread;
+	std::mutex m_hashing_mutex;
+	std::condition_variable m_hashing_cond;
+
 	std::deque <std::shared_ptr<File::FileLocal>> m_files_to_transfer_accepted;
 	std::deque <std::shared_ptr<File::FileLocal>> m_files_to_transfer_queued;
-	std::deque <std::shared_ptr<File::FileLocal>> m_files_to_transfer_unaccepted;
+	//waiting for UPLOAD_ACCEPT, by the id sent with the request, only touched by the GUI thread
+	std::map <int, std::shared_ptr<File::FileLocal>> m_files_to_transfer_unaccepted;
 	std::mutex m_file_upload_mutex;
 
 	std::string user_server_directory = "";
 	std::string user_server_directory_pending = "";
 
-	std::vector<std::shared_ptr<File::FileDetails>> m_file_details;
+	//LIST_DIRECTORY page size, the first page is displayed while the server still reads the directory
+	static constexpr uint32_t LISTING_PAGE_SIZE = 1000;
+
+	//only the newest listing requested is displayed, pages echoing an older id are skipped
+	uint32_t m_listing_id = 0;
+	std::string m_listing_path;
+	bool m_listing_page_received = false;
+
 	std::map<File::file_type, int> m_file_icons;
 
 	std::map<unsigned int, std::shared_ptr<File::FileRemote>> m_requested_files;
 	int m_req_files_counter = 0;
 
-	const unsigned long long MAX_BANDWIDTH = 100000000; //100MB per packet
+	//Large files are downloaded as DOWNLOAD_SEGMENTS ranges in parallel, each over its own data connection.
+	//Every segment has its own id in m_requested_files, all of them pointing to the same file.
+	struct download_segment
+	{
+		uint64_t start_offset = 0;
+		uint64_t length = 0;
+		//where the next chunk of the segment goes in the preallocated file, once the previous ones are written
+		uint64_t write_offset = 0;
+		std::size_t data_stream = 0;
+	};
+
+	std::map<unsigned int, download_segment> m_requested_segments;
+
+	//a corrupt chunk is requested again, together with the rest of its range, at most this many times per file
+	const unsigned int MAX_CHUNK_RETRIES = 3;
+	std::map<std::shared_ptr<File::FileRemote>, unsigned int> m_chunk_retries;
+
+	//uploads the server stopped because of a corrupt chunk, dropped by the upload thread
+	std::vector<int> m_cancelled_uploads;
+
+	//Large files are chunked by the hashing thread and only the chunks the server is missing are sent, see UPLOAD_DEDUP.
+	struct dedup_upload
+	{
+		std::shared_ptr<File::FileLocal> file;
+		std::string file_path;
+		//the file details, the chunk list is appended once the file is chunked
+		ftp_request request;
+		std::vector<ftp_cdc::chunk> recipe;
+	};
+
+	//guarded by m_hashing_mutex
+	std::deque<dedup_upload> m_dedup_uploads_to_chunk;
+	//waiting for the missing chunks, by the id sent with the request, guarded by m_file_upload_mutex
+	std::map<int, dedup_upload> m_dedup_uploads_unaccepted;
+	//ids of plain and dedup upload requests, echoed by the server
+	int m_uploads_counter = 0;
+
+	//A new version of a file the server already has is sent as a delta against the server's copy, see UPLOAD_DELTA.
+	struct delta_upload
+	{
+		std::shared_ptr<File::FileLocal> file;
+		std::string file_path;
+		uint32_t block_size = 0;
+		std::vector<ftp_delta::block_signature> signatures;
+	};
+
+	//waiting for the signatures, by the id sent with the request
+	std::map<int, delta_upload> m_delta_uploads_unsigned;
+	int m_delta_uploads_counter = 0;
+	//guarded by m_hashing_mutex
+	std::deque<delta_upload> m_delta_uploads_to_compute;
+
+	const std::size_t DOWNLOAD_SEGMENTS = 4;
+	const unsigned long long MIN_SEGMENTED_DOWNLOAD_SIZE = 64ull * 1024 * 1024; //64MB
+
+	//set by the data connection once its send queue has drained, see SendFileBytes
+	bool m_data_stream_writable = true;
+
+	const unsigned long long UPLOAD_CHUNK_SIZE = 1024 * 1024; //1MB per packet
+	const unsigned long long UPLOAD_RATE_LIMIT = 0; //bytes per second, 0 for unlimited
+	const bool COMPRESS_TRANSFERS = true; //chunks that compress well are sent compressed, see ftp_chunk_codec
+	const bool DEDUP_UPLOADS = true; //chunks the server already has are not sent again, see ftp_cdc
+	const unsigned long long MIN_DEDUP_UPLOAD_SIZE = 4 * 1024 * 1024; //4MB
+	const bool DELTA_UPLOADS = true; //files already on the server are updated with the changed blocks only, see ftp_delta
+	const unsigned long long MIN_DELTA_UPLOAD_SIZE = 1024 * 1024; //1MB
 
 
 	//GUI items setters
@@ -66,23 +148,37 @@ private:
 	void OnSaveButtonClick(wxCommandEvent& evt);
 	void OnUploadButtonClick(wxCommandEvent& evt);
 	void OnFileActivate(wxListEvent& evt);
+	void OnFilesColumnClick(wxListEvent& evt);
+	void OnFilesFilterText(wxCommandEvent& evt);
 	void OnKeyDown(wxKeyEvent& evt);
-	void OnServerResponse(wxThreadEvent& evt);
+	void OnServerResponses(wxThreadEvent& evt);
+	void OnServerResponse(const ftp_request& response);
 	void OnClose(wxCloseEvent& evt);
 
 
 	//Display handlers
 	void DisplayLog(const std::string&& log_text, const wxColour&& log_colour) const;
-	void DisplayFiles() const;
 	void ResetFilesList();
 	
 	//Requests handlers
-	void ChangeDirectory(std::string& path);
+	void ChangeDirectory(std::string& path, File::listing_order order = File::listing_order::DIRECTORY, std::string name_prefix = "");
 	void SaveSelectedFiles();
 	void RemoveSelectedFiles();
 	void UploadFile();
 	void SendFileBytes();
+	//upload thread only
+	void FailPendingUploads();
+	void HashUploads();
+	//hashing thread only
+	void ChunkDedupUpload(dedup_upload&& upload);
+	void ComputeDeltaUpload(delta_upload&& upload);
+	void RequestSegmentedDownload(const File::FileDetails& file_details, const std::string& user_file_path);
+	void FinishDownload(unsigned int file_id);
+	void FailDownload(unsigned int file_id, const std::string& reason);
+	void RetryDownloadFrom(unsigned int file_id, uint64_t chunk_offset);
+	void CompleteDownloadRange(unsigned int file_id, uint64_t file_digest, uint64_t received_digest);
+	void ForgetDownload(const std::shared_ptr<File::FileRemote>& file);
 
 	//Thread action
-	void SendRequest(ftp_request& new_request, ftp_connection::conn_type conn_type);
+	void SendRequest(ftp_request&& new_request, ftp_connection::conn_type conn_type);
 };
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+#include<wx/wx.h>
+#include<wx/listctrl.h>
+#include"ftp_request.h"
+#include<map>
+#include<string>
+#include<string_view>
+#include<vector>
+
+//Server files list in virtual mode: the control keeps no rows, it asks for the text and icon of the rows it draws,
+//so displaying, sorting or filtering a directory of any size costs the visible rows.
+//Files are stored column by column in the order they were listed, with all names packed into one string.
+//m_sorted holds the displayed files in the current order and m_rows those of them that match the filter.
+class ServerFilesList : public wxListCtrl
+{
+public:
+	enum class sort_column
+	{
+		//listing order
+		NONE,
+		NAME,
+		SIZE
+	};
+
+	ServerFilesList(wxWindow* parent, const std::map<File::file_type, int>& file_icons);
+
+	//Removes every file and the filter. The entry going back to the previous directory is first whatever the order and filter.
+	void Reset(bool with_parent_entry);
+
+	//Files are shown once DisplayAddedFiles is called.
+	void AddFile(const std::string& file_name, uint64_t file_size, File::file_type type, int64_t file_time);
+	void DisplayAddedFiles();
+
+	//Sorting by the same column again reverses the order.
+	void SortBy(sort_column column);
+
+	//Shows the files whose names contain filter, ignoring case. A filter extending the previous one only searches the rows shown.
+	void SetFilter(const std::string& filter);
+
+	File::FileDetails FileAt(long row) const;
+	bool IsParentEntry(long row) const;
+	bool Contains(const std::string& file_name, File::file_type type) const;
+
+protected:
+	wxString OnGetItemText(long row, long column) const override;
+	int OnGetItemImage(long row) const override;
+
+private:
+	const std::map<File::file_type, int>& m_file_icons;
+
+	std::string m_names;
+	//name of file i ends at m_name_ends[i] and starts where the one of file i - 1 ends
+	std::vector<std::size_t> m_name_ends;
+	std::vector<uint64_t> m_sizes;
+	std::vector<int64_t> m_times;
+	std::vector<File::file_type> m_types;
+	bool m_parent_entry = false;
+
+	std::vector<uint32_t> m_sorted;
+	std::vector<uint32_t> m_rows;
+
+	sort_column m_sort_column = sort_column::NONE;
+	bool m_sort_descending = false;
+
+	//lower case
+	std::string m_filter;
+
+	std::string_view Name(uint32_t file) const;
+	bool Before(uint32_t left, uint32_t right) const;
+	bool Matches(uint32_t file) const;
+
+	void FilterRows();
+	//rows moved, the selected ones would now point to other files
+	void ShowReorderedRows();
+};
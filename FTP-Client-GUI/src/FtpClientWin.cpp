@@ -7,11 +7,19 @@ wxEND_EVENT_TABLE()
 FtpClientWin::FtpClientWin() : wxFrame(nullptr, wxID_ANY, "FTP Client", wxPoint(30, 30), wxSize(1280, 768))
 {
 	//Connect server response thread event
-	Connect(evt_id::SERVER_RESPONSE_ID, wxEVT_SERVER_RESPONSE, wxThreadEventHandler(FtpClientWin::OnServerResponse));
+	Connect(evt_id::SERVER_RESPONSE_ID, wxEVT_SERVER_RESPONSE, wxThreadEventHandler(FtpClientWin::OnServerResponses));
+
+	//the client's io threads only post an event when responses arrive, they are taken on the GUI thread
+	client.NotifyOnResponses([this]() -> void
+		{
+			wxQueueEvent(this, new wxThreadEvent(wxEVT_SERVER_RESPONSE, evt_id::SERVER_RESPONSE_ID));
+		});
 
 	//Establish connection with the server
+	client.SetCompression(COMPRESS_TRANSFERS);
 	client.EstablishControlConnection("127.0.0.1", 60000);
-	client.EstablishDataConnection("127.0.0.1", 60000);
+	client.EstablishDataConnection("127.0.0.1", 60000, DOWNLOAD_SEGMENTS);
+	client.SetUploadRateLimit(UPLOAD_RATE_LIMIT);
 
 	//client.EstablishControlConnection("192.168.56.101", 60000);
 	//client.EstablishDataConnection("192.168.56.101", 60000);
@@ -32,17 +40,19 @@ FtpClientWin::FtpClientWin() : wxFrame(nullptr, wxID_ANY, "FTP Client", wxPoint(
 
 	m_panel->Bind(wxEVT_CHAR_HOOK, &FtpClientWin::OnKeyDown, this);
 
-	m_request_thread = new RequestHandlerThread(dynamic_cast<wxFrame*>(this), client, running);
-	m_request_thread->Create();
-	m_request_thread->Run();
-
-
 	m_upload_thread = std::thread(
 		[this]() -> void
 		{
 			SendFileBytes();
 		}
 	);
+
+	m_hashing_thread = std::thread(
+		[this]() -> void
+		{
+			HashUploads();
+		}
+	);
 	 
 
 	FtpClientWin::ChangeDirectory(user_server_directory);
@@ -102,7 +112,15 @@ void FtpClientWin::SetupFilesList()
 
 	panel_sizer->Add(server_files_label, 0, wxLEFT, 10);
 
-	m_server_files_list = new wxListCtrl(m_panel, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxLC_REPORT);
+	//typing narrows the list down to the files whose names contain the text
+	m_files_filter = new wxTextCtrl(m_panel, wxID_ANY);
+	m_files_filter->SetHint("Filter files");
+	m_files_filter->Bind(wxEVT_TEXT, &FtpClientWin::OnFilesFilterText, this);
+
+	panel_sizer->Add(m_files_filter, 0, wxLEFT, 10);
+
+	m_server_files_list = new ServerFilesList(m_panel, m_file_icons);
+	m_server_files_list->Bind(wxEVT_LIST_COL_CLICK, &FtpClientWin::OnFilesColumnClick, this);
 
 
 	const std::vector<std::string> file_desc_columns =
@@ -172,9 +190,10 @@ void FtpClientWin::OnUploadButtonClick(wxCommandEvent& evt)
 void FtpClientWin::OnFileActivate(wxListEvent& evt)
 {
 
-	auto file_name = evt.GetItem().GetText().ToStdString();
+	const auto file_details = m_server_files_list->FileAt(evt.GetIndex());
+	auto file_name = file_details.file_name;
 
-	if (m_file_details[evt.GetItem()]->type == File::file_type::DIR)
+	if (file_details.type == File::file_type::DIR)
 	{
 
 		//if user_server_directory_pending isn't empty, client is still waiting for the response from the server
@@ -184,7 +203,7 @@ void FtpClientWin::OnFileActivate(wxListEvent& evt)
 
 			//if user is not in the home directory, the first option is to go back to previous directory.
 			//change to path for previous directory
-			if (!user_server_directory.empty() && evt.GetItem() == 0)
+			if (m_server_files_list->IsParentEntry(evt.GetIndex()))
 			{
 				
 				user_server_directory_pending = user_server_directory; 
@@ -214,6 +233,16 @@ void FtpClientWin::OnFileActivate(wxListEvent& evt)
 
 }
 
+void FtpClientWin::OnFilesColumnClick(wxListEvent& evt)
+{
+	m_server_files_list->SortBy(evt.GetColumn() == 0 ? ServerFilesList::sort_column::NAME : ServerFilesList::sort_column::SIZE);
+}
+
+void FtpClientWin::OnFilesFilterText(wxCommandEvent& evt)
+{
+	m_server_files_list->SetFilter(evt.GetString().ToStdString());
+}
+
 void FtpClientWin::OnKeyDown(wxKeyEvent& evt)
 {
 
@@ -224,23 +253,29 @@ void FtpClientWin::OnKeyDown(wxKeyEvent& evt)
 }
 
 
-void FtpClientWin::OnServerResponse(wxThreadEvent& evt)
+void FtpClientWin::OnServerResponses(wxThreadEvent& evt)
 {
-	
-	auto response = evt.GetPayload<ftp_request>();
+	client.TakeResponses(m_response_batch, RESPONSE_BATCH_SIZE);
+
+	for (const auto& response : m_response_batch)
+		FtpClientWin::OnServerResponse(response);
+
+	m_response_batch.clear();
+}
+
+void FtpClientWin::OnServerResponse(const ftp_request& response)
+{
+	ftp_request_reader response_reader(response);
 
 	switch(response.header.operation)
 	{
 	case ftp_request_header::ftp_operation::SERVER_OK:
 		{
 		unsigned long request_hash;
-		response.ExtractTrivialFromBuffer(request_hash);
+		response_reader.ReadTrivial(request_hash);
 
-		ftp_request data_collect_request;
-		data_collect_request.header.operation = ftp_request_header::ftp_operation::DATA_STREAM_VERIFIED;
-		data_collect_request.InsertTrivialToBuffer(request_hash);
-		
-		FtpClientWin::SendRequest(data_collect_request, ftp_connection::conn_type::data);
+		//verified on the data connection the request was meant for
+		client.VerifyDataStream(request_hash);
 
 		break;
 		}
@@ -248,16 +283,35 @@ void FtpClientWin::OnServerResponse(wxThreadEvent& evt)
 	case ftp_request_header::ftp_operation::UPLOAD_ACCEPT:
 		{
 			//server sends unique ID where the client should send data
-			//recent unresolved file to upload becomes resolved -> is pushed into pending queue
-
-		auto recent_unresolved = m_files_to_transfer_unaccepted.front();
-		m_files_to_transfer_unaccepted.pop_front();
+			//the file the echoed id was sent for becomes resolved -> is pushed into pending queue
 
+		int client_file_id;
 		int server_file_id;
-		response.ExtractTrivialFromBuffer(server_file_id);
+		uint64_t start_offset;
+		response_reader.ReadTrivial(client_file_id, server_file_id, start_offset);
+
+		const auto unresolved_it = m_files_to_transfer_unaccepted.find(client_file_id);
+		if (unresolved_it == m_files_to_transfer_unaccepted.end())
+			break;
+
+		auto recent_unresolved = std::move(unresolved_it->second);
+		m_files_to_transfer_unaccepted.erase(unresolved_it);
 		recent_unresolved->client_file_id = server_file_id;
 		FtpClientWin::DisplayLog("[INFO]: UPLOAD_ACCEPT.", wxColour(0, 204, 0));
 
+		//the server already has the whole file and finishes the upload on its own
+		if (start_offset >= recent_unresolved->remaining_bytes)
+			break;
+
+		//the server already has the first start_offset bytes from an interrupted upload
+		if (start_offset > 0)
+		{
+			recent_unresolved->file_src->seekg(start_offset);
+			recent_unresolved->remaining_bytes -= start_offset;
+
+			FtpClientWin::DisplayLog("[INFO]: Resuming upload from byte " + std::to_string(start_offset), wxColour(0, 204, 0));
+		}
+
 		m_file_upload_mutex.lock();
 
 		m_files_to_transfer_queued.push_back(std::move(recent_unresolved));
@@ -273,80 +327,256 @@ void FtpClientWin::OnServerResponse(wxThreadEvent& evt)
 
 	
 
-	case ftp_request_header::ftp_operation::CHANGE_DIRECTORY:
+	case ftp_request_header::ftp_operation::UPLOAD_DEDUP:
+		{
+		int client_file_id;
+		int server_file_id;
+		uint32_t missing_count;
+		response_reader.ReadTrivial(client_file_id, server_file_id, missing_count);
+
+		m_file_upload_mutex.lock();
+
+		const auto upload_it = m_dedup_uploads_unaccepted.find(client_file_id);
+
+		if (upload_it == m_dedup_uploads_unaccepted.end())
+		{
+			m_file_upload_mutex.unlock();
+			break;
+		}
+
+		auto accepted_upload = std::move(upload_it->second);
+		m_dedup_uploads_unaccepted.erase(upload_it);
+
+		m_file_upload_mutex.unlock();
+
+		auto& upload_file = accepted_upload.file;
+		upload_file->client_file_id = server_file_id;
+		upload_file->remaining_bytes = 0;
+
+		//missing chunks come in file order, neighbouring ones are sent as one range
+		for (uint32_t i = 0; i < missing_count; ++i)
+		{
+			uint32_t chunk_index;
+			response_reader.ReadTrivial(chunk_index);
+
+			const auto& chunk = accepted_upload.recipe.at(chunk_index);
+			auto& send_ranges = upload_file->send_ranges;
+
+			if (!send_ranges.empty() && send_ranges.back().first + send_ranges.back().second == chunk.offset)
+				send_ranges.back().second += chunk.length;
+			else
+				send_ranges.emplace_back(chunk.offset, chunk.length);
+
+			upload_file->remaining_bytes += chunk.length;
+		}
+
+		FtpClientWin::DisplayLog("[INFO]: UPLOAD_DEDUP, sending " + std::to_string(missing_count) + " of "
+			+ std::to_string(accepted_upload.recipe.size()) + " chunks (" + std::to_string(upload_file->remaining_bytes / 1024) + " KB).", wxColour(0, 204, 0));
+
+		//the server already has every chunk and assembles the file on its own
+		if (upload_file->remaining_bytes <= 0)
+			break;
+
+		m_file_upload_mutex.lock();
+
+		m_files_to_transfer_queued.push_back(std::move(upload_file));
+
+		m_file_upload_mutex.unlock();
+
+		m_upload_request_cond.notify_all();
+		break;
+		}
+
+	case ftp_request_header::ftp_operation::UPLOAD_DELTA:
+		{
+		int client_file_id;
+		int server_file_id;
+		uint32_t block_size;
+		uint32_t block_count;
+		response_reader.ReadTrivial(client_file_id, server_file_id, block_size, block_count);
+
+		const auto upload_it = m_delta_uploads_unsigned.find(client_file_id);
+		if (upload_it == m_delta_uploads_unsigned.end())
+			break;
+
+		auto signed_upload = std::move(upload_it->second);
+		m_delta_uploads_unsigned.erase(upload_it);
+
+		signed_upload.file->client_file_id = server_file_id;
+		signed_upload.block_size = block_size;
+		signed_upload.signatures.resize(block_count);
+
+		for (auto& signature : signed_upload.signatures)
+			response_reader.ReadTrivial(signature.weak, signature.strong);
+
+		FtpClientWin::DisplayLog("[INFO]: UPLOAD_DELTA, " + std::to_string(block_count) + " block signatures received.", wxColour(0, 204, 0));
+
 		{
+			std::lock_guard<std::mutex> hashing_lock(m_hashing_mutex);
+			m_delta_uploads_to_compute.push_back(std::move(signed_upload));
+		}
 
+		m_hashing_cond.notify_all();
+		break;
+		}
 
-			//pending directory becomes valid directory
-		user_server_directory = user_server_directory_pending;
-		user_server_directory_pending = "";
-		FtpClientWin::ResetFilesList();
+	case ftp_request_header::ftp_operation::LIST_DIRECTORY:
+		{
+		uint32_t listing_id;
+		uint8_t last_page;
+		response_reader.ReadTrivial(listing_id, last_page);
 
-		while(response.header.request_size > 0)
+		//a listing requested again before it finished, or one that was never answered in full
+		if (listing_id != m_listing_id)
+			break;
+
+		//first page, the listed directory becomes valid directory
+		if (!m_listing_page_received)
+		{
+			user_server_directory = m_listing_path;
+			user_server_directory_pending = "";
+			FtpClientWin::ResetFilesList();
+			m_listing_page_received = true;
+		}
+
+		while(!response_reader.Empty())
 		{
 
 			std::string file_name;
 			std::size_t file_size;
 			File::file_type file_type;
-			File::ExtractFileDetails(response,file_name, file_size, file_type);
+			int64_t file_time;
+			File::ExtractFileDetails(response_reader, file_name, file_size, file_type, file_time);
+
+			m_server_files_list->AddFile(file_name, file_size, file_type, file_time);
+
+		}
+
+		m_server_files_list->DisplayAddedFiles();
+
+		if (last_page)
+			m_listing_page_received = false;
+
+		break;
+		}
+
+	case ftp_request_header::ftp_operation::DOWNLOAD_START:
+		{
+		unsigned int file_id;
+		uint64_t start_offset;
+		uint64_t file_size;
+		uint64_t range_length;
+		response_reader.ReadTrivial(file_id, start_offset, file_size, range_length);
+
+		const auto requested_it = m_requested_files.find(file_id);
+
+		if (requested_it == m_requested_files.end())
+			break;
 
-			m_file_details.push_back(
-				std::make_shared<File::FileDetails>(file_name, file_size, file_type)
-			);
+		auto& requested_file = *requested_it->second;
 
+		//segments are written into the preallocated file as they are, the server has to agree on the range
+		if (const auto segment_it = m_requested_segments.find(file_id); segment_it != m_requested_segments.end())
+		{
+			if (start_offset != segment_it->second.start_offset || range_length != segment_it->second.length)
+				FtpClientWin::FailDownload(file_id, "file has changed on the server, refresh and try again");
+
+			break;
 		}
 
-		FtpClientWin::DisplayFiles();
+		//the server continues from the end of our partial copy, or starts over if the file changed meanwhile;
+		//the download sink has already opened the partial copy accordingly
+		requested_file.remaining_bytes = range_length;
 
+		if (start_offset > 0)
+			FtpClientWin::DisplayLog("Resuming download of: " + requested_file.file_name + " from byte " + std::to_string(start_offset),
+				wxColour(255, 128, 0));
 
+		//the download is finished on DOWNLOAD_FINISHED, which follows even when nothing is left to send
 		break;
 		}
 
+	//the chunk's bytes were written by the download sink, only its size arrives here, see ftp_download_sink
 	case ftp_request_header::ftp_operation::DOWNLOAD_FILE:
 		{
-		
-		auto user_file_path = m_save_dir_picker->GetPath().ToStdString();
-		while (response.header.request_size > 0)
+		unsigned int file_id;
+		uint64_t chunk_size;
+		uint8_t chunk_intact;
+		response_reader.ReadTrivial(file_id, chunk_size, chunk_intact);
+
+		//chunks of a failed or retried download may still be on their way
+		if (m_requested_files.find(file_id) == m_requested_files.end())
+			break;
+
+		const auto segment_it = m_requested_segments.find(file_id);
+		const auto& requested_file = *m_requested_files[file_id];
+
+		if (!chunk_intact)
 		{
-			
-			//std::string file_name;
-			unsigned int file_id;
-			response.ExtractTrivialFromBuffer(file_id);
+			//nothing of the chunk is written, the range is requested again from its first byte
+			FtpClientWin::RetryDownloadFrom(file_id, segment_it != m_requested_segments.end()
+				? segment_it->second.write_offset
+				: requested_file.file_size - requested_file.remaining_bytes);
 
-			std::vector<char> retrieved_file_buffer;
-			response.ExtractToVector(retrieved_file_buffer);
+			break;
+		}
 
-			m_requested_files[file_id]->file_dest->write(retrieved_file_buffer.data(), retrieved_file_buffer.size());
-			m_requested_files[file_id]->remaining_bytes -= retrieved_file_buffer.size();
+		if (segment_it != m_requested_segments.end())
+			segment_it->second.write_offset += chunk_size;
 
-			FtpClientWin::DisplayLog(
-				"Downloading file: " + m_requested_files[file_id]->file_name, 
-				wxColour(255, 128, 0)
-			);
+		m_requested_files[file_id]->remaining_bytes -= chunk_size;
 
-			FtpClientWin::DisplayLog("Bytes remaining: " + std::to_string(m_requested_files[file_id]->remaining_bytes),
-				wxColour(153, 255, 255)
-			);
+		FtpClientWin::DisplayLog(
+			"Downloading file: " + m_requested_files[file_id]->file_name, 
+			wxColour(255, 128, 0)
+		);
 
-			if(m_requested_files[file_id]->remaining_bytes <= 0)
-			{
-				FtpClientWin::DisplayLog(
-					"[INFO]: File: " + m_requested_files[file_id]->file_name + " successfully saved!", 
-					wxColour(0, 204, 0));
+		FtpClientWin::DisplayLog("Bytes remaining: " + std::to_string(m_requested_files[file_id]->remaining_bytes),
+			wxColour(153, 255, 255)
+		);
+		break;
+		}
 
-				m_requested_files.erase(file_id);
-			}
-			
+	case ftp_request_header::ftp_operation::DOWNLOAD_FINISHED:
+		{
+		unsigned int file_id;
+		uint64_t file_digest;
+		uint64_t received_digest;
+		response_reader.ReadTrivial(file_id, file_digest, received_digest);
+
+		if (m_requested_files.find(file_id) != m_requested_files.end())
+			FtpClientWin::CompleteDownloadRange(file_id, file_digest, received_digest);
 
+		break;
 		}
+
+	case ftp_request_header::ftp_operation::CHUNK_CORRUPT:
+		{
+		int server_file_id;
+		uint64_t chunk_offset;
+		response_reader.ReadTrivial(server_file_id, chunk_offset);
+
+		{
+			std::lock_guard<std::mutex> upload_lock(m_file_upload_mutex);
+			m_cancelled_uploads.push_back(server_file_id);
+		}
+
+		FtpClientWin::DisplayLog("[SERVER]: Upload stopped, the chunk at byte " + std::to_string(chunk_offset)
+			+ " arrived corrupted. Upload the file again to resume from there.", wxColour(255, 0, 0));
 		break;
 		}
 
-	case ftp_request_header::ftp_operation::UPLOAD_FINISHED:
+	case ftp_request_header::ftp_operation::UPLOAD_RESULT:
 	{
 		std::string server_response;
-		response.ExtractStringFromBuffer(server_response);
+		response_reader.ReadString(server_response);
 		FtpClientWin::DisplayLog("[SERVER]: " + server_response, wxColour(0, 204, 0));
+
+		const auto upload_stats = client.GetUploadRateStats();
+		FtpClientWin::DisplayLog("Upload rate: " + std::to_string(upload_stats.current_rate / 1024) + " KB/s, throttled for "
+			+ std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(upload_stats.throttled_time).count()) + " ms",
+			wxColour(128, 128, 128));
+
 		FtpClientWin::ChangeDirectory(user_server_directory);
 		break;
 
@@ -354,7 +584,7 @@ void FtpClientWin::OnServerResponse(wxThreadEvent& evt)
 	case ftp_request_header::ftp_operation::UPLOAD_FILE:
 		{
 		std::string server_response;
-		response.ExtractStringFromBuffer(server_response);
+		response_reader.ReadString(server_response);
 		FtpClientWin::DisplayLog("[SERVER]: " + server_response, wxColour(0, 204, 0));
 		FtpClientWin::ChangeDirectory(user_server_directory);
 		break;
@@ -363,11 +593,14 @@ void FtpClientWin::OnServerResponse(wxThreadEvent& evt)
 	case ftp_request_header::ftp_operation::DELETE_FILE:
 		{
 		std::string server_response;
-		response.ExtractStringFromBuffer(server_response);
+		response_reader.ReadString(server_response);
 		FtpClientWin::DisplayLog("[SERVER]: " + server_response, wxColour(0, 204, 0));
 		FtpClientWin::ChangeDirectory(user_server_directory);
 		break;
 		}
+	//requests the server never answers
+	default:
+		break;
 	}
 }
 
@@ -382,55 +615,31 @@ void FtpClientWin::DisplayLog(const std::string&& log_text, const wxColour&& log
 	m_logs_list->SetItemBackgroundColour(m_logs_list->GetItemCount() - 1, log_colour);
 }
 
-void FtpClientWin::DisplayFiles() const
-{
-	using namespace File;
-
-	for(auto& file_detail : m_file_details)
-	{
-		auto& [file_name, file_size, type] = *file_detail;
-
-		wxListItem new_file;
-		new_file.SetId(m_server_files_list->GetItemCount());
-		new_file.SetText(file_name);
-
-		m_server_files_list->InsertItem(new_file, file_name, m_file_icons.at(type));
-		m_server_files_list->SetItem(new_file, 1,  std::to_string(file_size));
-		
-	}
-
-
-}
-
 void FtpClientWin::ResetFilesList()
 {
-	if (m_server_files_list->GetItemCount() > 0)
-	{
-		m_file_details.erase(m_file_details.cbegin(), m_file_details.cend());
-		m_server_files_list->DeleteAllItems();
-	}
-
-
-	if (!user_server_directory.empty())
-	{
-		std::string prev_dir_str = "<----";
-
-		m_file_details.push_back(
-			std::make_shared<File::FileDetails>(prev_dir_str, 0, File::file_type::DIR)
-		);
-
-	}
+	//outside the home directory the first entry goes back to the previous directory
+	m_files_filter->ChangeValue("");
+	m_server_files_list->Reset(!user_server_directory.empty());
 }
-void FtpClientWin::ChangeDirectory(std::string& path)
+void FtpClientWin::ChangeDirectory(std::string& path, File::listing_order order, std::string name_prefix)
 {
 	ftp_request temp_request;
-	temp_request.header.operation = ftp_request_header::ftp_operation::CHANGE_DIRECTORY;
+	temp_request.header.operation = ftp_request_header::ftp_operation::LIST_DIRECTORY;
+
+	uint32_t page_size = LISTING_PAGE_SIZE;
+
+	//pages of the listing displayed so far are skipped from now on
+	m_listing_id++;
+	m_listing_path = path;
+	m_listing_page_received = false;
 
 	temp_request.InsertStringToBuffer(path);
+	temp_request.InsertTrivialToBuffer(page_size, order, m_listing_id);
+	temp_request.InsertStringToBuffer(name_prefix);
 
 	//running the side-thread to handle ftp_request sending and receiving
 
-	FtpClientWin::SendRequest(temp_request, ftp_connection::conn_type::control);
+	FtpClientWin::SendRequest(std::move(temp_request), ftp_connection::conn_type::control);
 }
 
 void FtpClientWin::SaveSelectedFiles()
@@ -453,28 +662,49 @@ void FtpClientWin::SaveSelectedFiles()
 		//foreach selected items we insert them into ftp_request...
 		auto next_item = -1;
 		auto user_file_path = m_save_dir_picker->GetPath().ToStdString();
+		bool whole_files_requested = false;
 
 		while ((next_item = m_server_files_list->GetNextItem(next_item, wxLIST_NEXT_ALL, wxLIST_STATE_SELECTED)) != -1)
 		{
 
-			auto file_name = m_file_details[next_item]->file_name;
+			const auto file_details = m_server_files_list->FileAt(next_item);
+
+			//large files are requested on their own, see RequestSegmentedDownload
+			if (file_details.file_size >= MIN_SEGMENTED_DOWNLOAD_SIZE && client.DataStreamCount() > 1)
+			{
+				FtpClientWin::RequestSegmentedDownload(file_details, user_file_path);
+				continue;
+			}
+
+			auto file_name = file_details.file_name;
+			uint64_t file_size = file_details.file_size;
+			int64_t file_time = file_details.file_time;
+			//the whole file is sent
+			uint64_t range_length = 0;
 
-			std::shared_ptr<std::ofstream> file_dest =
-				std::make_shared<std::ofstream>(user_file_path + "\\" + file_name, std::ios::binary);
+			//creating copy of the remote file on client's machine,
+			//it is opened once the server tells where the download starts
+			auto requested_file = std::make_shared<File::FileRemote>(nullptr, file_size, file_name);
+			requested_file->file_path = user_file_path + "\\" + file_name;
+			requested_file->partial_path = user_file_path + "\\" + File::PartialFileName(file_name, file_size, file_time);
+			requested_file->file_time = file_time;
 
-			//creating copy of the remote file on client's machine
-			m_requested_files.insert({ 
-				m_req_files_counter,
-				std::make_shared<File::FileRemote>(std::move(file_dest), m_file_details[next_item]->file_size, file_name)
-			});
+			//a partial copy left by an interrupted download of the same file is continued
+			uint64_t start_offset = File::ResumeOffset(requested_file->partial_path, file_size);
+
+			client.Downloads().Expect(m_req_files_counter, requested_file->partial_path, false);
+			m_requested_files.insert({ m_req_files_counter, std::move(requested_file) });
 
 			temp_request.InsertTrivialToBuffer(m_req_files_counter);
 			temp_request.InsertStringToBuffer(file_name);
+			temp_request.InsertTrivialToBuffer(start_offset, file_size, file_time, range_length);
 
 			m_req_files_counter++;
+			whole_files_requested = true;
 		}
 
-		FtpClientWin::SendRequest(temp_request, ftp_connection::conn_type::control);
+		if (whole_files_requested)
+			FtpClientWin::SendRequest(std::move(temp_request), ftp_connection::conn_type::control);
 	}
 }
 
@@ -505,11 +735,12 @@ void FtpClientWin::RemoveSelectedFiles()
 		{
 			//for each selected item, we insert its name into the ftp_request.
 
-			temp_request.InsertStringToBuffer(m_file_details[next_item]->file_name);
+			auto file_name = m_server_files_list->FileAt(next_item).file_name;
+			temp_request.InsertStringToBuffer(file_name);
 
 		}
 
-		FtpClientWin::SendRequest(temp_request, ftp_connection::conn_type::control);
+		FtpClientWin::SendRequest(std::move(temp_request), ftp_connection::conn_type::control);
 	}
 }
 
@@ -523,29 +754,259 @@ void FtpClientWin::UploadFile()
 	auto file_name = m_send_file_picker->GetFileName().GetFullName().ToStdString();
 
 	auto file_size = std::filesystem::file_size(user_file_path);
+	int64_t file_time = File::FileTime(user_file_path);
 
 	temp_request.InsertStringToBuffer(user_server_directory);
 	temp_request.InsertStringToBuffer(file_name);
-	temp_request.InsertTrivialToBuffer(file_size);
+	temp_request.InsertTrivialToBuffer(file_size, file_time);
 	
 
 	std::shared_ptr<std::ifstream> file_src =
 		std::make_shared<std::ifstream>(user_file_path, std::ios::binary);
 
+	const bool on_server = m_server_files_list->Contains(file_name, File::file_type::FILE);
 
-	//setting the id to -1 -> waiting for server response to assign the id on the server side.
-	//while id is -1, file remains unaccepted
+	//the server answers with signatures of its copy, the upload thread then sends the delta against them
+	if (DELTA_UPLOADS && on_server && file_size >= MIN_DELTA_UPLOAD_SIZE)
+	{
+		temp_request.header.operation = ftp_request_header::ftp_operation::UPLOAD_DELTA;
 
-	m_files_to_transfer_unaccepted.emplace_back(
-		std::make_shared<File::FileLocal>(std::move(file_src), file_size, -1)
-	);
+		const auto client_file_id = m_delta_uploads_counter++;
+		temp_request.InsertTrivialToBuffer(client_file_id);
+
+		m_delta_uploads_unsigned[client_file_id] = { std::make_shared<File::FileLocal>(std::move(file_src), file_size, -1), user_file_path };
+
+		FtpClientWin::DisplayLog("[INFO]: " + file_name + " is on the server, sending only the blocks that changed.", wxColour(128, 128, 128));
+		FtpClientWin::SendRequest(std::move(temp_request), ftp_connection::conn_type::control);
+		return;
+	}
+
+	//the request is sent by the hashing thread once it has chunked the file
+	if (DEDUP_UPLOADS && file_size >= MIN_DEDUP_UPLOAD_SIZE)
+	{
+		temp_request.header.operation = ftp_request_header::ftp_operation::UPLOAD_DEDUP;
+
+		const auto client_file_id = m_uploads_counter++;
+		temp_request.InsertTrivialToBuffer(client_file_id);
+
+		{
+			std::lock_guard<std::mutex> hashing_lock(m_hashing_mutex);
+			m_dedup_uploads_to_chunk.push_back({ std::make_shared<File::FileLocal>(std::move(file_src), file_size, client_file_id),
+				user_file_path, std::move(temp_request) });
+		}
 
+		m_hashing_cond.notify_all();
 
-	FtpClientWin::SendRequest(temp_request, ftp_connection::conn_type::control);
+		FtpClientWin::DisplayLog("[INFO]: Chunking " + file_name + " to send only the chunks the server is missing.", wxColour(128, 128, 128));
+		return;
+	}
+
+
+	//the file keeps the id sent with the request until the server's response assigns the id on the server side.
+
+	const auto client_file_id = m_uploads_counter++;
+	temp_request.InsertTrivialToBuffer(client_file_id);
+
+	m_files_to_transfer_unaccepted[client_file_id] =
+		std::make_shared<File::FileLocal>(std::move(file_src), file_size, client_file_id);
+
+
+	FtpClientWin::SendRequest(std::move(temp_request), ftp_connection::conn_type::control);
 }
 
 
 
+//Splits the file into one range per data connection and requests every range separately,
+//so each is verified on, and sent over, its own connection.
+void FtpClientWin::RequestSegmentedDownload(const File::FileDetails& file_details, const std::string& user_file_path)
+{
+	const auto segment_count = client.DataStreamCount();
+	std::string file_name = file_details.file_name;
+	uint64_t file_size = file_details.file_size;
+	int64_t file_time = file_details.file_time;
+
+	auto requested_file = std::make_shared<File::FileRemote>(nullptr, file_size, file_name);
+	requested_file->file_path = user_file_path + "\\" + file_name;
+	//not resumable, the preallocated copy is always as large as the whole file
+	requested_file->partial_path = user_file_path + "\\" + File::PartialFileName(file_name + ".segmented", file_size, file_time);
+	requested_file->file_time = file_time;
+
+	std::error_code ec;
+	std::ofstream(requested_file->partial_path, std::ios::binary | std::ios::trunc).close();
+	std::filesystem::resize_file(requested_file->partial_path, file_size, ec);
+
+	if (ec)
+	{
+		FtpClientWin::DisplayLog("[INFO]: Could not create file: " + requested_file->partial_path, wxColour(255, 0, 0));
+		return;
+	}
+
+	const auto segment_size = (file_size + segment_count - 1) / segment_count;
+
+	for (std::size_t segment = 0; segment < segment_count && segment * segment_size < file_size; ++segment)
+	{
+		uint64_t start_offset = segment * segment_size;
+		uint64_t range_length = std::min<uint64_t>(segment_size, file_size - start_offset);
+
+		//every segment is written into the preallocated file from its own start by the download sink
+		client.Downloads().Expect(m_req_files_counter, requested_file->partial_path, true);
+		m_requested_files.insert({ m_req_files_counter, requested_file });
+		m_requested_segments.insert({ static_cast<unsigned int>(m_req_files_counter), { start_offset, range_length, start_offset, segment } });
+
+		ftp_request segment_request;
+		segment_request.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FILE;
+		segment_request.InsertStringToBuffer(user_server_directory);
+		segment_request.InsertTrivialToBuffer(m_req_files_counter);
+		segment_request.InsertStringToBuffer(file_name);
+		segment_request.InsertTrivialToBuffer(start_offset, file_size, file_time, range_length);
+
+		client.SendControlRequest(std::move(segment_request), segment);
+
+		m_req_files_counter++;
+	}
+
+	FtpClientWin::DisplayLog("Downloading file: " + file_name + " in " + std::to_string(segment_count) + " segments",
+		wxColour(255, 128, 0));
+}
+
+void FtpClientWin::FinishDownload(unsigned int file_id)
+{
+	const auto finished_file = m_requested_files[file_id];
+
+	//the digests only cover the ranges received under each id, not what is between or after them
+	std::error_code ec;
+	if (std::filesystem::file_size(finished_file->partial_path, ec) != finished_file->file_size || ec)
+	{
+		FtpClientWin::FailDownload(file_id, "the saved copy does not have the size of the file on the server");
+		return;
+	}
+
+	if (File::CompletePartialFile(*finished_file))
+		FtpClientWin::DisplayLog(
+			"[INFO]: File: " + finished_file->file_name + " successfully saved!", 
+			wxColour(0, 204, 0));
+
+	else
+		FtpClientWin::DisplayLog(
+			"[INFO]: File: " + finished_file->file_name + " downloaded, but could not be moved in place!",
+			wxColour(255, 0, 0));
+
+	FtpClientWin::ForgetDownload(finished_file);
+}
+
+//Every id of a download gets its own DOWNLOAD_FINISHED, the file is complete once the last of them matched.
+void FtpClientWin::CompleteDownloadRange(unsigned int file_id, uint64_t file_digest, uint64_t received_digest)
+{
+	const auto requested_file = m_requested_files[file_id];
+
+	if (received_digest != file_digest)
+	{
+		FtpClientWin::FailDownload(file_id, "the received bytes don't match the file on the server");
+		return;
+	}
+
+	const auto file_ids = std::count_if(m_requested_files.cbegin(), m_requested_files.cend(),
+		[&requested_file](const auto& entry)
+		{
+			return entry.second == requested_file;
+		});
+
+	if (file_ids > 1)
+	{
+		//other segments of the file are still on their way
+		m_requested_files.erase(file_id);
+		m_requested_segments.erase(file_id);
+	}
+
+	else if (requested_file->remaining_bytes <= 0)
+		FtpClientWin::FinishDownload(file_id);
+
+	else
+		FtpClientWin::FailDownload(file_id, "the server sent less than the whole file");
+}
+
+//Requests the chunk that arrived corrupted, and the rest of its range, under a new id.
+//Chunks still arriving for the old id are ignored.
+void FtpClientWin::RetryDownloadFrom(unsigned int file_id, uint64_t chunk_offset)
+{
+	const auto requested_file = m_requested_files[file_id];
+
+	if (++m_chunk_retries[requested_file] > MAX_CHUNK_RETRIES)
+	{
+		FtpClientWin::FailDownload(file_id, "too many corrupted chunks");
+		return;
+	}
+
+	FtpClientWin::DisplayLog("Chunk at byte " + std::to_string(chunk_offset) + " of: " + requested_file->file_name
+		+ " arrived corrupted, requesting it again", wxColour(255, 128, 0));
+
+	std::string file_name = requested_file->file_name;
+	uint64_t file_size = requested_file->file_size;
+	int64_t file_time = requested_file->file_time;
+	uint64_t start_offset = chunk_offset;
+	//a whole file is resumed from the end of the partial copy, which is where the corrupt chunk starts
+	uint64_t range_length = 0;
+	std::size_t data_stream = 0;
+
+	if (const auto segment_it = m_requested_segments.find(file_id); segment_it != m_requested_segments.end())
+	{
+		const auto& segment = segment_it->second;
+		range_length = segment.start_offset + segment.length - chunk_offset;
+		data_stream = segment.data_stream;
+
+		m_requested_segments.insert({ static_cast<unsigned int>(m_req_files_counter), { chunk_offset, range_length, chunk_offset, data_stream } });
+	}
+
+	//the download sink forgot the old id on the corrupt chunk and closed its copy behind the bytes before it,
+	//a whole file is then reopened in append mode from there on DOWNLOAD_START
+	client.Downloads().Forget(file_id);
+	client.Downloads().Expect(m_req_files_counter, requested_file->partial_path, range_length > 0);
+
+	m_requested_files.erase(file_id);
+	m_requested_segments.erase(file_id);
+	m_requested_files.insert({ m_req_files_counter, requested_file });
+
+	ftp_request retry_request;
+	retry_request.header.operation = ftp_request_header::ftp_operation::DOWNLOAD_FILE;
+	retry_request.InsertStringToBuffer(user_server_directory);
+	retry_request.InsertTrivialToBuffer(m_req_files_counter);
+	retry_request.InsertStringToBuffer(file_name);
+	retry_request.InsertTrivialToBuffer(start_offset, file_size, file_time, range_length);
+
+	client.SendControlRequest(std::move(retry_request), data_stream);
+
+	m_req_files_counter++;
+}
+
+void FtpClientWin::FailDownload(unsigned int file_id, const std::string& reason)
+{
+	const auto failed_file = m_requested_files[file_id];
+
+	FtpClientWin::DisplayLog("[INFO]: Download of: " + failed_file->file_name + " failed, " + reason, wxColour(255, 0, 0));
+
+	//removed once the download sink has closed it
+	FtpClientWin::ForgetDownload(failed_file);
+	client.Downloads().Discard(failed_file->partial_path);
+}
+
+//Drops every id of the file, a segmented download has one per segment.
+void FtpClientWin::ForgetDownload(const std::shared_ptr<File::FileRemote>& file)
+{
+	for (auto file_it = m_requested_files.begin(); file_it != m_requested_files.end();)
+	{
+		if (file_it->second == file)
+		{
+			client.Downloads().Forget(file_it->first);
+			m_requested_segments.erase(file_it->first);
+			file_it = m_requested_files.erase(file_it);
+		}
+		else
+			++file_it;
+	}
+
+	m_chunk_retries.erase(file);
+}
+
 void FtpClientWin::SendFileBytes()
 {
 	while (running)
@@ -557,30 +1018,87 @@ void FtpClientWin::SendFileBytes()
 
 		m_upload_request_cond.wait(check_for_upload_lock, [this]() -> bool
 			{
-				return quit_uploading || (!m_files_to_transfer_accepted.empty() || !m_files_to_transfer_queued.empty());
+				return quit_uploading
+					|| (m_data_stream_writable && (!m_files_to_transfer_accepted.empty() || !m_files_to_transfer_queued.empty()));
 			});
 
 		if (quit_uploading)
 			return;
 
-		Sleep(100);
+		check_for_upload_lock.unlock();
+
+		//nothing can be sent anymore, waiting for the data stream to become writable would either spin or never end
+		if (!client.IsDataStreamConnected())
+		{
+			FtpClientWin::FailPendingUploads();
+			continue;
+		}
+
 		for (auto& curr_file : m_files_to_transfer_accepted)
 		{
+			//data connection is full, chunks are produced again once it drains
+			if (!client.IsDataStreamWritable())
+				break;
+
 			ftp_request file_bytes_response;
 			file_bytes_response.header.operation = ftp_request_header::ftp_operation::UPLOAD_DATA;
-			std::vector<char> buffer(std::min(MAX_BANDWIDTH, curr_file->remaining_bytes));
+			auto chunk_size = std::min<std::size_t>(UPLOAD_CHUNK_SIZE, curr_file->remaining_bytes);
 
-			file_bytes_response.InsertTrivialToBuffer(curr_file->client_file_id);
+			//deduplicated uploads only send the ranges of the chunks the server is missing
+			if (!curr_file->send_ranges.empty())
+			{
+				auto& send_range = curr_file->send_ranges.front();
+				chunk_size = std::min<std::size_t>(chunk_size, send_range.second);
+				curr_file->file_src->seekg(send_range.first);
 
-			curr_file->file_src->read(buffer.data(), buffer.size());
+				send_range.first += chunk_size;
+				send_range.second -= chunk_size;
 
-			curr_file->remaining_bytes -= buffer.size();
+				if (send_range.second == 0)
+					curr_file->send_ranges.pop_front();
+			}
 
-			file_bytes_response.CopyFromVector(buffer);
+			file_bytes_response.InsertTrivialToBuffer(curr_file->client_file_id);
+
+			const auto chunk_bytes = file_bytes_response.InsertChunkFromStream(*curr_file->file_src, chunk_size);
+			curr_file->digest.Update(chunk_bytes.data(), chunk_bytes.size());
+			file_bytes_response.Compress(client.DataStreamCompression());
+
+			curr_file->remaining_bytes -= chunk_size;
 
 
 			//client.SendDataRequest(file_bytes_response);
-			FtpClientWin::SendRequest(file_bytes_response, ftp_connection::conn_type::data);
+			FtpClientWin::SendRequest(std::move(file_bytes_response), ftp_connection::conn_type::data);
+
+			//the server keeps the file only if its digest of the received bytes matches ours
+			if (curr_file->remaining_bytes <= 0)
+			{
+				ftp_request upload_finished_request;
+				upload_finished_request.header.operation = ftp_request_header::ftp_operation::UPLOAD_FINISHED;
+
+				auto file_digest = curr_file->digest.Value();
+				upload_finished_request.InsertTrivialToBuffer(curr_file->client_file_id, file_digest);
+
+				FtpClientWin::SendRequest(std::move(upload_finished_request), ftp_connection::conn_type::data);
+			}
+		}
+
+		if (!client.IsDataStreamWritable())
+		{
+			check_for_upload_lock.lock();
+			m_data_stream_writable = false;
+			check_for_upload_lock.unlock();
+
+			client.NotifyWhenDataStreamWritable(
+				[this]() -> void
+				{
+					{
+						std::unique_lock<std::mutex> lock(m_upload_request_mutex);
+						m_data_stream_writable = true;
+					}
+
+					m_upload_request_cond.notify_one();
+				});
 		}
 
 		if (!m_files_to_transfer_accepted.empty())
@@ -597,6 +1115,20 @@ void FtpClientWin::SendFileBytes()
 
 		m_file_upload_mutex.lock();
 
+		if (!m_cancelled_uploads.empty())
+		{
+			m_files_to_transfer_accepted.erase(
+				std::remove_if(m_files_to_transfer_accepted.begin(), m_files_to_transfer_accepted.end(),
+					[this](std::shared_ptr<File::FileLocal> const entry)
+					{
+						return std::find(m_cancelled_uploads.cbegin(), m_cancelled_uploads.cend(), entry->client_file_id) != m_cancelled_uploads.cend();
+					}),
+				m_files_to_transfer_accepted.end()
+						);
+
+			m_cancelled_uploads.clear();
+		}
+
 		for (auto& pending_file : m_files_to_transfer_queued)
 		{
 			m_files_to_transfer_accepted.push_back(std::move(pending_file));
@@ -620,23 +1152,163 @@ void FtpClientWin::SendFileBytes()
 
 }
  
-void FtpClientWin::SendRequest(ftp_request& new_request, ftp_connection::conn_type conn_type)
+//Chunks and hashes the files of dedup and delta uploads, one at a time, until the window is closed.
+void FtpClientWin::HashUploads()
+{
+	while (running)
+	{
+		std::unique_lock<std::mutex> hashing_lock(m_hashing_mutex);
+
+		m_hashing_cond.wait(hashing_lock, [this]() -> bool
+			{
+				return quit_uploading || !m_dedup_uploads_to_chunk.empty() || !m_delta_uploads_to_compute.empty();
+			});
+
+		if (quit_uploading)
+			return;
+
+		std::deque<dedup_upload> uploads_to_chunk;
+		uploads_to_chunk.swap(m_dedup_uploads_to_chunk);
+
+		std::deque<delta_upload> uploads_to_compute;
+		uploads_to_compute.swap(m_delta_uploads_to_compute);
+
+		hashing_lock.unlock();
+
+		for (auto& upload : uploads_to_chunk)
+			FtpClientWin::ChunkDedupUpload(std::move(upload));
+
+		for (auto& upload : uploads_to_compute)
+			FtpClientWin::ComputeDeltaUpload(std::move(upload));
+	}
+}
+
+//Hashes every chunk of the file and sends the chunk list, the server answers with the chunks it is missing.
+//Runs on the hashing thread, as it reads the whole file.
+void FtpClientWin::ChunkDedupUpload(dedup_upload&& upload)
+{
+	std::ifstream chunk_src(upload.file_path, std::ios::binary);
+	upload.recipe = ftp_cdc::Split(chunk_src);
+
+	auto chunk_count = static_cast<uint32_t>(upload.recipe.size());
+	upload.request.InsertTrivialToBuffer(chunk_count);
+
+	for (auto& chunk : upload.recipe)
+		upload.request.InsertTrivialToBuffer(chunk.hash, chunk.length);
+
+	auto dedup_request = std::move(upload.request);
+
+	//the answer echoes the id the file was registered with, see UPLOAD_DEDUP in OnServerResponse
+	{
+		std::lock_guard<std::mutex> upload_lock(m_file_upload_mutex);
+		m_dedup_uploads_unaccepted[upload.file->client_file_id] = std::move(upload);
+	}
+
+	FtpClientWin::SendRequest(std::move(dedup_request), ftp_connection::conn_type::control);
+}
+
+//Sends the instructions of the delta against the server's copy, its literal ranges are then sent like a file.
+//Runs on the hashing thread, as it reads the whole file.
+void FtpClientWin::ComputeDeltaUpload(delta_upload&& upload)
+{
+	std::ifstream delta_src(upload.file_path, std::ios::binary);
+	const auto file_delta = ftp_delta::Compute(delta_src, upload.block_size, upload.signatures);
+
+	auto& upload_file = upload.file;
+
+	ftp_request instructions_request;
+	instructions_request.header.operation = ftp_request_header::ftp_operation::DELTA_INSTRUCTIONS;
+
+	auto file_digest = file_delta.file_digest;
+	auto instruction_count = static_cast<uint32_t>(file_delta.instructions.size());
+	instructions_request.InsertTrivialToBuffer(upload_file->client_file_id, file_digest, instruction_count);
+
+	upload_file->remaining_bytes = 0;
+	uint64_t file_offset = 0;
+
+	for (auto instruction : file_delta.instructions)
+	{
+		instructions_request.InsertTrivialToBuffer(instruction.source_block, instruction.length);
+
+		if (instruction.source_block == ftp_delta::LITERAL)
+		{
+			upload_file->send_ranges.emplace_back(file_offset, instruction.length);
+			upload_file->remaining_bytes += instruction.length;
+		}
+
+		file_offset += instruction.length;
+	}
+
+	FtpClientWin::SendRequest(std::move(instructions_request), ftp_connection::conn_type::data);
+
+	//only copies, the server has every block already
+	if (upload_file->remaining_bytes <= 0)
+	{
+		ftp_request upload_finished_request;
+		upload_finished_request.header.operation = ftp_request_header::ftp_operation::UPLOAD_FINISHED;
+
+		auto literals_digest = upload_file->digest.Value();
+		upload_finished_request.InsertTrivialToBuffer(upload_file->client_file_id, literals_digest);
+
+		FtpClientWin::SendRequest(std::move(upload_finished_request), ftp_connection::conn_type::data);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> upload_lock(m_file_upload_mutex);
+		m_files_to_transfer_queued.push_back(std::move(upload_file));
+	}
+
+	m_upload_request_cond.notify_all();
+}
+
+void FtpClientWin::SendRequest(ftp_request&& new_request, ftp_connection::conn_type conn_type)
 {
 
 	switch (conn_type)
 	{
 
 	case ftp_connection::conn_type::control:
-		client.SendControlRequest(new_request);
+		client.SendControlRequest(std::move(new_request));
 		break;
 	case ftp_connection::conn_type::data:
-		client.SendDataRequest(new_request);
+		client.SendDataRequest(std::move(new_request));
+		break;
+	default:
 		break;
 
 	}
 
 }
 
+void FtpClientWin::FailPendingUploads()
+{
+	std::vector<int> failed_files;
+
+	{
+		std::lock_guard<std::mutex> upload_lock(m_file_upload_mutex);
+
+		for (const auto& failed_file : m_files_to_transfer_accepted)
+			failed_files.push_back(failed_file->client_file_id);
+
+		for (const auto& failed_file : m_files_to_transfer_queued)
+			failed_files.push_back(failed_file->client_file_id);
+
+		m_files_to_transfer_accepted.clear();
+		m_files_to_transfer_queued.clear();
+		m_cancelled_uploads.clear();
+	}
+
+	if (failed_files.empty())
+		return;
+
+	CallAfter([this, failed_files = std::move(failed_files)]() -> void
+		{
+			for (const auto file_id : failed_files)
+				FtpClientWin::DisplayLog("[INFO]: Upload [" + std::to_string(file_id) + "] failed, the data connection is closed", wxColour(255, 0, 0));
+		});
+}
+
 void FtpClientWin::OnClose(wxCloseEvent& evt)
 {
 
@@ -649,11 +1321,20 @@ void FtpClientWin::OnClose(wxCloseEvent& evt)
 
 	m_upload_request_cond.notify_one();
 	m_upload_thread.join();
-	
-	m_request_thread->Wait();
+
+	//taking the lock orders quit_uploading before the hashing thread's next check of it
+	{
+		std::unique_lock<std::mutex> lock(m_hashing_mutex);
+	}
+
+	m_hashing_cond.notify_one();
+	m_hashing_thread.join();
 
 	client.ControlStreamDisconnect();
 	client.DataStreamDisconnect();
 
+	//no event is posted to the window once it is destroyed
+	client.NotifyOnResponses(nullptr);
+
 	Destroy();
 }
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include"../include/ServerFilesList.h"
+#include<algorithm>
+#include<cctype>
+
+ServerFilesList::ServerFilesList(wxWindow* parent, const std::map<File::file_type, int>& file_icons)
+	: wxListCtrl(parent, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxLC_REPORT | wxLC_VIRTUAL), m_file_icons(file_icons)
+{
+}
+
+void ServerFilesList::Reset(bool with_parent_entry)
+{
+	m_names.clear();
+	m_name_ends.clear();
+	m_sizes.clear();
+	m_times.clear();
+	m_types.clear();
+	m_sorted.clear();
+	m_rows.clear();
+	m_filter.clear();
+
+	m_parent_entry = with_parent_entry;
+
+	if (m_parent_entry)
+	{
+		ServerFilesList::AddFile("<----", 0, File::file_type::DIR, 0);
+		ServerFilesList::DisplayAddedFiles();
+	}
+
+	ServerFilesList::ShowReorderedRows();
+}
+
+void ServerFilesList::AddFile(const std::string& file_name, uint64_t file_size, File::file_type type, int64_t file_time)
+{
+	m_names += file_name;
+	m_name_ends.push_back(m_names.size());
+	m_sizes.push_back(file_size);
+	m_times.push_back(file_time);
+	m_types.push_back(type);
+}
+
+void ServerFilesList::DisplayAddedFiles()
+{
+	const auto first_added = m_sorted.size();
+
+	for (auto file = static_cast<uint32_t>(first_added); file < m_types.size(); ++file)
+		m_sorted.push_back(file);
+
+	//files listed later can only go after the ones shown, the rows shown keep their place
+	if (m_sort_column == sort_column::NONE && !m_sort_descending)
+	{
+		std::copy_if(m_sorted.cbegin() + first_added, m_sorted.cend(), std::back_inserter(m_rows),
+			[this](uint32_t file) -> bool
+			{
+				return Matches(file);
+			});
+
+		SetItemCount(static_cast<long>(m_rows.size()));
+		Refresh();
+		return;
+	}
+
+	const auto compare = [this](uint32_t left, uint32_t right) -> bool
+	{
+		return Before(left, right);
+	};
+
+	std::sort(m_sorted.begin() + first_added, m_sorted.end(), compare);
+	std::inplace_merge(m_sorted.begin(), m_sorted.begin() + first_added, m_sorted.end(), compare);
+
+	ServerFilesList::FilterRows();
+	ServerFilesList::ShowReorderedRows();
+}
+
+void ServerFilesList::SortBy(sort_column column)
+{
+	m_sort_descending = column == m_sort_column ? !m_sort_descending : false;
+	m_sort_column = column;
+
+	std::sort(m_sorted.begin(), m_sorted.end(),
+		[this](uint32_t left, uint32_t right) -> bool
+		{
+			return Before(left, right);
+		});
+
+	ServerFilesList::FilterRows();
+	ServerFilesList::ShowReorderedRows();
+}
+
+void ServerFilesList::SetFilter(const std::string& filter)
+{
+	std::string lower_filter(filter);
+	std::transform(lower_filter.begin(), lower_filter.end(), lower_filter.begin(),
+		[](unsigned char c) -> char
+		{
+			return static_cast<char>(std::tolower(c));
+		});
+
+	if (lower_filter == m_filter)
+		return;
+
+	//names matching the new filter are among the ones matching the previous one
+	const bool narrowed = lower_filter.find(m_filter) != std::string::npos;
+	m_filter = std::move(lower_filter);
+
+	if (narrowed)
+	{
+		m_rows.erase(std::remove_if(m_rows.begin(), m_rows.end(),
+			[this](uint32_t file) -> bool
+			{
+				return !Matches(file);
+			}), m_rows.end());
+	}
+
+	else
+	{
+		ServerFilesList::FilterRows();
+	}
+
+	ServerFilesList::ShowReorderedRows();
+}
+
+File::FileDetails ServerFilesList::FileAt(long row) const
+{
+	const auto file = m_rows[row];
+	std::string file_name(Name(file));
+
+	return File::FileDetails(file_name, static_cast<std::size_t>(m_sizes[file]), m_types[file], m_times[file]);
+}
+
+bool ServerFilesList::IsParentEntry(long row) const
+{
+	return m_parent_entry && m_rows[row] == 0;
+}
+
+bool ServerFilesList::Contains(const std::string& file_name, File::file_type type) const
+{
+	for (uint32_t file = m_parent_entry ? 1 : 0; file < m_types.size(); ++file)
+	{
+		if (m_types[file] == type && Name(file) == file_name)
+			return true;
+	}
+
+	return false;
+}
+
+wxString ServerFilesList::OnGetItemText(long row, long column) const
+{
+	const auto file = m_rows[row];
+
+	if (column == 0)
+		return std::string(Name(file));
+
+	return std::to_string(m_sizes[file]);
+}
+
+int ServerFilesList::OnGetItemImage(long row) const
+{
+	return m_file_icons.at(m_types[m_rows[row]]);
+}
+
+std::string_view ServerFilesList::Name(uint32_t file) const
+{
+	const auto name_start = file == 0 ? 0 : m_name_ends[file - 1];
+	return std::string_view(m_names).substr(name_start, m_name_ends[file] - name_start);
+}
+
+bool ServerFilesList::Before(uint32_t left, uint32_t right) const
+{
+	if (m_parent_entry && (left == 0 || right == 0))
+		return left == 0 && right != 0;
+
+	if (m_sort_descending)
+		std::swap(left, right);
+
+	switch (m_sort_column)
+	{
+	case sort_column::NAME:
+		return Name(left) != Name(right) ? Name(left) < Name(right) : left < right;
+
+	case sort_column::SIZE:
+		return m_sizes[left] != m_sizes[right] ? m_sizes[left] < m_sizes[right] : Name(left) < Name(right);
+
+	default:
+		return left < right;
+	}
+}
+
+bool ServerFilesList::Matches(uint32_t file) const
+{
+	if (m_filter.empty() || (m_parent_entry && file == 0))
+		return true;
+
+	const auto file_name = Name(file);
+
+	return std::search(file_name.cbegin(), file_name.cend(), m_filter.cbegin(), m_filter.cend(),
+		[](char name_char, char filter_char) -> bool
+		{
+			return std::tolower(static_cast<unsigned char>(name_char)) == filter_char;
+		}) != file_name.cend();
+}
+
+void ServerFilesList::FilterRows()
+{
+	m_rows.clear();
+
+	std::copy_if(m_sorted.cbegin(), m_sorted.cend(), std::back_inserter(m_rows),
+		[this](uint32_t file) -> bool
+		{
+			return Matches(file);
+		});
+}
+
+void ServerFilesList::ShowReorderedRows()
+{
+	SetItemState(-1, 0, wxLIST_STATE_SELECTED);
+	SetItemCount(static_cast<long>(m_rows.size()));
+	Refresh();
+}
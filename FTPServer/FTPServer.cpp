@@ -7,15 +7,32 @@
 #define ASIO_STANDALONE
 #include"../FPTProject/include/ftpserver.h"
 
-int main()
+int main(int argc, char* argv[])
 {
     ftp_server server(60000);
 
-    server.Start();
-    while(true)
+    //download shares of clients by address, ex. "FTPServer 192.168.56.101=2" gives that client twice the share of the others
+    for (int i = 1; i < argc; ++i)
     {
-        
-        server.CheckForRequests();
+        const std::string client_weight = argv[i];
+        const auto separator = client_weight.find('=');
+
+        asio::error_code ec;
+        const auto client_address = asio::ip::make_address_v4(client_weight.substr(0, separator), ec);
+
+        if (separator == std::string::npos || ec)
+        {
+            std::cout << "Ignoring argument: " << client_weight << ", expected <client address>=<weight>\n";
+            continue;
+        }
+
+        const auto weight = static_cast<unsigned int>(std::strtoul(client_weight.c_str() + separator + 1, nullptr, 10));
+        server.SetClientWeight(client_address.to_ulong(), weight);
     }
+
+    server.Start();
+
+    //returns only when the server is stopped
+    server.CheckForRequests();
 }
 